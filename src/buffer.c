@@ -3,8 +3,7 @@
  */
 
 #include <sys/types.h>
-#include <sys/queue.h>
-#include <sys/tree.h>
+#include <sys/uio.h>
 
 #include <err.h>
 #include <errno.h>
@@ -15,145 +14,197 @@
 
 #include "workerd.h"
 
-/* buffers */
+/* buffers are ropes of fixed size segments, so appending
+ * never copies what's already there and the send path can
+ * hand the segments straight to writev. retired segments
+ * are kept in a small pool since messages come and go a lot
+ */
+
+#define BUFFER_SEGSIZE		4096
+#define BUFFER_POOLMAX		256
+
+#define BUFFER_SEGCOUNT(N)	(((N) + BUFFER_SEGSIZE - 1) / BUFFER_SEGSIZE)
 
 struct buffer {
-	char	*buf;
-	ssize_t	 offset;
-	ssize_t	 capacity;
-	ssize_t	 eof;
+	char	**segs;
+	size_t	  nsegs;
+	size_t	  segslots;
+
+	ssize_t	  offset;
+	ssize_t	  eof;
 };
 
 static struct buffer	*buffer_new(void);
-static int		 buffer_accomodate(struct buffer *b, ssize_t count);
+static void		 buffer_free(struct buffer *);
 
-/* buffer lookup structure */
+static int		 buffer_accomodate(struct buffer *, size_t);
+static void		 buffer_shrink(struct buffer *, size_t);
+static void		 buffer_zero(struct buffer *, size_t, size_t);
+static ssize_t		 buffer_append(struct buffer *, const void *, size_t);
 
-SLIST_HEAD(bufferlist, bufferdesc);
-RB_HEAD(buffertree, bufferdesc);
+static char		*segment_get(void);
+static void		 segment_put(char *);
 
-struct bufferdesc {
-	int		 descriptor;
-	struct buffer	*backing;
+static char		*segmentpool[BUFFER_POOLMAX];
+static size_t		 segmentpooled = 0;
 
-	SLIST_ENTRY(bufferdesc)	freelist_entries;
-	RB_ENTRY(bufferdesc)	inuse_entries;
-};
+/* buffer lookup structure. descriptors are slot map
+ * handles, so a stale one gets EBADF instead of whatever
+ * buffer happens to live there now
+ */
 
-static struct bufferdesc 	*bufferdesc_new(struct buffer *);
-static void			 bufferdesc_markfree(struct bufferdesc *);
+static struct buffer	*buffer_forkey(int);
 
-static struct bufferdesc	*bufferdesc_bufferforkey(int);
-static int			 bufferdesc_compare(struct bufferdesc *, struct bufferdesc *);
+static struct slotmap	*allbuffers = NULL;
 
+static struct buffer *
+buffer_forkey(int key)
+{
+	struct buffer	*res = NULL;
 
-RB_PROTOTYPE_STATIC(buffertree, bufferdesc, inuse_entries, bufferdesc_compare)
+	if (allbuffers != NULL && key >= 0)
+		res = slotmap_get(allbuffers, (uint32_t)key);
 
-static struct buffertree	 bufferdesc_inuse = RB_INITIALIZER(&bufferdesc_inuse);
+	if (res == NULL) errno = EBADF;
+	return res;
+}
 
 
-static struct bufferlist	 bufferdesc_freelist = SLIST_HEAD_INITIALIZER(bufferdesc_freelist);
-static int			 bufferdesc_firstfreedescriptor = 0;
+static char *
+segment_get(void)
+{
+	if (segmentpooled > 0)
+		return segmentpool[--segmentpooled];
 
+	return malloc(BUFFER_SEGSIZE);
+}
 
-RB_GENERATE_STATIC(buffertree, bufferdesc, inuse_entries, bufferdesc_compare)
+static void
+segment_put(char *seg)
+{
+	if (segmentpooled < BUFFER_POOLMAX)
+		segmentpool[segmentpooled++] = seg;
+	else free(seg);
+}
+
+static struct buffer *
+buffer_new(void)
+{
+	return calloc(1, sizeof(struct buffer));
+}
+
+static void
+buffer_free(struct buffer *b)
+{
+	buffer_shrink(b, 0);
+
+	free(b->segs);
+	free(b);
+}
 
-static struct bufferdesc *
-bufferdesc_new(struct buffer *b)
+/* make sure count bytes are backed by segments. the
+ * segment table grows geometrically, segments themselves
+ * are handed out as is - whoever exposes them zeroes them
+ */
+static int
+buffer_accomodate(struct buffer *b, size_t count)
 {
-	struct bufferdesc	*out = NULL;
+	char	**newsegs;
+	size_t	  needsegs, newslots;
+
+	needsegs = BUFFER_SEGCOUNT(count);
+	if (needsegs <= b->nsegs) return 0;
 
-	if (SLIST_EMPTY(&bufferdesc_freelist)) {
-		out = malloc(sizeof(struct bufferdesc));	
-		if (out == NULL) goto end;
+	if (needsegs > b->segslots) {
+		newslots = (b->segslots > 0) ? b->segslots : 1;
+		while (newslots < needsegs) newslots *= 2;
 
-		out->descriptor = bufferdesc_firstfreedescriptor++;
+		newsegs = reallocarray(b->segs, newslots, sizeof(char *));
+		if (newsegs == NULL) return -1;
 
-	} else {
-		out = SLIST_FIRST(&bufferdesc_freelist);
-		SLIST_REMOVE_HEAD(&bufferdesc_freelist, freelist_entries);
+		b->segs = newsegs;
+		b->segslots = newslots;
 	}
 
-	out->backing = b;
+	for (; b->nsegs < needsegs; b->nsegs++)
+		if ((b->segs[b->nsegs] = segment_get()) == NULL)
+			return -1;
 
-	RB_INSERT(buffertree, &bufferdesc_inuse, out);
-end:
-	return out;
+	return 0;
 }
 
+/* give back every segment not needed to hold count bytes */
 static void
-bufferdesc_markfree(struct bufferdesc *bd)
+buffer_shrink(struct buffer *b, size_t count)
 {
-	bd->backing = NULL;
+	size_t	keepsegs;
+
+	keepsegs = BUFFER_SEGCOUNT(count);
 
-	RB_REMOVE(buffertree, &bufferdesc_inuse, bd);
-	SLIST_INSERT_HEAD(&bufferdesc_freelist, bd, freelist_entries);
+	while (b->nsegs > keepsegs)
+		segment_put(b->segs[--b->nsegs]);
 }
 
-static struct bufferdesc *
-bufferdesc_bufferforkey(int key)
+static void
+buffer_zero(struct buffer *b, size_t from, size_t to)
 {
-	struct bufferdesc	find, *res = NULL;
+	size_t	span;
 
-	find.descriptor = key;
-	res = RB_FIND(buffertree, &bufferdesc_inuse, &find);
+	while (from < to) {
+		span = BUFFER_SEGSIZE - from % BUFFER_SEGSIZE;
+		if (span > to - from) span = to - from;
 
-	if (res == NULL) errno = EBADF;
-	return res;
+		memset(b->segs[from / BUFFER_SEGSIZE] + from % BUFFER_SEGSIZE, 0, span);
+		from += span;
+	}
 }
 
-static int
-bufferdesc_compare(struct bufferdesc *a, struct bufferdesc *b)
+static ssize_t
+buffer_append(struct buffer *thisbuffer, const void *in, size_t count)
 {
-	int	 result = 0;
-
-	if (a->descriptor > b->descriptor) result = 1;
-	if (a->descriptor < b->descriptor) result = -1;
-
-	return result;
-}
+	ssize_t	 		 written = -1;
+	size_t 	 		 endoffset, at, span, done;
 
+	if (count > SSIZE_MAX) {
+		errno = EINVAL;
+		goto end;
+	}
 
-static struct buffer *
-buffer_new(void)
-{
-	struct buffer	*out = NULL;
-	char		*buf;
+	endoffset = thisbuffer->offset + count;
 
-	buf = recallocarray(NULL, 0, 1, sizeof(char));
-	if (buf == NULL) goto end;
+	if (endoffset > SSIZE_MAX) {
+		errno = EFBIG;
+		goto end;
 
-	out = malloc(sizeof(struct buffer));
-	if (out == NULL) {
-		free(buf);
+	} else if (buffer_accomodate(thisbuffer, endoffset) < 0)
 		goto end;
-	}
 
-	out->offset = 0;
-	out->eof = 0;
-	out->capacity = 1;
-	out->buf = buf;
-end:
-	return out;
-}
+	/* writing past the end exposes whatever was left
+	 * in the gap, which has to read back as zeroes
+	 */
+	if (thisbuffer->offset > thisbuffer->eof)
+		buffer_zero(thisbuffer, thisbuffer->eof, thisbuffer->offset);
 
-static int
-buffer_accomodate(struct buffer *b, ssize_t count)
-{
-	char	*newbuf;
-	int	 status = -1;
+	for (done = 0; done < count; done += span) {
+		at = thisbuffer->offset + done;
 
-	if (count <= b->capacity) return 0;
+		span = BUFFER_SEGSIZE - at % BUFFER_SEGSIZE;
+		if (span > count - done) span = count - done;
 
-	newbuf = recallocarray(b->buf, b->capacity, count, sizeof(char));
-	if (newbuf == NULL) goto end;
+		memcpy(thisbuffer->segs[at / BUFFER_SEGSIZE] + at % BUFFER_SEGSIZE,
+			(const char *)in + done, span);
+	}
 
-	b->buf = newbuf;
-	b->capacity = count;
+	/* like write(2), overwriting the middle leaves
+	 * whatever comes after it alone
+	 */
+	thisbuffer->offset += count;
+	if (thisbuffer->offset > thisbuffer->eof)
+		thisbuffer->eof = thisbuffer->offset;
 
-	status = 0;
+	written = count;
 end:
-	return status;
+	return written;
 }
 
 
@@ -161,19 +212,22 @@ int
 buffer_open(void)
 {
 	struct buffer		*newbuffer = NULL;
-	struct bufferdesc	*newdescriptor = NULL;
+	uint32_t		 handle;
 	int			 nfd = -1;
 
+	if (allbuffers == NULL)
+		if ((allbuffers = slotmap_new()) == NULL)
+			goto end;
+
 	newbuffer = buffer_new();
 	if (newbuffer == NULL) goto end;
 
-	newdescriptor = bufferdesc_new(newbuffer);
-	if (newdescriptor == NULL) {
-		free(newbuffer);
+	if (slotmap_insert(allbuffers, newbuffer, &handle) < 0) {
+		buffer_free(newbuffer);
 		goto end;
 	}
 
-	nfd = newdescriptor->descriptor;
+	nfd = (int)handle;
 end:
 	return nfd;
 }
@@ -181,16 +235,14 @@ end:
 int
 buffer_close(int key)
 {
-	struct bufferdesc	*thisdesc;
+	struct buffer		*thisbuffer;
 	int			 status = -1;
 
-	thisdesc = bufferdesc_bufferforkey(key);
-	if (thisdesc == NULL) goto end;
-
-	free(thisdesc->backing->buf);
-	free(thisdesc->backing);
+	thisbuffer = buffer_forkey(key);
+	if (thisbuffer == NULL) goto end;
 
-	bufferdesc_markfree(thisdesc);
+	slotmap_remove(allbuffers, (uint32_t)key);
+	buffer_free(thisbuffer);
 
 	status = 0;
 end:
@@ -200,26 +252,34 @@ end:
 ssize_t
 buffer_read(int key, void *out, size_t count)
 {
-	struct bufferdesc	*thisdesc;
 	struct buffer		*thisbuffer;
 
 	ssize_t			 canread, shouldread, didread = -1;
+	size_t			 at, span, done;
 
 	if (count > SSIZE_MAX) {
 		errno = EINVAL;
 		goto end;
 	}
 
-	thisdesc = bufferdesc_bufferforkey(key);
-	if (thisdesc == NULL) goto end;
-	else thisbuffer = thisdesc->backing;
+	thisbuffer = buffer_forkey(key);
+	if (thisbuffer == NULL) goto end;
 
 	canread = thisbuffer->eof - thisbuffer->offset;
 	if (canread < 0) canread = 0;
 
 	shouldread = (count > (size_t)canread) ? canread : (ssize_t)count;
 
-	memcpy(out, thisbuffer->buf + thisbuffer->offset, shouldread);
+	for (done = 0; done < (size_t)shouldread; done += span) {
+		at = thisbuffer->offset + done;
+
+		span = BUFFER_SEGSIZE - at % BUFFER_SEGSIZE;
+		if (span > shouldread - done) span = shouldread - done;
+
+		memcpy((char *)out + done,
+			thisbuffer->segs[at / BUFFER_SEGSIZE] + at % BUFFER_SEGSIZE, span);
+	}
+
 	thisbuffer->offset += shouldread;
 
 	didread = shouldread;
@@ -230,37 +290,52 @@ end:
 ssize_t
 buffer_write(int key, const void *in, size_t count)
 {
-	struct bufferdesc	*thisdesc;
 	struct buffer		*thisbuffer;
 
-	ssize_t	 		 written = -1;
-	size_t 	 		 endoffset;
+	thisbuffer = buffer_forkey(key);
+	if (thisbuffer == NULL) return -1;
 
-	if (count > SSIZE_MAX) {
+	return buffer_append(thisbuffer, in, count);
+}
+
+ssize_t
+buffer_writev(int key, const struct iovec *iov, int iovcnt)
+{
+	struct buffer		*thisbuffer;
+
+	ssize_t			 written = -1;
+	size_t			 total = 0;
+	int			 i;
+
+	if (iovcnt < 0) {
 		errno = EINVAL;
 		goto end;
 	}
 
-	thisdesc = bufferdesc_bufferforkey(key);
-	if (thisdesc == NULL) goto end;
-	else thisbuffer = thisdesc->backing;
+	thisbuffer = buffer_forkey(key);
+	if (thisbuffer == NULL) goto end;
 
-	endoffset = thisbuffer->offset + count;
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > SSIZE_MAX - total) {
+			errno = EINVAL;
+			goto end;
+		}
 
-	if (endoffset > SSIZE_MAX) {
+		total += iov[i].iov_len;
+	}
+
+	/* one allocation up front, then plain copies */
+	if (thisbuffer->offset + total > SSIZE_MAX) {
 		errno = EFBIG;
 		goto end;
+	} else if (buffer_accomodate(thisbuffer, thisbuffer->offset + total) < 0)
+		goto end;
 
-	} else if (endoffset > (size_t)thisbuffer->capacity) {
-		if (buffer_accomodate(thisbuffer, endoffset) < 0)
+	for (i = 0; i < iovcnt; i++)
+		if (buffer_append(thisbuffer, iov[i].iov_base, iov[i].iov_len) < 0)
 			goto end;
-	}
-
-	memcpy(thisbuffer->buf + thisbuffer->offset, in, count);
 
-	thisbuffer->offset += count;
-	thisbuffer->eof = thisbuffer->offset;
-	written = count;
+	written = total;
 end:
 	return written;
 }
@@ -268,15 +343,11 @@ end:
 int
 buffer_truncate(int key, off_t length)
 {
-	struct bufferdesc	*thisdesc;
 	struct buffer		*thisbuffer;
+	int			 status = -1;
 
-	char	*newbuf;
-	int	 status = -1;
-
-	thisdesc = bufferdesc_bufferforkey(key);
-	if (thisdesc == NULL) goto end;
-	else thisbuffer = thisdesc->backing;
+	thisbuffer = buffer_forkey(key);
+	if (thisbuffer == NULL) goto end;
 
 	if (length < 0) {
 		errno = EINVAL;
@@ -286,19 +357,16 @@ buffer_truncate(int key, off_t length)
 		goto end;
 	}
 
-	if (thisbuffer->capacity >= (ssize_t)length) {
-		newbuf = recallocarray(thisbuffer->buf, thisbuffer->capacity,
-			length, sizeof(char));
-		if (newbuf == NULL) goto end;
-
-		thisbuffer->buf = newbuf;
-
-	} else {
+	if (length <= thisbuffer->eof)
+		buffer_shrink(thisbuffer, length);
+	else {
 		if (buffer_accomodate(thisbuffer, length) < 0)
 			goto end;
+
+		buffer_zero(thisbuffer, thisbuffer->eof, length);
 	}
 
-	thisbuffer->eof = thisbuffer->capacity = length;
+	thisbuffer->eof = length;
 	status = 0;
 end:
 	return status;
@@ -307,14 +375,12 @@ end:
 off_t
 buffer_seek(int key, off_t offset, int whence)
 {
-	struct bufferdesc	*thisdesc;
 	struct buffer		*thisbuffer;
 
 	off_t	 		 position, returnposition = -1;
 
-	thisdesc = bufferdesc_bufferforkey(key);
-	if (thisdesc == NULL) goto end;
-	else thisbuffer = thisdesc->backing;
+	thisbuffer = buffer_forkey(key);
+	if (thisbuffer == NULL) goto end;
 
 	switch (whence) {
 	case SEEK_SET:
@@ -331,10 +397,6 @@ buffer_seek(int key, off_t offset, int whence)
 		goto end;
 	}
 
-	if (position > thisbuffer->capacity)
-		if (buffer_accomodate(thisbuffer, position) < 0)
-			goto end;
-
 	if (position < 0) {
 		errno = EINVAL;
 		goto end;
@@ -345,3 +407,36 @@ buffer_seek(int key, off_t offset, int whence)
 end:
 	return returnposition;	
 }
+
+int
+buffer_getiov(int key, off_t offset, struct iovec *iov, int iovcnt)
+{
+	struct buffer		*thisbuffer;
+
+	size_t			 at, span;
+	int			 filled = -1;
+
+	if (offset < 0 || iovcnt < 1) {
+		errno = EINVAL;
+		goto end;
+	}
+
+	thisbuffer = buffer_forkey(key);
+	if (thisbuffer == NULL) goto end;
+
+	/* one entry per segment, as many as we were given room for */
+	for (filled = 0; filled < iovcnt && offset < thisbuffer->eof; filled++) {
+		at = (size_t)offset;
+
+		span = BUFFER_SEGSIZE - at % BUFFER_SEGSIZE;
+		if (span > (size_t)(thisbuffer->eof - offset))
+			span = thisbuffer->eof - offset;
+
+		iov[filled].iov_base = thisbuffer->segs[at / BUFFER_SEGSIZE] + at % BUFFER_SEGSIZE;
+		iov[filled].iov_len = span;
+
+		offset += span;
+	}
+end:
+	return filled;
+}
@@ -0,0 +1,262 @@
+/* workerd bundle cache
+ * keeps recently uploaded archives around under the hash
+ * of their sendfile message, so a client resubmitting one
+ * can name it instead of sending it all over again. entries
+ * are hard links to the upload's own spool file, so adding
+ * one copies nothing. see store.c for how they're kept
+ *
+ * chunks that clients upload against a manifest are kept
+ * the same way, so a bundle that changed only in places can
+ * be put back together from what we have plus the few chunks
+ * we don't. see NETOP_MANIFEST for how cuts are chosen
+ *
+ * (c) jay lang 2023
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <sha2.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "workerd.h"
+
+#define CACHE_READSIZE	65536
+
+static int		 cache_validhash(const char *);
+static void		 cache_storechunk(const char *, const void *, size_t);
+static void		 cache_makegear(void);
+static void		 cache_report(int, short, void *);
+
+static struct store	*bundles;
+static struct store	*chunks;
+
+static uint64_t		 gear[256];
+static int		 gearready = 0;
+
+static struct event	 reporttimer;
+
+static int
+cache_validhash(const char *hash)
+{
+	return strlen(hash) == SHA256_DIGEST_STRING_LENGTH - 1 &&
+	    strspn(hash, "0123456789abcdef") == SHA256_DIGEST_STRING_LENGTH - 1;
+}
+
+/* keep a chunk we know the hash of, unless we have it already */
+static void
+cache_storechunk(const char *hash, const void *bytes, size_t size)
+{
+	char	*path;
+	int	 fd;
+
+	if (store_touch(chunks, hash) == 0)
+		return;
+
+	path = store_path(chunks, hash);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+	if (fd < 0 || write(fd, bytes, size) != (ssize_t)size) {
+		log_write(LOGTYPE_WARN, "cache_storechunk: write %s", path);
+		unlink(path);
+	} else
+		store_add(chunks, hash, size);
+
+	if (fd >= 0) close(fd);
+	free(path);
+}
+
+/* the gear table is splitmix64 seeded with zero,
+ * so clients can work it out for themselves
+ */
+static void
+cache_makegear(void)
+{
+	uint64_t	state = 0, z;
+	int		i;
+
+	for (i = 0; i < 256; i++) {
+		z = (state += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+
+	gearready = 1;
+}
+
+static void
+cache_report(int fd, short event, void *arg)
+{
+	struct timeval	tv;
+
+	store_report(bundles, "bundle cache", "bytes not uploaded");
+	store_report(chunks, "chunk cache", "bytes not uploaded");
+
+	tv.tv_sec = CACHE_REPORTINTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&reporttimer, &tv);
+
+	(void)fd;
+	(void)event;
+	(void)arg;
+}
+
+void
+cache_init(void)
+{
+	if (!gearready) cache_makegear();
+
+	if ((bundles = store_new(FRONTEND_CACHE, CACHE_MAXENTRIES, CACHE_MAXBYTES)) == NULL)
+		log_fatal("cache_init: store_new");
+	else if ((chunks = store_new(FRONTEND_CHUNKS, CACHE_MAXCHUNKS, CACHE_MAXCHUNKBYTES)) == NULL)
+		log_fatal("cache_init: store_new");
+
+	evtimer_set(&reporttimer, cache_report, NULL);
+	cache_report(-1, EV_TIMEOUT, NULL);
+}
+
+/* hand back a descriptor for the archive behind hash,
+ * or -1 with errno set to ENOENT if we don't have it
+ */
+int
+cache_lookup(const char *hash)
+{
+	if (!cache_validhash(hash)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return store_open(bundles, hash, -1);
+}
+
+/* remember an uploaded archive. it stays with us
+ * after m itself is torn down and its spool file unlinked.
+ * its hash goes in hash, unless it couldn't be read
+ */
+int
+cache_insert(struct netmsg *m, char *hash)
+{
+	static uint8_t	 chunk[CACHE_READSIZE];
+	SHA2_CTX	 ctx;
+	const char	*spool;
+	char		*path = NULL;
+	off_t		 offset = 0;
+	ssize_t		 n;
+	int		 fd, status = -1;
+
+	if ((fd = netmsg_getfd(m)) < 0 || (spool = netmsg_getpath(m)) == NULL)
+		log_fatalx("cache_insert: not a disk message: %s", netmsg_error(m));
+
+	/* pread, since the descriptor shares its offset
+	 * with whoever else is reading the upload
+	 */
+	SHA256Init(&ctx);
+	while ((n = pread(fd, chunk, sizeof(chunk), offset)) > 0) {
+		SHA256Update(&ctx, chunk, n);
+		offset += n;
+	}
+
+	if (n < 0) {
+		log_write(LOGTYPE_WARN, "cache_insert: pread %s", spool);
+		goto end;
+	}
+
+	SHA256End(&ctx, hash);
+	status = 0;
+
+	/* seen it already, but it's fresh again now */
+	if (store_touch(bundles, hash) == 0)
+		goto end;
+
+	path = store_path(bundles, hash);
+	if (link(spool, path) < 0) {
+		log_write(LOGTYPE_WARN, "cache_insert: link %s", path);
+		goto end;
+	}
+
+	log_writex(LOGTYPE_DEBUG, "cached bundle %s (%lld bytes)", hash, (long long)offset);
+	store_add(bundles, hash, offset);
+end:
+	close(fd);
+	free(path);
+	return status;
+}
+
+/* where the chunk starting at bytes ends. len is how much
+ * follows, and only runs short of CHUNK_MAXSIZE at the end
+ * of the bundle, in which case the rest may be one chunk
+ */
+size_t
+cache_chunklen(const uint8_t *bytes, size_t len)
+{
+	uint64_t	h = 0;
+	size_t		i;
+
+	if (!gearready) cache_makegear();
+	if (len > CHUNK_MAXSIZE) len = CHUNK_MAXSIZE;
+
+	for (i = 0; i < len; i++) {
+		h = (h << 1) + gear[bytes[i]];
+
+		if (i + 1 >= CHUNK_MINSIZE && (h & CHUNK_MASK) == 0)
+			return i + 1;
+	}
+
+	return len;
+}
+
+/* copy a chunk we have into bytes, provided it's the
+ * size the client says it is. -1 with errno set to ENOENT
+ * means it needs uploading
+ */
+int
+cache_readchunk(const char *hash, void *bytes, size_t size)
+{
+	int	fd, status = -1;
+
+	if (!cache_validhash(hash)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((fd = store_open(chunks, hash, size)) < 0)
+		return -1;
+
+	if (read(fd, bytes, size) != (ssize_t)size) {
+		log_write(LOGTYPE_WARN, "cache_readchunk: read %s", hash);
+		store_remove(chunks, hash);
+		errno = ENOENT;
+	} else
+		status = 0;
+
+	close(fd);
+	return status;
+}
+
+/* take a chunk the client uploaded, which has to
+ * match its hash. -1 with errno set to EINVAL if not
+ */
+int
+cache_putchunk(const char *hash, const void *bytes, size_t size)
+{
+	char	actual[SHA256_DIGEST_STRING_LENGTH];
+
+	SHA256Data(bytes, size, actual);
+
+	if (strcmp(actual, hash) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	cache_storechunk(hash, bytes, size);
+	return 0;
+}
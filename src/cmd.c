@@ -0,0 +1,174 @@
+/* workerd child commands
+ * runs helper programs (i.e. vmctl) without waiting
+ * on them in the event loop. children are tracked in a
+ * small table and reaped off of SIGCHLD, at which point
+ * whoever started them gets called back with the exit status
+ *
+ * (c) jay lang 2023
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <event.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "workerd.h"
+
+#define CMD_MAXARGS	16
+
+struct cmd {
+	pid_t		 pid;
+
+	void		(*cb)(int, void *);
+	void		*arg;
+
+	LIST_ENTRY(cmd)	 entries;
+};
+
+LIST_HEAD(cmdlist, cmd);
+
+static void	cmd_complete(struct cmd *, int);
+static void	cmd_reap(int, short, void *);
+
+static struct cmdlist	running = LIST_HEAD_INITIALIZER(running);
+static struct event	sigchld;
+static int		initialized = 0;
+
+static void
+cmd_complete(struct cmd *c, int wstatus)
+{
+	LIST_REMOVE(c, entries);
+
+	if (WIFSIGNALED(wstatus))
+		log_fatalx("cmd_complete: child %d terminated by signal %d",
+			c->pid, WTERMSIG(wstatus));
+
+	/* the callback may well start more commands, so
+	 * it's only safe to call once we're off the list
+	 */
+	if (c->cb != NULL) c->cb(WEXITSTATUS(wstatus), c->arg);
+	free(c);
+}
+
+static void
+cmd_reap(int signal, short event, void *arg)
+{
+	struct cmd	*c;
+	pid_t		 pid;
+	int		 wstatus;
+
+	/* signals coalesce, so look at everybody. only wait
+	 * on our own children in case somebody else forks
+	 */
+again:
+	LIST_FOREACH(c, &running, entries) {
+		if ((pid = waitpid(c->pid, &wstatus, WNOHANG)) < 0)
+			log_fatal("cmd_reap: waitpid %d", c->pid);
+		else if (pid == 0)
+			continue;
+
+		cmd_complete(c, wstatus);
+		goto again;
+	}
+
+	(void)signal;
+	(void)event;
+	(void)arg;
+}
+
+void
+cmd_init(void)
+{
+	if (initialized) return;
+
+	signal_set(&sigchld, SIGCHLD, cmd_reap, NULL);
+	if (signal_add(&sigchld, NULL) < 0)
+		log_fatal("cmd_init: signal_add");
+
+	initialized = 1;
+}
+
+/* fork and exec path with the given NULL-terminated
+ * arguments; argv[0] is filled in for the caller. cb gets
+ * the exit status from the event loop once the child is gone
+ */
+int
+cmd_run(void (*cb)(int, void *), void *arg, const char *path, ...)
+{
+	struct cmd	*c;
+	char		*argv[CMD_MAXARGS + 1];
+	va_list		 ap;
+	int		 argc, status = -1;
+
+	if (!initialized)
+		log_fatalx("cmd_run: bug - cmd_init was never called");
+
+	argv[0] = (char *)path;
+	va_start(ap, path);
+
+	for (argc = 1; (argv[argc] = va_arg(ap, char *)) != NULL; argc++) {
+		if (argc == CMD_MAXARGS) {
+			errno = E2BIG;
+			goto end;
+		}
+	}
+
+	if ((c = calloc(1, sizeof(struct cmd))) == NULL)
+		goto end;
+
+	if ((c->pid = fork()) < 0) {
+		free(c);
+		goto end;
+
+	} else if (c->pid == 0) {
+		if (!debug) {
+			freopen("/dev/null", "a", stdout);
+			freopen("/dev/null", "a", stderr);
+		}
+
+		execv(path, argv);
+		log_fatal("cmd_run: execv %s", path);
+	}
+
+	c->cb = cb;
+	c->arg = arg;
+
+	LIST_INSERT_HEAD(&running, c, entries);
+	status = 0;
+end:
+	va_end(ap);
+	return status;
+}
+
+int
+cmd_pending(void)
+{
+	return !LIST_EMPTY(&running);
+}
+
+/* block until every child (including any started by
+ * callbacks along the way) has finished. only meant for
+ * shutdown, where there is no event loop left to wait in
+ */
+void
+cmd_drain(void)
+{
+	struct cmd	*c;
+	int		 wstatus;
+
+	while ((c = LIST_FIRST(&running)) != NULL) {
+		if (waitpid(c->pid, &wstatus, 0) < 0) {
+			if (errno == EINTR) continue;
+			log_fatal("cmd_drain: waitpid %d", c->pid);
+		}
+
+		cmd_complete(c, wstatus);
+	}
+}
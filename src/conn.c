@@ -5,7 +5,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
-#include <sys/tree.h>
+#include <sys/uio.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -15,14 +15,55 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <tls.h>
 #include <unistd.h>
 
 #include "workerd.h"
 
 #define CONN_LISTENBACKLOG	128
+
+/* each wakeup on the listener accepts up to CONN_ACCEPTBUDGET
+ * sockets. running out of descriptors parks the listener for
+ * CONN_ACCEPTPAUSE seconds rather than spinning on it. tls
+ * clients get CONN_HANDSHAKETIMEOUT seconds to finish their
+ * handshake, and only so many may be at it at once
+ */
+#define CONN_ACCEPTBUDGET	64
+#define CONN_ACCEPTPAUSE	1
+#define CONN_HANDSHAKETIMEOUT	5
+#define CONN_MAXHANDSHAKES	256
 #define CONN_MTU		1048576
 
+/* receive rings start small and only grow while a large message
+ * is in flight. each read event is capped so that one client
+ * streaming at line rate can't starve everyone else. while a
+ * message is still short, we keep reading before handing it
+ * what we have, so a big upload reaches its spool file in ring
+ * sized writes rather than one per tls record
+ */
+#define CONN_RXINITIAL		16384
+#define CONN_READBUDGET		(4 * CONN_MTU)
+
+/* sends come straight out of message storage. queued messages are
+ * gathered into one writev up to CONN_SENDBUDGET bytes, while tls
+ * coalesces small ones into a single record-sized write. tls writes
+ * are bounded so a large file doesn't get encrypted in one go
+ */
+#define CONN_SENDIOV		64
+#define CONN_SENDBUDGET		262144
+#define CONN_TLSCHUNK		65536
+
+/* reconnecting clients resume off a session ticket rather than
+ * redoing the whole handshake. ticket keys live only in memory
+ * and are replaced every CONN_TICKETROTATE seconds; libtls keeps
+ * a few old ones around so outstanding tickets stay good for
+ * about a session lifetime
+ */
+#define CONN_SESSIONLIFETIME	7200
+#define CONN_TICKETROTATE	(CONN_SESSIONLIFETIME / 4)
+#define CONN_REPORTINTERVAL	300
+
 struct globalcontext {
 	int			 mode;
 	uint8_t			*tls_key;	
@@ -31,15 +72,35 @@ struct globalcontext {
 	struct tls_config	*tls_globalcfg;
 	struct tls		*tls_serverctx;
 
+	uint32_t		 tls_keyrev;
+	struct event		 tls_rotatetimer;
+	struct event		 tls_reporttimer;
+
+	/* handshake accounting, with the cpu time
+	 * spent inside of tls_handshake
+	 */
+	uint64_t		 tls_handshakes;
+	uint64_t		 tls_resumed;
+	uint64_t		 tls_failed;
+	uint64_t		 tls_lasthandshakes;
+	struct timespec		 tls_handshaketime;
+
+	int			 handshaking;
+
 	int			 listen_fd;
 	struct event		 listen_event;
+	struct event		 listen_pausetimer;
 };
 
 static void	globalcontext_init(int);
 static void	globalcontext_teardown(void);
 
+static void	globalcontext_rotatetickets(int, short, void *);
+static void	globalcontext_report(int, short, void *);
+
 static void	globalcontext_listen(void (*)(struct conn *), uint16_t);
 static void	globalcontext_accept(int, short, void *);
+static void	globalcontext_resumelistening(int, short, void *);
 static void	globalcontext_stoplistening(void);
 
 static int	globalcontext_initialized = 0;
@@ -51,36 +112,69 @@ struct conn {
 	struct sockaddr_in	  peer;
 
 	struct tls		 *tls_context;
+	char			 *tls_sendbuf;
+	int			  tls_handshaken;
+
+	/* until the handshake is through, the conn is ours
+	 * alone and cb_accept is who it goes to after
+	 */
+	struct event		  event_handshake;
+	struct timespec		  handshakedeadline;
+	void			(*cb_accept)(struct conn *);
 	struct event		  event_receive;
 	struct timeval		  timeout;
 
 	struct netmsg		 *incoming_message;
 	struct msgqueue		 *outgoing;
 
+	/* receive ring. holds bytes read off the wire that
+	 * haven't been handed to a message yet, i.e. while our
+	 * receiver has asked us to stop delivering
+	 */
+	char			 *rxbuf;
+	size_t			  rxcapacity;
+	size_t			  rxstart;
+	size_t			  rxlen;
+	int			  rxmaybemore;
+
 	void			(*cb_receive)(struct conn *, struct netmsg *);
 	void			(*cb_timeout)(struct conn *);
 	void			(*cb_teardown)(struct conn *);
+	void			(*cb_drain)(struct conn *);
 
-	RB_ENTRY(conn)		  entries;
-};
+	/* we compress outgoing data once the owner allows
+	 * it and the peer has shown it can take it
+	 */
+	int			  compressallowed;
+	int			  compresspeer;
 
-RB_HEAD(conntree, conn);
+	uint32_t		  handle;
+};
 
 static struct conn		*conn_new(int, struct sockaddr_in *, struct tls *);
-static int			 conn_compare(struct conn *, struct conn *);
-
+static int			 conn_isalive(struct conn *, uint32_t);
+static int			 conn_handshake(struct conn *);
+static void			 conn_starthandshake(struct conn *, void (*)(struct conn *));
+static void			 conn_dohandshake(int, short, void *);
+
+static void			 conn_rxreserve(struct conn *);
+static size_t			 conn_rxfree(struct conn *, char **);
+static size_t			 conn_rxpending(struct conn *, char **);
+static void			 conn_rxconsume(struct conn *, size_t);
+static int			 conn_rxshort(struct conn *);
+
+static void			 conn_inflate(struct conn *);
+static int			 conn_deliver(struct conn *);
 static void			 conn_doreceive(int, short, void *);
 static void			 conn_dosend(struct msgqueue *, struct conn *);
 
-static struct conntree allcons = RB_INITIALIZER(&allcons);
-
-RB_PROTOTYPE_STATIC(conntree, conn, entries, conn_compare)
-RB_GENERATE_STATIC(conntree, conn, entries, conn_compare)
+static struct slotmap	*allcons = NULL;
 
 static void
 globalcontext_init(int mode)
 {
 	struct tls_config	*globalcfg;
+	unsigned char		 sessionid[TLS_MAX_SESSION_ID_LENGTH];
 	struct tls		*serverctx;
 
 	uint8_t			*key;
@@ -115,6 +209,19 @@ globalcontext_init(int mode)
 			log_fatalx("globalcontext_init: can't set key memory");
 		}
 
+		if (tls_config_set_ciphers(globalcfg, CONN_CIPHERS) < 0 ||
+		    tls_config_set_ecdhecurves(globalcfg, CONN_CURVES) < 0)
+			log_fatalx("globalcontext_init: can't set cipher preference: %s",
+				tls_config_error(globalcfg));
+
+		tls_config_prefer_ciphers_server(globalcfg);
+
+		arc4random_buf(sessionid, sizeof(sessionid));
+		if (tls_config_set_session_id(globalcfg, sessionid, sizeof(sessionid)) < 0 ||
+		    tls_config_set_session_lifetime(globalcfg, CONN_SESSIONLIFETIME) < 0)
+			log_fatalx("globalcontext_init: can't enable session resumption: %s",
+				tls_config_error(globalcfg));
+
 		serverctx = tls_server();
 		if (serverctx == NULL)
 			log_fatalx("globalcontext_init: can't allocate tls serverctx");
@@ -128,8 +235,23 @@ globalcontext_init(int mode)
 	
 		globalcontext.tls_globalcfg = globalcfg;
 		globalcontext.tls_serverctx = serverctx;
+
+		/* the server context holds onto globalcfg, so keys
+		 * added to it later on get picked up as they come
+		 */
+		evtimer_set(&globalcontext.tls_rotatetimer,
+			globalcontext_rotatetickets, NULL);
+		globalcontext_rotatetickets(-1, EV_TIMEOUT, NULL);
+
+		evtimer_set(&globalcontext.tls_reporttimer,
+			globalcontext_report, NULL);
+		globalcontext_report(-1, EV_TIMEOUT, NULL);
 	}
 
+	if (allcons == NULL)
+		if ((allcons = slotmap_new()) == NULL)
+			log_fatal("globalcontext_init: slotmap_new");
+
 	globalcontext.mode = mode;
 	globalcontext.listen_fd = -1;
 	globalcontext_initialized = 1;
@@ -147,6 +269,9 @@ globalcontext_teardown(void)
 	globalcontext.listen_fd = -1;
 
 	if (globalcontext.mode == CONN_MODE_TLS) {
+		evtimer_del(&globalcontext.tls_rotatetimer);
+		evtimer_del(&globalcontext.tls_reporttimer);
+
 		tls_free(globalcontext.tls_serverctx);
 		tls_config_free(globalcontext.tls_globalcfg);
 		tls_unload_file(globalcontext.tls_key, globalcontext.tls_keysize);
@@ -156,6 +281,62 @@ globalcontext_teardown(void)
 	globalcontext_initialized = 0;
 }
 
+static void
+globalcontext_rotatetickets(int fd, short event, void *arg)
+{
+	struct timeval	tv;
+	unsigned char	key[TLS_TICKET_KEY_SIZE];
+
+	arc4random_buf(key, sizeof(key));
+
+	if (tls_config_add_ticket_key(globalcontext.tls_globalcfg,
+	    ++globalcontext.tls_keyrev, key, sizeof(key)) < 0)
+		log_fatalx("globalcontext_rotatetickets: %s",
+			tls_config_error(globalcontext.tls_globalcfg));
+
+	explicit_bzero(key, sizeof(key));
+
+	tv.tv_sec = CONN_TICKETROTATE;
+	tv.tv_usec = 0;
+	evtimer_add(&globalcontext.tls_rotatetimer, &tv);
+
+	(void)fd;
+	(void)event;
+	(void)arg;
+}
+
+static void
+globalcontext_report(int fd, short event, void *arg)
+{
+	struct timeval	tv;
+	uint64_t	handshakes, resumed, usec;
+
+	handshakes = globalcontext.tls_handshakes;
+	resumed = globalcontext.tls_resumed;
+
+	/* only worth a line in the log if anybody connected */
+	if (handshakes != globalcontext.tls_lasthandshakes) {
+		usec = globalcontext.tls_handshaketime.tv_sec * 1000000 +
+			globalcontext.tls_handshaketime.tv_nsec / 1000;
+
+		log_writex(LOGTYPE_MSG, "tls: %llu handshakes, %llu resumed (%llu%%), "
+			"%llu failed, %llu usec cpu (%llu usec each)",
+			handshakes, resumed, resumed * 100 / handshakes,
+			globalcontext.tls_failed, usec,
+			usec / (handshakes + globalcontext.tls_failed));
+
+		globalcontext.tls_lasthandshakes = handshakes;
+	}
+
+	tv.tv_sec = CONN_REPORTINTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&globalcontext.tls_reporttimer, &tv);
+
+	(void)fd;
+	(void)event;
+	(void)arg;
+}
+
 static void
 globalcontext_listen(void (*cb)(struct conn *), uint16_t port)
 {
@@ -187,6 +368,9 @@ globalcontext_listen(void (*cb)(struct conn *), uint16_t port)
 		log_fatal("globalcontext_listen: event_add");
 	}
 
+	evtimer_set(&globalcontext.listen_pausetimer,
+		globalcontext_resumelistening, NULL);
+
 	globalcontext.listen_fd = lfd;
 }
 
@@ -194,33 +378,85 @@ static void
 globalcontext_accept(int fd, short event, void *arg)
 {
 	struct sockaddr_in	 peer;
-	struct tls		 *connctx = NULL;
+	struct tls		 *connctx;
 	struct conn		 *newconn;
+	struct timeval		  tv;
 
 	socklen_t	  	  addrlen;
-	int			  newfd;	
+	int			  i, newfd;	
 
 	void			(*cb)(struct conn *) = (void (*)(struct conn *))arg;
 
-	/* XXX: will this always work? i.e. could we get a RST immediately
-	 * after an incoming SYN that breaks everything and causes an error here
-	 *
-	 * a month later: i think this is probably fine, but like who knows
-	 * one heck of a corner case, but a good stackoverflow question
+	/* take whatever's queued up, to a point, so a burst gets
+	 * seen to in one go without starving everybody else
 	 */
-	newfd = accept4(fd, (struct sockaddr *)&peer, &addrlen,
-		SOCK_NONBLOCK | SOCK_CLOEXEC);
+	for (i = 0; i < CONN_ACCEPTBUDGET; i++) {
+		addrlen = sizeof(struct sockaddr_in);
+		newfd = accept4(fd, (struct sockaddr *)&peer, &addrlen,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (newfd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			else if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			else if (errno != EMFILE && errno != ENFILE)
+				log_fatal("globalcontext_accept: accept");
+
+			/* the listener would stay readable and we'd spin,
+			 * so leave it be until some descriptors free up
+			 */
+			log_write(LOGTYPE_WARN, "globalcontext_accept: accept");
+
+			if (event_del(&globalcontext.listen_event) < 0)
+				log_fatal("globalcontext_accept: event_del");
+
+			tv.tv_sec = CONN_ACCEPTPAUSE;
+			tv.tv_usec = 0;
+			evtimer_add(&globalcontext.listen_pausetimer, &tv);
+			break;
+		}
 
-	if (newfd < 0) log_fatal("globalcontext_accept: accept");
-	
-	if (globalcontext.mode == CONN_MODE_TLS)
-		if (tls_accept_socket(globalcontext.tls_serverctx, &connctx, newfd) < 0)
-			log_fatalx("tls_accept_socket: %s", tls_error(globalcontext.tls_serverctx));
+		if (globalcontext.mode != CONN_MODE_TLS) {
+			newconn = conn_new(newfd, &peer, NULL);
+			cb(newconn);
+			continue;
+		}
+
+		if (globalcontext.handshaking >= CONN_MAXHANDSHAKES) {
+			log_writex(LOGTYPE_WARN, "too many handshakes in flight, "
+				"dropping %s", inet_ntoa(peer.sin_addr));
+			close(newfd);
+			continue;
+		}
+
+		connctx = NULL;
+		if (tls_accept_socket(globalcontext.tls_serverctx, &connctx, newfd) < 0) {
+			log_writex(LOGTYPE_WARN, "tls_accept_socket: %s",
+				tls_error(globalcontext.tls_serverctx));
+			close(newfd);
+			continue;
+		}
+
+		newconn = conn_new(newfd, &peer, connctx);
+		conn_starthandshake(newconn, cb);
+	}
+
+	(void)event;
+}
 
-	newconn = conn_new(newfd, &peer, connctx);
-	cb(newconn);
+static void
+globalcontext_resumelistening(int fd, short event, void *arg)
+{
+	if (globalcontext.listen_fd < 0)
+		return;
 
+	if (event_add(&globalcontext.listen_event, NULL) < 0)
+		log_fatal("globalcontext_resumelistening: event_add");
+
+	(void)fd;
 	(void)event;
+	(void)arg;
 }
 
 static void
@@ -229,8 +465,11 @@ globalcontext_stoplistening(void)
 	if (event_del(&globalcontext.listen_event) < 0)
 		log_fatal("globalcontext_stoplistening: event_del");
 
+	evtimer_del(&globalcontext.listen_pausetimer);
+
 	globalcontext.listen_fd = -1;
 	bzero(&globalcontext.listen_event, sizeof(struct event));
+	bzero(&globalcontext.listen_pausetimer, sizeof(struct event));
 }
 
 static struct conn *
@@ -249,184 +488,513 @@ conn_new(int fd, struct sockaddr_in *peer, struct tls *connctx)
 	out->outgoing = msgqueue_new(out, conn_dosend);
 	if (out->outgoing == NULL) log_fatal("conn_new: msgqueue_new");
 
-	RB_INSERT(conntree, &allcons, out);
+	if (slotmap_insert(allcons, out, &out->handle) < 0)
+		log_fatal("conn_new: slotmap_insert");
+
 	return out;
 }
 
 static int
-conn_compare(struct conn *a, struct conn *b)
+conn_isalive(struct conn *c, uint32_t handle)
 {
-	int	result = 0;
+	/* c may be gone by now, so look it up by what it was */
+	return slotmap_get(allcons, handle) == c;
+}
+
+/* make sure the ring has room for whatever the message in flight
+ * still needs, up to an mtu. a fresh connection or one trading
+ * heartbeats never gets past CONN_RXINITIAL
+ */
+static void
+conn_rxreserve(struct conn *c)
+{
+	char		*newbuf;
+	uint64_t	 want = CONN_RXINITIAL;
+	size_t		 newcapacity, head;
+
+	if (c->incoming_message != NULL)
+		want = netmsg_getmissing(c->incoming_message);
+
+	if (want > CONN_MTU) want = CONN_MTU;
+	if (c->rxcapacity > 0 && c->rxcapacity - c->rxlen >= want) return;
 
-	if (a->sockfd > b->sockfd) result = 1;
-	if (a->sockfd < b->sockfd) result = -1;
+	newcapacity = (c->rxcapacity == 0) ? CONN_RXINITIAL : c->rxcapacity;
+	while (newcapacity - c->rxlen < want && newcapacity < CONN_MTU)
+		newcapacity *= 2;
 
-	return result;
+	if (newcapacity == c->rxcapacity) return;
+
+	newbuf = reallocarray(NULL, newcapacity, sizeof(char));
+	if (newbuf == NULL)
+		log_fatal("conn_rxreserve: reallocarray");
+
+	/* straighten out the ring while we're at it */
+	head = c->rxcapacity - c->rxstart;
+	if (head > c->rxlen) head = c->rxlen;
+
+	memcpy(newbuf, c->rxbuf + c->rxstart, head);
+	memcpy(newbuf + head, c->rxbuf, c->rxlen - head);
+
+	free(c->rxbuf);
+	c->rxbuf = newbuf;
+	c->rxcapacity = newcapacity;
+	c->rxstart = 0;
+}
+
+/* contiguous free space at the tail of the ring */
+static size_t
+conn_rxfree(struct conn *c, char **out)
+{
+	size_t	tail;
+
+	tail = (c->rxstart + c->rxlen) % c->rxcapacity;
+	*out = c->rxbuf + tail;
+
+	if (tail < c->rxstart || c->rxlen == c->rxcapacity)
+		return c->rxcapacity - c->rxlen;
+	else
+		return c->rxcapacity - tail;
+}
+
+/* contiguous received bytes at the head of the ring */
+static size_t
+conn_rxpending(struct conn *c, char **out)
+{
+	size_t	span;
+
+	*out = c->rxbuf + c->rxstart;
+
+	span = c->rxcapacity - c->rxstart;
+	return (span < c->rxlen) ? span : c->rxlen;
 }
 
 static void
-conn_doreceive(int fd, short event, void *arg)
+conn_rxconsume(struct conn *c, size_t count)
+{
+	c->rxlen -= count;
+	c->rxstart = (c->rxlen == 0) ? 0 : (c->rxstart + count) % c->rxcapacity;
+}
+
+/* whether the message in flight needs more than the ring holds.
+ * once its headers are in, that's the rest of it
+ */
+static int
+conn_rxshort(struct conn *c)
+{
+	if (c->incoming_message == NULL) return 0;
+	return c->rxlen < netmsg_getmissing(c->incoming_message);
+}
+
+/* take the tls handshake one step further, keeping track of
+ * what it cost and whether the client came back with a ticket.
+ * returns 0 once done, TLS_WANT_POLLIN/POLLOUT while in
+ * progress, -1 on failure
+ */
+static int
+conn_handshake(struct conn *c)
+{
+	struct timespec	start, end, spent;
+	int		status;
+
+	if (globalcontext.mode != CONN_MODE_TLS || c->tls_handshaken)
+		return 0;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+	status = tls_handshake(c->tls_context);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+
+	timespecsub(&end, &start, &spent);
+	timespecadd(&globalcontext.tls_handshaketime, &spent,
+		&globalcontext.tls_handshaketime);
+
+	if (status == 0) {
+		c->tls_handshaken = 1;
+		globalcontext.tls_handshakes++;
+
+		if (tls_conn_session_resumed(c->tls_context))
+			globalcontext.tls_resumed++;
+
+	} else if (status == -1) {
+		log_writex(LOGTYPE_DEBUG, "tls handshake with %s: %s",
+			inet_ntoa(c->peer.sin_addr), tls_error(c->tls_context));
+		globalcontext.tls_failed++;
+	}
+
+	return status;
+}
+
+static void
+conn_starthandshake(struct conn *c, void (*cb)(struct conn *))
+{
+	c->cb_accept = cb;
+	globalcontext.handshaking++;
+
+	clock_gettime(CLOCK_MONOTONIC, &c->handshakedeadline);
+	c->handshakedeadline.tv_sec += CONN_HANDSHAKETIMEOUT;
+
+	conn_dohandshake(c->sockfd, EV_READ, c);
+}
+
+static void
+conn_dohandshake(int fd, short event, void *arg)
 {
 	struct conn	*c = (struct conn *)arg;
-	char		*receivebuf = NULL;
+	struct timespec	 now, left;
+	struct timeval	 tv;
 
-	ssize_t		 receivesize = 0;
-	int		 unrecoverable, willteardown = 0;
+	void		(*cb)(struct conn *);
+	int		 status;
 
 	if (event & EV_TIMEOUT) {
-		c->cb_timeout(c);
+		log_writex(LOGTYPE_DEBUG, "tls handshake with %s timed out",
+			inet_ntoa(c->peer.sin_addr));
+		globalcontext.tls_failed++;
+		conn_teardown(c);
 		return;
 	}
 
-	for (;;) {
-		ssize_t		 thispacketsize;
-		char		*newreceivebuf;
+	if ((status = conn_handshake(c)) == -1) {
+		conn_teardown(c);
+		return;
 
-		newreceivebuf = reallocarray(receivebuf, receivesize + CONN_MTU, sizeof(char));
-		if (newreceivebuf == NULL)
-			log_fatal("conn_doreceive: reallocarray");
+	} else if (status == 0) {
+		cb = c->cb_accept;
+		c->cb_accept = NULL;
+		globalcontext.handshaking--;
 
-		receivebuf = newreceivebuf;
+		cb(c);
+		return;
+	}
 
-		if (globalcontext.mode == CONN_MODE_TLS)
-			thispacketsize = tls_read(c->tls_context, receivebuf + receivesize, CONN_MTU);
-		else {
-			thispacketsize = read(c->sockfd, receivebuf + receivesize, CONN_MTU);
-			if (thispacketsize < 0 && errno == EAGAIN)
-				thispacketsize = TLS_WANT_POLLIN;
-		}
-		
-		if (thispacketsize == -1 || thispacketsize == 0) {
-			log_writex(LOGTYPE_DEBUG, "client eof it seems");
-			willteardown = 1;
-			break;	
-		} else if (thispacketsize == TLS_WANT_POLLIN || thispacketsize == TLS_WANT_POLLOUT) {
-			break;
-		}
+	/* whatever's left of the deadline, which may be nothing */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&c->handshakedeadline, &now, &left);
+	if (left.tv_sec < 0) timespecclear(&left);
+	TIMESPEC_TO_TIMEVAL(&tv, &left);
+
+	event_set(&c->event_handshake, c->sockfd,
+		(status == TLS_WANT_POLLOUT) ? EV_WRITE : EV_READ,
+		conn_dohandshake, c);
 
-		receivesize += thispacketsize;
+	if (event_add(&c->event_handshake, &tv) < 0)
+		log_fatal("conn_dohandshake: event_add");
+
+	(void)fd;
+}
+
+/* the peer evidently speaks compression. swap in a
+ * decompressed copy of what it sent, if there's data in it.
+ * on failure the original goes up with the error attached
+ */
+static void
+conn_inflate(struct conn *c)
+{
+	struct netmsg	*plain;
+
+	c->compresspeer = 1;
+
+	if ((plain = netmsg_decompress(c->incoming_message)) != NULL) {
+		netmsg_teardown(c->incoming_message);
+		c->incoming_message = plain;
 	}
+}
+
+/* split received bytes into messages, handing each to our
+ * receiver as soon as it's complete. we never write more into
+ * a message than its decoder says is missing, so back to back
+ * messages in a single read come apart cleanly. anything left
+ * over once the receiver pauses us stays in the ring. returns -1
+ * if the connection was torn down by the receiver
+ */
+static int
+conn_deliver(struct conn *c)
+{
+	char		*bytes;
+	uint64_t	 missing;
+	size_t		 count;
+	uint32_t	 handle;
+	int		 unrecoverable;
 
-	if (receivesize > 0) {
+	handle = c->handle;
 
-		/* first, reboot the connection so that if our client doesn't
-		 * turn off reception (e.g. to flight an engine request), timeouts
-		 * will occur appropriately
-		 */
-		conn_stopreceiving(c);
-		conn_receive(c, c->cb_receive);
+	while (c->rxlen > 0) {
+		if (!event_pending(&c->event_receive, EV_READ, NULL))
+			break;
+
+		count = conn_rxpending(c, &bytes);
 
 		if (c->incoming_message == NULL) {
 			uint8_t	opcode;
-	
-			opcode = *(uint8_t *)receivebuf;
+
+			opcode = *(uint8_t *)bytes;
 			c->incoming_message = netmsg_new(opcode);
-	
-			/* invalid argument -> bad opcode */
+
+			/* invalid argument -> bad opcode, and we have
+			 * no way to find the next message boundary
+			 */
 			if (c->incoming_message == NULL) {
-				if (errno == EINVAL) {
-					c->cb_receive(c, NULL);
-					goto end;
+				if (errno != EINVAL)
+					log_fatal("conn_deliver: netmsg_new");
+
+				conn_rxconsume(c, c->rxlen);
 
-				} else log_fatal("conn_doreceive: netmsg_new");
+				c->cb_receive(c, NULL);
+				return conn_isalive(c, handle) ? 0 : -1;
 			}
 		}
-	
-		if (netmsg_write(c->incoming_message, receivebuf, receivesize) != receivesize)
-			log_fatalx("conn_doreceive: netmsg_write: %s",
+
+		missing = netmsg_getmissing(c->incoming_message);
+		if (count > missing) count = (size_t)missing;
+
+		if (netmsg_write(c->incoming_message, bytes, count) != (ssize_t)count)
+			log_fatalx("conn_deliver: netmsg_write: %s",
 				netmsg_error(c->incoming_message));
-		
+
+		conn_rxconsume(c, count);
+
 		if (!netmsg_isvalid(c->incoming_message, &unrecoverable)) {
+			if (!unrecoverable) continue;
+
+			/* deliver as is, caller checks for validity and
+			 * can discover errstr + work with it as desired.
+			 * framing is lost, so drop whatever follows
+			 */
+			log_writex(LOGTYPE_DEBUG, "unrecoverable message was delivered: %s",
+				netmsg_error(c->incoming_message));
+			conn_rxconsume(c, c->rxlen);
+
+		} else {
+			netmsg_clearerror(c->incoming_message);
+
+			if (netmsg_iscompressed(c->incoming_message))
+				conn_inflate(c);
+		}
+
+		c->cb_receive(c, c->incoming_message);
+		if (!conn_isalive(c, handle)) return -1;
+
+		netmsg_teardown(c->incoming_message);
+		c->incoming_message = NULL;
+	}
+
+	return 0;
+}
 
-			if (unrecoverable) {
-				/* deliver as is, caller checks for validity and
-				 * can discover errstr + work with it as desired
-				 */
-				char		*label, *data;
-				uint64_t	 datasize;
+static void
+conn_doreceive(int fd, short event, void *arg)
+{
+	struct conn	*c = (struct conn *)arg;
+	char		*receivebuf;
 
-				label = netmsg_getlabel(c->incoming_message);
-				data = netmsg_getdata(c->incoming_message, &datasize);
+	size_t		 budget = CONN_READBUDGET, span;
+	int		 rebooted = 0, willteardown = 0, drained = 0;
 
-				log_writex(LOGTYPE_DEBUG, "DEBUG: unrecoverable message was delivered. receivesize = %ld. label = %s. data size = %ld", receivesize, label, data);
+	if (event & EV_TIMEOUT) {
+		c->cb_timeout(c);
+		return;
+	}
 
-				free(label);
-				free(data);
+	c->rxmaybemore = 0;
 
-				c->cb_receive(c, c->incoming_message);
+	for (;;) {
+		ssize_t		 thispacketsize = 0;
 
-				if (RB_FIND(conntree, &allcons, c) != NULL) {
-					netmsg_teardown(c->incoming_message);
-					c->incoming_message = NULL;
-				}
+		/* anything held back from last time goes first,
+		 * and a message that's short gets topped up
+		 */
+		while (c->rxlen == 0 || conn_rxshort(c)) {
+			if (budget == 0) {
+				c->rxmaybemore = 1;
+				break;
 			}
 
-		} else {
-			netmsg_clearerror(c->incoming_message);
-			c->cb_receive(c, c->incoming_message);
+			conn_rxreserve(c);
 
-			if (RB_FIND(conntree, &allcons, c) != NULL) {
-				netmsg_teardown(c->incoming_message);
-				c->incoming_message = NULL;
+			span = conn_rxfree(c, &receivebuf);
+			if (span == 0) break;
+			else if (span > budget) span = budget;
+
+			if (globalcontext.mode == CONN_MODE_TLS)
+				thispacketsize = tls_read(c->tls_context, receivebuf, span);
+			else {
+				thispacketsize = read(c->sockfd, receivebuf, span);
+				if (thispacketsize < 0 && errno == EAGAIN)
+					thispacketsize = TLS_WANT_POLLIN;
+			}
+
+			if (thispacketsize == -1 || thispacketsize == 0) {
+				log_writex(LOGTYPE_DEBUG, "client eof it seems");
+				willteardown = 1;
+				break;
+			} else if (thispacketsize == TLS_WANT_POLLIN ||
+			    thispacketsize == TLS_WANT_POLLOUT) {
+				drained = 1;
+				break;
 			}
+
+			c->rxlen += thispacketsize;
+			budget -= thispacketsize;
 		}
+
+		/* nothing to pass along, or only part of a
+		 * message from a peer that's gone anyway
+		 */
+		if (c->rxlen == 0 || willteardown)
+			break;
+
+		if (!rebooted) {
+			/* first, reboot the connection so that if our client doesn't
+			 * turn off reception (e.g. to flight an engine request), timeouts
+			 * will occur appropriately
+			 */
+			conn_stopreceiving(c);
+			conn_receive(c, c->cb_receive);
+			rebooted = 1;
+		}
+
+		if (conn_deliver(c) < 0)
+			return;
+		else if (drained)
+			break;
+
+		/* paused by our receiver, there might be more waiting
+		 * for us inside of libtls that we won't get woken for
+		 */
+		if (!event_pending(&c->event_receive, EV_READ, NULL)) {
+			c->rxmaybemore = 1;
+			break;
+		}
+	}
+
+	/* idle rings go back to their initial size */
+	if (c->rxlen == 0 && c->incoming_message == NULL &&
+	    c->rxcapacity > CONN_RXINITIAL) {
+		free(c->rxbuf);
+		c->rxbuf = NULL;
+		c->rxcapacity = 0;
 	}
 
-end:	
-	free(receivebuf);
 	if (willteardown)
 		conn_teardown(c);
 
+	/* out of budget, come back around once everyone else has gone */
+	else if (c->rxmaybemore && event_pending(&c->event_receive, EV_READ, NULL))
+		event_active(&c->event_receive, EV_READ, 1);
+
 	(void)fd;
 }
 
 static void
 conn_dosend(struct msgqueue *mq, struct conn *c)
 {
-	char		*rawmsg;
-	struct netmsg	*sendmsg;	
-	ssize_t		 sendsize, sendoffset, written;
+	struct iovec	 iov[CONN_SENDIOV];
+	struct netmsg	*sendmsgs[CONN_SENDIOV];
+	size_t		 sendsizes[CONN_SENDIOV];
+
+	char		*p;
+	ssize_t		 written;
+	size_t		 budget, sendoffset, sendsize = 0;
+	int		 i, j, iovcnt = 0, msgcnt, sentcnt, lastmore = 0;
 
-	sendmsg = msgqueue_gethead(mq);
-	if (sendmsg == NULL)
+	msgcnt = msgqueue_getheads(mq, sendmsgs, CONN_SENDIOV);
+	if (msgcnt == 0)
 		log_fatalx("conn_dosend: fired when msgqueue empty somehow");
 
-	sendsize = netmsg_seek(sendmsg, 0, SEEK_END);
-	if (sendsize < 0) log_fatal("conn_dosend: netmsg_seek to end");
+	sendoffset = msgqueue_getcachedoffset(mq);
+	budget = (globalcontext.mode == CONN_MODE_TLS) ? CONN_TLSCHUNK : CONN_SENDBUDGET;
+
+	/* memory messages point us right into their segments, disk
+	 * messages into a mapping of their file. gather as many as
+	 * fit, remembering how much of each one is left to go. a
+	 * message that used up every slot we had may have more
+	 */
+	for (i = 0; i < msgcnt && iovcnt < CONN_SENDIOV && sendsize < budget; i++) {
+		int	n;
 
-	sendoffset = (ssize_t)msgqueue_getcachedoffset(mq);
-	sendsize -= sendoffset;
+		n = netmsg_getiov(sendmsgs[i], (i == 0) ? sendoffset : 0,
+			iov + iovcnt, CONN_SENDIOV - iovcnt);
 
-	if (netmsg_seek(sendmsg, sendoffset, SEEK_SET) < 0)
-		log_fatal("conn_dosend: netmsg_seek to cached offset");
+		if (n < 0)
+			log_fatalx("conn_dosend: netmsg_getiov: %s",
+				netmsg_error(sendmsgs[i]));
 
-	rawmsg = reallocarray(NULL, sendsize, sizeof(char));
-	if (rawmsg == NULL)
-		log_fatal("conn_dosend: reallocarray can't allocate %ld bytes", sendsize);
+		lastmore = (n == CONN_SENDIOV - iovcnt);
 
-	if (netmsg_read(sendmsg, rawmsg, sendsize) != sendsize)
-		log_fatal("conn_dosend: netmsg_read failed to read %ld bytes", sendsize);
+		sendsizes[i] = 0;
+		for (j = iovcnt; j < iovcnt + n; j++)
+			sendsizes[i] += iov[j].iov_len;
+
+		for (; iovcnt < CONN_SENDIOV && n > 0; iovcnt++, n--) {
+			if (iov[iovcnt].iov_len > budget - sendsize)
+				iov[iovcnt].iov_len = budget - sendsize;
+
+			sendsize += iov[iovcnt].iov_len;
+		}
+	}
+
+	sentcnt = i;
+
+	if (sendsize == 0) {
+		msgqueue_deletehead(mq);
+		goto end;
+	}
+
+	if (globalcontext.mode == CONN_MODE_TLS) {
+		/* one big span goes out as is, a run of small
+		 * ones gets flattened into a single record
+		 */
+		if (iovcnt == 1)
+			p = iov[0].iov_base;
+		else {
+			if (c->tls_sendbuf == NULL) {
+				c->tls_sendbuf = reallocarray(NULL, CONN_TLSCHUNK, sizeof(char));
+				if (c->tls_sendbuf == NULL)
+					log_fatal("conn_dosend: reallocarray tls send buffer");
+			}
+
+			p = c->tls_sendbuf;
+			for (j = 0; j < iovcnt; j++) {
+				memcpy(p, iov[j].iov_base, iov[j].iov_len);
+				p += iov[j].iov_len;
+			}
+
+			p = c->tls_sendbuf;
+		}
 
-	if (globalcontext.mode == CONN_MODE_TLS)
-		written = tls_write(c->tls_context, rawmsg, sendsize);
-	else {
-		written = write(c->sockfd, rawmsg, sendsize);
+		written = tls_write(c->tls_context, p, sendsize);
+	} else {
+		written = writev(c->sockfd, iov, iovcnt);
 		if (written < 0 && errno == EAGAIN)
 			written = TLS_WANT_POLLOUT;
 	}
 
-	if (written == -1 || written == 0)
+	if (written == -1 || written == 0) {
 		conn_teardown(c);
+		return;
+
+	} else if (written == TLS_WANT_POLLIN || written == TLS_WANT_POLLOUT)
+		return;
 
-	else if (written == TLS_WANT_POLLIN || written == TLS_WANT_POLLOUT)
-		msgqueue_setcachedoffset(mq, (size_t)sendoffset);
+	/* retire everything that made it out in full, and
+	 * remember where we got to in the first one that didn't
+	 */
+	for (i = 0; i < sentcnt; i++) {
+		if ((size_t)written < sendsizes[i] ||
+		    (i == sentcnt - 1 && lastmore && (size_t)written == sendsizes[i])) {
+			msgqueue_setcachedoffset(mq, sendoffset + written);
+			break;
+		}
 
-	else if (written < sendsize)
-		msgqueue_setcachedoffset(mq, (size_t)(sendoffset + written));
+		written -= sendsizes[i];
+		sendoffset = 0;
 
-	else msgqueue_deletehead(mq);
+		msgqueue_deletehead(mq);
+	}
 
-	free(rawmsg);
+end:
+	/* whoever is feeding us may be waiting to hear this */
+	if (msgqueue_gethead(mq) == NULL && c->cb_drain != NULL)
+		c->cb_drain(c);
 }
 
 
@@ -447,22 +1015,31 @@ conn_teardown(struct conn *c)
 	if (c->cb_teardown != NULL)
 		c->cb_teardown(c);
 
-	RB_REMOVE(conntree, &allcons, c);
+	slotmap_remove(allcons, c->handle);
 
 	if (c->incoming_message != NULL)
 		netmsg_teardown(c->incoming_message);
 
+	free(c->rxbuf);
 	msgqueue_teardown(c->outgoing);
 
 	conn_stopreceiving(c);
 	conn_canceltimeout(c);
 
+	if (event_initialized(&c->event_handshake))
+		event_del(&c->event_handshake);
+
+	if (c->cb_accept != NULL)
+		globalcontext.handshaking--;
+
 	shutdown(c->sockfd, SHUT_RDWR);
 	close(c->sockfd);
 
 	if (c->tls_context != NULL)
 		tls_free(c->tls_context);
 
+	free(c->tls_sendbuf);
+
 	free(c);
 
 	log_writex(LOGTYPE_DEBUG, "tore down connection");
@@ -471,14 +1048,13 @@ conn_teardown(struct conn *c)
 void
 conn_teardownall(void)
 {
-	globalcontext_stoplistening();
+	struct conn	*toremove;
+	uint32_t	 cursor = 0;
 
-	while (!RB_EMPTY(&allcons)) {
-		struct conn	*toremove;
+	globalcontext_stoplistening();
 
-		toremove = RB_MIN(conntree, &allcons);
+	while ((toremove = slotmap_iterate(allcons, &cursor, NULL)) != NULL)
 		conn_teardown(toremove);
-	}
 	
 	globalcontext_teardown();
 }
@@ -503,13 +1079,20 @@ conn_receive(struct conn *c, void (*cb)(struct conn *, struct netmsg *))
 
 		if (event_add(&c->event_receive, timeout) < 0)
 			log_fatal("conn_receive: event_add");
+
+		/* held back bytes won't make the socket readable again */
+		if (c->rxlen > 0 || c->rxmaybemore)
+			event_active(&c->event_receive, EV_READ, 1);
 	}
 }
 
 void
 conn_stopreceiving(struct conn *c)
 {
-	if (event_pending(&c->event_receive, EV_READ, NULL))
+	/* a timeout can still be armed when the read isn't,
+	 * and it mustn't fire into a conn that's been freed
+	 */
+	if (event_pending(&c->event_receive, EV_READ | EV_TIMEOUT, NULL))
 		if (event_del(&c->event_receive) < 0)
 			log_fatal("conn_stopreceiving: event_del");
 }
@@ -520,6 +1103,12 @@ conn_setteardowncb(struct conn *c, void (*cb)(struct conn *))
 	c->cb_teardown = cb;
 }
 
+void
+conn_setdraincb(struct conn *c, void (*cb)(struct conn *))
+{
+	c->cb_drain = cb;
+}
+
 void
 conn_settimeout(struct conn *c, struct timeval *timeout, void (*cb)(struct conn *))
 {
@@ -545,12 +1134,35 @@ conn_getfd(struct conn *c)
 	return c->sockfd;
 }
 
+uint32_t
+conn_gethandle(struct conn *c)
+{
+	return c->handle;
+}
+
 void
 conn_send(struct conn *c, struct netmsg *msg)
 {
+	struct netmsg	*compressed;
+
+	if (c->compressallowed && c->compresspeer) {
+		if ((compressed = netmsg_compress(msg)) != NULL) {
+			netmsg_teardown(msg);
+			msg = compressed;
+
+		} else if (errno != EINVAL)
+			log_fatal("conn_send: netmsg_compress");
+	}
+
 	msgqueue_append(c->outgoing, msg);
 }
 
+void
+conn_setcompress(struct conn *c, int allowed)
+{
+	c->compressallowed = allowed;
+}
+
 struct sockaddr_in *
 conn_getsockpeer(struct conn *c)
 {
@@ -7,6 +7,7 @@
 #include <sys/time.h>
 
 #include <errno.h>
+#include <limits.h>
 #include <event.h>
 #include <pwd.h>
 #include <stdio.h>
@@ -16,153 +17,652 @@
 
 #include "workerd.h"
 
-static void	engine_sendtofrontend(int, uint32_t, char *);
+/* chunked files the client sent along before
+ * its job got a vm, to be passed on in order
+ */
+struct jobpart {
+	struct netmsg			*m;
+	TAILQ_ENTRY(jobpart)		 entries;
+};
+
+TAILQ_HEAD(jobparts, jobpart);
+
+struct job {
+	uint32_t		 key;
+	struct netmsg		*archive;
+	struct jobparts		 parts;
+
+	/* what the parts add up to, and whether the file
+	 * in progress has been turned away for it
+	 */
+	uint64_t		 partbytes;
+	int			 rejecting;
+
+	TAILQ_ENTRY(job)	 entries;
+};
+
+TAILQ_HEAD(jobqueue, job);
+
+struct linebatch {
+	uint32_t	 key;
+	struct event	 timer;
+
+	size_t		 len;
+	char		 text[ENGINE_LINEBATCH];
+};
+
+static void	engine_sendtofrontend(int, uint32_t, int, char *);
 static void	proc_getmsgfromfrontend(int, int, struct ipcmsg *);
 
+static int	jobqueue_enqueue(uint32_t, struct netmsg *);
+static int	jobqueue_addpart(struct job *, struct netmsg *);
+static void	jobqueue_free(struct job *, struct vm *);
+static void	jobqueue_cancel(uint32_t);
+static void	jobqueue_dispatch(void);
+static void	jobqueue_sendpositions(void);
+static void	jobqueue_tick(int, short, void *);
+
+static void	linebatch_add(uint32_t, char *);
+static void	linebatch_flush(uint32_t);
+static void	linebatch_drop(uint32_t);
+static void	linebatch_expire(int, short, void *);
+
 static void	vm_print(uint32_t, char *);
 static void	vm_readline(uint32_t);
-static void	vm_commitfile(uint32_t, char *, char *, size_t);
+static void	vm_commitfile(uint32_t, struct netmsg *);
+static void	vm_stream(uint32_t, struct netmsg *);
+static void	vm_filepart(uint32_t, struct netmsg *);
+static void	vm_partstaken(uint32_t, uint64_t);
 static void	vm_signaldone(uint32_t);
 static void	vm_reporterror(uint32_t, char *);
 
 static struct vm_interface vmi = {	.print = vm_print,
 					.readline = vm_readline,
 					.commitfile = vm_commitfile,
+					.stream = vm_stream,
+					.filepart = vm_filepart,
+					.partstaken = vm_partstaken,
 					.signaldone = vm_signaldone,
 					.reporterror = vm_reporterror };
 
+/* jobs whose archives arrived while no vm was ready.
+ * they keep their spooled archive and go out in order
+ * as vms come up; jobsbykey mirrors the frontend's keys
+ */
+static struct jobqueue	 jobqueue = TAILQ_HEAD_INITIALIZER(jobqueue);
+static struct slotmap	*jobsbykey;
+static uint32_t		 jobcount = 0;
+static struct event	 jobtimer;
+
+/* lines on their way to the frontend, by key */
+static struct slotmap	*batchesbykey;
+
 static void
-engine_sendtofrontend(int type, uint32_t key, char *data)
+engine_sendtofrontend(int type, uint32_t key, int fd, char *data)
 {
 	struct ipcmsg	*response;
 
+	/* whatever comes next was said after the lines
+	 * we're holding onto, so they have to go first
+	 */
+	if (type != IMSG_SENDLINES) linebatch_flush(key);
+
 	response = ipcmsg_new(key, data);
 	if (response == NULL) log_fatal("engine_sendtofrontend: ipcmsg_new");
 
-	myproc_send(PROC_FRONTEND, type, -1, response);
+	myproc_send(PROC_FRONTEND, type, fd, response);
 	ipcmsg_teardown(response);
 }
 
 static void
 vm_print(uint32_t key, char *msg)
 {
-	engine_sendtofrontend(IMSG_SENDLINE, key, msg);
+	memo_recordline(key, msg);
+	linebatch_add(key, msg);
 }
 
+/* a job that asks for input can't be replayed */
 static void
 vm_readline(uint32_t key)
 {
-	engine_sendtofrontend(IMSG_REQUESTLINE, key, NULL);
+	memo_abandon(key);
+	engine_sendtofrontend(IMSG_REQUESTLINE, key, -1, NULL);
 }
 
+/* the frontend gets its own descriptor for the file the
+ * vm sent us, so it can go away on our end right after this
+ */
 static void
-vm_commitfile(uint32_t key, char *fname, char *fdata, size_t fdatasize)
+vm_commitfile(uint32_t key, struct netmsg *m)
 {
-	struct vm	*v;
-	char		*wbpath;
+	int	fd;
 
-	if ((v = vm_fromkey(key)) == NULL)
-		if (v == NULL) log_fatal("vm_commitfile: vm_fromkey");
+	if ((fd = netmsg_getfd(m)) < 0)
+		log_fatal("vm_commitfile: netmsg_getfd");
 
-	log_writex(LOGTYPE_DEBUG, "committing file %s!", fname);
-	wbpath = wbfile_writeback(fname, fdata, fdatasize);
-	vm_setaux(v, wbpath);
-	engine_sendtofrontend(IMSG_SENDFILE, key, wbpath);
+	memo_recordmsg(key, m);
+	log_writex(LOGTYPE_DEBUG, "committing file to key %u", key);
+	engine_sendtofrontend(IMSG_SENDFILE, key, fd, NULL);
+}
+
+/* stream chunks are disk messages too, so they
+ * cross over the same way files do
+ */
+static void
+vm_stream(uint32_t key, struct netmsg *m)
+{
+	int	fd;
+
+	if ((fd = netmsg_getfd(m)) < 0)
+		log_fatal("vm_stream: netmsg_getfd");
+
+	memo_recordmsg(key, m);
+
+	engine_sendtofrontend(IMSG_STREAM, key, fd, NULL);
+}
+
+/* chunks cross over as descriptors, and the
+ * bookends are small enough to go by name
+ */
+static void
+vm_filepart(uint32_t key, struct netmsg *m)
+{
+	char	*label;
+	int	 fd;
+
+	/* not worth keeping transcripts this big */
+	memo_abandon(key);
+
+	if (netmsg_gettype(m) == NETOP_FILECHUNK) {
+		if ((fd = netmsg_getfd(m)) < 0)
+			log_fatal("vm_filepart: netmsg_getfd");
+
+		engine_sendtofrontend(IMSG_FILECHUNK, key, fd, NULL);
+		return;
+	}
+
+	if ((label = netmsg_getlabel(m)) == NULL)
+		log_fatalx("vm_filepart: netmsg_getlabel: %s", netmsg_error(m));
+
+	if (netmsg_gettype(m) == NETOP_FILEBEGIN)
+		engine_sendtofrontend(IMSG_FILEBEGIN, key, -1, label);
+	else engine_sendtofrontend(IMSG_FILEEND, key, -1, label);
+
+	free(label);
+}
+
+/* the client's been holding off on the rest of its
+ * upload until the vm caught up
+ */
+static void
+vm_partstaken(uint32_t key, uint64_t count)
+{
+	char	countlabel[32];
+
+	snprintf(countlabel, sizeof(countlabel), "%llu", count);
+	engine_sendtofrontend(IMSG_PARTSTAKEN, key, -1, countlabel);
 }
 
 static void
 vm_signaldone(uint32_t key)
 {
+	memo_commit(key);
+
 	log_writex(LOGTYPE_DEBUG, "requesting termination");
-	engine_sendtofrontend(IMSG_REQUESTTERM, key, NULL);
+	engine_sendtofrontend(IMSG_REQUESTTERM, key, -1, NULL);
 }
 
 static void
 vm_reporterror(uint32_t key, char *error)
 {
-	engine_sendtofrontend(IMSG_ERROR, key, error);
+	memo_abandon(key);
+	engine_sendtofrontend(IMSG_ERROR, key, -1, error);
+}
+
+static int
+jobqueue_enqueue(uint32_t key, struct netmsg *archive)
+{
+	struct job	*j;
+	struct timeval	 tv;
+	int		 status = -1;
+
+	if (jobcount >= ENGINE_MAXQUEUE) {
+		errno = EAGAIN;
+		goto end;
+	} else if ((j = calloc(1, sizeof(struct job))) == NULL)
+		goto end;
+
+	if (slotmap_insertat(jobsbykey, key, j) < 0) {
+		free(j);
+		goto end;
+	}
+
+	j->key = key;
+	j->archive = archive;
+	TAILQ_INIT(&j->parts);
+
+	TAILQ_INSERT_TAIL(&jobqueue, j, entries);
+	jobcount++;
+
+	if (!evtimer_pending(&jobtimer, NULL)) {
+		tv.tv_sec = ENGINE_QUEUEINTERVAL;
+		tv.tv_usec = 0;
+		evtimer_add(&jobtimer, &tv);
+	}
+
+	status = 0;
+end:
+	return status;
+}
+
+/* the client went away before its job got a vm */
+static void
+jobqueue_cancel(uint32_t key)
+{
+	struct job	*j;
+
+	if ((j = slotmap_remove(jobsbykey, key)) == NULL)
+		return;
+
+	log_writex(LOGTYPE_DEBUG, "cancelling queued job for key %u", key);
+
+	TAILQ_REMOVE(&jobqueue, j, entries);
+	jobcount--;
+
+	netmsg_teardown(j->archive);
+	jobqueue_free(j, NULL);
+
+	jobqueue_sendpositions();
+}
+
+/* hold onto a piece of a file for a job that's still waiting
+ * on a vm. a file that would take the job past
+ * ENGINE_MAXPARTBYTES is dropped whole, both what's already
+ * here and the rest of it up to and including its end.
+ * returns -1 for a dropped piece, with errno set to EFBIG for
+ * the first one so the client hears about it only once. the
+ * chunks dropped won't ever reach a vm, so the client gets
+ * their places in its upload window back here
+ */
+static int
+jobqueue_addpart(struct job *j, struct netmsg *m)
+{
+	struct jobpart	*p;
+	uint64_t	 dropped = 0;
+	uint8_t		 type;
+	int		 status = -1;
+
+	type = netmsg_gettype(m);
+
+	if (j->rejecting) {
+		if (type == NETOP_FILEEND) j->rejecting = 0;
+		else if (type == NETOP_FILECHUNK) vm_partstaken(j->key, 1);
+
+		netmsg_teardown(m);
+		errno = ECANCELED;
+		goto end;
+	}
+
+	if (type == NETOP_FILECHUNK &&
+	    j->partbytes + netmsg_getdatasize(m) > ENGINE_MAXPARTBYTES) {
+		while ((p = TAILQ_LAST(&j->parts, jobparts)) != NULL) {
+			TAILQ_REMOVE(&j->parts, p, entries);
+			type = netmsg_gettype(p->m);
+
+			if (type == NETOP_FILECHUNK) {
+				j->partbytes -= netmsg_getdatasize(p->m);
+				dropped++;
+			}
+
+			netmsg_teardown(p->m);
+			free(p);
+
+			if (type == NETOP_FILEBEGIN) break;
+		}
+
+		j->rejecting = 1;
+		netmsg_teardown(m);
+		vm_partstaken(j->key, dropped + 1);
+
+		errno = EFBIG;
+		goto end;
+	}
+
+	if ((p = malloc(sizeof(struct jobpart))) == NULL)
+		log_fatal("jobqueue_addpart: malloc");
+
+	if (type == NETOP_FILECHUNK)
+		j->partbytes += netmsg_getdatasize(m);
+
+	p->m = m;
+	TAILQ_INSERT_TAIL(&j->parts, p, entries);
+	status = 0;
+end:
+	return status;
+}
+
+/* pass anything the job picked up while it waited
+ * on to v, or just drop it if there's no v
+ */
+static void
+jobqueue_free(struct job *j, struct vm *v)
+{
+	struct jobpart	*p;
+
+	while ((p = TAILQ_FIRST(&j->parts)) != NULL) {
+		TAILQ_REMOVE(&j->parts, p, entries);
+
+		if (v != NULL) vm_injectmsg(v, p->m);
+		else netmsg_teardown(p->m);
+
+		free(p);
+	}
+
+	free(j);
+}
+
+/* hand jobs to vms for as long as vms are ready. the
+ * frontend's message goes to the vm untouched, rather
+ * than being read in and written out again
+ */
+static void
+jobqueue_dispatch(void)
+{
+	struct job	*j;
+	struct vm	*v;
+	int		 dispatched = 0;
+
+	while ((j = TAILQ_FIRST(&jobqueue)) != NULL) {
+		if ((v = vm_claim(j->key, vmi)) == NULL) {
+			if (errno != EAGAIN)
+				log_fatal("jobqueue_dispatch: vm_claim");
+			break;
+		}
+
+		TAILQ_REMOVE(&jobqueue, j, entries);
+		slotmap_remove(jobsbykey, j->key);
+		jobcount--;
+
+		log_writex(LOGTYPE_DEBUG, "dispatching job for key %u", j->key);
+
+		vm_injectmsg(v, j->archive);
+		engine_sendtofrontend(IMSG_INITIALIZED, j->key, -1, NULL);
+
+		jobqueue_free(j, v);
+		dispatched = 1;
+	}
+
+	if (dispatched) jobqueue_sendpositions();
+}
+
+static void
+jobqueue_sendpositions(void)
+{
+	struct job	*j;
+	char		 position[16];
+	uint32_t	 i = 1;
+
+	TAILQ_FOREACH(j, &jobqueue, entries) {
+		snprintf(position, sizeof(position), "%u", i++);
+		engine_sendtofrontend(IMSG_QUEUEPOSITION, j->key, -1, position);
+	}
+}
+
+static void
+jobqueue_tick(int fd, short event, void *arg)
+{
+	struct timeval	tv;
+
+	if (TAILQ_EMPTY(&jobqueue)) return;
+
+	jobqueue_sendpositions();
+
+	tv.tv_sec = ENGINE_QUEUEINTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&jobtimer, &tv);
+
+	(void)fd;
+	(void)event;
+	(void)arg;
+}
+
+static void
+linebatch_add(uint32_t key, char *line)
+{
+	struct linebatch	*b;
+	struct timeval		 tv;
+	size_t			 len;
+
+	len = strlen(line);
+	b = slotmap_get(batchesbykey, key);
+
+	/* leave room for the newline and terminator */
+	if (b != NULL && b->len + len + 2 > ENGINE_LINEBATCH) {
+		linebatch_flush(key);
+		b = NULL;
+	}
+
+	/* a line with newlines of its own would read as
+	 * several once batched, and throw off the client's acks
+	 */
+	if (len + 2 > ENGINE_LINEBATCH || strchr(line, '\n') != NULL) {
+		engine_sendtofrontend(IMSG_SENDLINE, key, -1, line);
+		return;
+	}
+
+	if (b == NULL) {
+		if ((b = malloc(sizeof(struct linebatch))) == NULL)
+			log_fatal("linebatch_add: malloc");
+		else if (slotmap_insertat(batchesbykey, key, b) < 0)
+			log_fatal("linebatch_add: slotmap_insertat");
+
+		b->key = key;
+		b->len = 0;
+
+		tv.tv_sec = 0;
+		tv.tv_usec = ENGINE_LINEFLUSH;
+
+		evtimer_set(&b->timer, linebatch_expire, b);
+		evtimer_add(&b->timer, &tv);
+	}
+
+	memcpy(b->text + b->len, line, len);
+	b->len += len;
+
+	b->text[b->len++] = '\n';
+	b->text[b->len] = '\0';
+}
+
+static void
+linebatch_flush(uint32_t key)
+{
+	struct linebatch	*b;
+
+	if ((b = slotmap_remove(batchesbykey, key)) == NULL)
+		return;
+
+	evtimer_del(&b->timer);
+	engine_sendtofrontend(IMSG_SENDLINES, key, -1, b->text);
+	free(b);
+}
+
+/* the client went away, so nobody's reading these */
+static void
+linebatch_drop(uint32_t key)
+{
+	struct linebatch	*b;
+
+	if ((b = slotmap_remove(batchesbykey, key)) == NULL)
+		return;
+
+	evtimer_del(&b->timer);
+	free(b);
+}
+
+static void
+linebatch_expire(int fd, short event, void *arg)
+{
+	struct linebatch	*b = arg;
+
+	linebatch_flush(b->key);
+
+	(void)fd;
+	(void)event;
 }
 
 static void
 proc_getmsgfromfrontend(int type, int fd, struct ipcmsg *msg)
 {
-	struct netmsg	*weakmsg;
+	struct netmsg	*archive, *part;
+	struct job	*j;
 	struct vm	*v;
 
+	const char	*errstr;
 	char		*msgtext;
-	char		*wbfile;
-	char		*fname, *fdata;
-
-	uint64_t	 fdatasize;
+	char		 position[16];
+	uint64_t	 total;
 	uint32_t	 key;
+	int		 memofd, replaying;
 
 	msgtext = ipcmsg_getmsg(msg);
 	key = ipcmsg_getkey(msg);
 
-	if (type != IMSG_PUTARCHIVE)
-		if ((v = vm_fromkey(key)) == NULL)
-			log_fatal("proc_getmsgfromfrontend: vm_fromkey");
+	/* a queued job has no vm yet, so only the archive
+	 * itself, files to go with it and a cancellation
+	 * make sense for it. one being replayed only
+	 * needs acks
+	 */
+	v = vm_fromkey(key);
+	j = (v == NULL) ? slotmap_get(jobsbykey, key) : NULL;
+	replaying = (v == NULL) ? memo_isreplaying(key) : 0;
+
+	if (v == NULL && type != IMSG_PUTARCHIVE && type != IMSG_TERMINATE &&
+	    (j == NULL || (type != IMSG_FILEBEGIN && type != IMSG_FILECHUNK &&
+	    type != IMSG_FILEEND)) && (!replaying || type != IMSG_CLIENTACK)) {
+		if (fd >= 0) close(fd);
+		if (type == IMSG_FILECHUNK) vm_partstaken(key, 1);
+
+		engine_sendtofrontend(IMSG_ERROR, key, -1,
+			"job has not started running yet");
+		free(msgtext);
+		return;
+	}
 
 	switch (type) {
 	case IMSG_PUTARCHIVE:
-		v = vm_claim(key, vmi);
-		if (v == NULL) {
-			engine_sendtofrontend(IMSG_ERROR, key,
-				"no worker machines are available right now, try again later");
+		if (fd < 0)
+			log_fatalx("proc_getmsgfromfrontend: archive arrived without a descriptor");
+
+		if (v != NULL || j != NULL || replaying) {
+			close(fd);
+			engine_sendtofrontend(IMSG_ERROR, key, -1,
+				"received multiple sendfile messages when only one expected");
 			break;
 		}
 
-		weakmsg = netmsg_loadweakly(msgtext);
+		if ((archive = netmsg_loadweakly(fd)) == NULL)
+			log_fatal("proc_getmsgfromfrontend: netmsg_loadweakly");
 
-		/* XXX: same race condition as in bundled. if the frontend tears
-		 * down the netmsg before we are able to load it, do nothing
+		if (netmsg_gettype(archive) != NETOP_SENDFILE)
+			log_fatalx("proc_getmsgfromfrontend: archive has opcode %u",
+				netmsg_gettype(archive));
+
+		/* the frontend names the bundle if the client
+		 * would like its job remembered
 		 */
-		if (weakmsg == NULL) {
-			if (errno == ENOENT) break;
-			else log_fatal("proc_getmsgfromfrontend: netmsg_loadweakly");
+		if (*msgtext != '\0') {
+			if ((memofd = memo_lookup(msgtext)) >= 0) {
+				netmsg_teardown(archive);
+
+				engine_sendtofrontend(IMSG_INITIALIZED, key, -1, NULL);
+				memo_replay(key, memofd, vmi);
+				break;
+			}
+
+			memo_record(key, msgtext);
 		}
 
-		fname = netmsg_getlabel(weakmsg);
-		if (fname == NULL)
-			log_fatalx("proc_getmsgfromfrontend: netmsg_getlabel: %s",
-				netmsg_error(weakmsg));
+		if (jobqueue_enqueue(key, archive) < 0) {
+			if (errno != EAGAIN)
+				log_fatal("proc_getmsgfromfrontend: jobqueue_enqueue");
+
+			memo_abandon(key);
+			netmsg_teardown(archive);
+			engine_sendtofrontend(IMSG_ERROR, key, -1,
+				"too many jobs are waiting for worker machines, try again later");
+			break;
+		}
 
-		fdata = netmsg_getdata(weakmsg, &fdatasize);
-		if (fdata == NULL)
-			log_fatalx("proc_getmsgfromfrontend: netmsg_getdata: %s",
-				netmsg_error(weakmsg));
-		
-		vm_injectfile(v, fname, fdata, (size_t)fdatasize);
+		jobqueue_dispatch();
 
-		engine_sendtofrontend(IMSG_INITIALIZED, key, NULL);
+		/* still waiting at the back of the line, so let
+		 * them know where they stand
+		 */
+		if (slotmap_get(jobsbykey, key) != NULL) {
+			snprintf(position, sizeof(position), "%u", jobcount);
+			engine_sendtofrontend(IMSG_QUEUEPOSITION, key, -1, position);
+		}
 
-		free(fname);
-		free(fdata);
-		netmsg_teardown(weakmsg);
 		break;
 
 	case IMSG_SENDLINE:
+		memo_abandon(key);
 		vm_injectline(v, msgtext);
 		break;
 
+	case IMSG_FILEBEGIN:
+	case IMSG_FILEEND:
+		memo_abandon(key);
+
+		part = netmsg_build((type == IMSG_FILEBEGIN) ? NETOP_FILEBEGIN : NETOP_FILEEND,
+			msgtext, NULL, 0);
+		if (part == NULL)
+			log_fatal("proc_getmsgfromfrontend: netmsg_build");
+
+		if (v != NULL) vm_injectmsg(v, part);
+		else (void)jobqueue_addpart(j, part);
+		break;
+
+	case IMSG_FILECHUNK:
+		if (fd < 0)
+			log_fatalx("proc_getmsgfromfrontend: chunk arrived without a descriptor");
+		else if ((part = netmsg_loadweakly(fd)) == NULL)
+			log_fatal("proc_getmsgfromfrontend: netmsg_loadweakly");
+
+		memo_abandon(key);
+
+		if (v != NULL)
+			vm_injectmsg(v, part);
+		else if (jobqueue_addpart(j, part) < 0 && errno == EFBIG)
+			engine_sendtofrontend(IMSG_ERROR, key, -1,
+				"file is too large to hold while the job waits "
+				"for a worker machine");
+		break;
+
 	case IMSG_CLIENTACK:
-		wbfile = (char *)vm_clearaux(v);
-		if (wbfile != NULL) {
-			log_writex(LOGTYPE_DEBUG, "td");
-			wbfile_teardown(wbfile);
+		if (*msgtext == '\0') {
+			if (replaying) memo_injectack(key);
+			else vm_injectack(v);
+			break;
 		}
 
-		vm_injectack(v);
+		/* the frontend vetted the number, but it could
+		 * still cover more than the vm has actually sent
+		 */
+		total = strtonum(msgtext, 0, LLONG_MAX, &errstr);
+		if (errstr != NULL || (replaying ? memo_injectacks(key, total) :
+		    vm_injectacks(v, total)) < 0)
+			engine_sendtofrontend(IMSG_ERROR, key, -1,
+				"acknowledged messages that were never sent");
 		break;
 
 	case IMSG_TERMINATE:
-		wbfile = (char *)vm_clearaux(v);
-		if (wbfile != NULL) {
-			log_writex(LOGTYPE_DEBUG, "td");
-			wbfile_teardown(wbfile);
-		}
+		linebatch_drop(key);
+		memo_abandon(key);
 
-		vm_release(v);
+		if (v != NULL) vm_release(v);
+		else if (replaying) memo_cancel(key);
+		else jobqueue_cancel(key);
 		break;
 
 	default:
@@ -170,18 +670,17 @@ proc_getmsgfromfrontend(int type, int fd, struct ipcmsg *msg)
 	}
 
 	free(msgtext);
-	(void)fd;
 }
 
 void
 engine_launch(void)
 {
-	if (unveil(WRITEBACK, "rwc") < 0)
-		log_fatal("unveil %s", WRITEBACK);
-	else if (unveil(FRONTEND_MESSAGES, "r") < 0)
-		log_fatal("unveil %s", FRONTEND_MESSAGES);
-	else if (unveil(ENGINE_MESSAGES, "rwc") < 0)
+	memo_init();
+
+	if (unveil(ENGINE_MESSAGES, "rwc") < 0)
 		log_fatal("unveil %s", ENGINE_MESSAGES);
+	else if (unveil(ENGINE_MEMO, "rwc") < 0)
+		log_fatal("unveil %s", ENGINE_MEMO);
 	else if (unveil(DISKS, "c") < 0)
 		log_fatal("unveil %s", DISKS);
 
@@ -190,10 +689,18 @@ engine_launch(void)
 	else if (unveil("/usr/libexec/ld.so", "r") < 0)
 		log_fatal("unveil ld.so");
 
-	if (pledge("stdio rpath wpath cpath proc exec inet", NULL) < 0)
+	if (pledge("stdio rpath wpath cpath proc exec inet sendfd recvfd", NULL) < 0)
 		log_fatal("pledge");
 
+	if ((jobsbykey = slotmap_new()) == NULL)
+		log_fatal("slotmap_new");
+	else if ((batchesbykey = slotmap_new()) == NULL)
+		log_fatal("slotmap_new");
+
+	evtimer_set(&jobtimer, jobqueue_tick, NULL);
+
 	vm_init();
+	vm_setreadycb(jobqueue_dispatch);
 
 	myproc_listen(PROC_PARENT, nothing);
 	myproc_listen(PROC_FRONTEND, proc_getmsgfromfrontend);
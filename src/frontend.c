@@ -6,7 +6,7 @@
 #include <sys/queue.h>
 #include <sys/socket.h>
 #include <sys/time.h>
-#include <sys/tree.h>
+#include <sys/uio.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -14,7 +14,9 @@
 #include <errno.h>
 #include <event.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pwd.h>
+#include <sha2.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,24 +27,51 @@
 
 #define FRONTEND_ADDRESSSIZE	16
 
+/* the most a sendfile message can take up on the wire */
+#define FRONTEND_MAXBUNDLE	(1 + 2 * sizeof(uint64_t) + MAXNAMESIZE + MAXFILESIZE)
+
+struct deltachunk {
+	char			 hash[SHA256_DIGEST_STRING_LENGTH];
+	uint64_t		 offset;
+	size_t			 size;
+	int			 needed;
+};
+
+/* a bundle being put back together from a manifest,
+ * in a sendfile message of its own
+ */
+struct delta {
+	struct netmsg		*m;
+	struct deltachunk	*chunks;
+	uint32_t		 count, missing;
+};
+
 struct activeconn {
 	struct conn		*c;
 	uint32_t	 	 backendkey;
 
 	int			 shouldheartbeat;
+	int			 submitted;
 	int			 initialized;
+	int			 batching;
+	int			 memoize;
+	int			 announced;
+
+	/* a chunked file on its way in, where its next
+	 * chunk ought to start and how many chunks the vm
+	 * has yet to take off our hands
+	 */
+	int			 uploading;
+	uint64_t		 uploadoffset;
+	uint64_t		 uploadsinflight;
+
+	struct delta		*delta;
 	char			 peer[FRONTEND_ADDRESSSIZE];
 
-	struct netmsg		*pendingmsg;
-
 	SLIST_ENTRY(activeconn)	 freelist_entries;
-	RB_ENTRY(activeconn)	 bykey_entries;
-	RB_ENTRY(activeconn)	 byptr_entries;
 };
 
 SLIST_HEAD(freelist, activeconn);
-RB_HEAD(activekeytree, activeconn);
-RB_HEAD(activeptrtree, activeconn);
 
 static struct activeconn	*activeconn_new(struct conn *);
 static void			 activeconn_handleteardown(struct conn *);
@@ -50,29 +79,29 @@ static void			 activeconn_handleteardown(struct conn *);
 static struct activeconn	*activeconn_bykey(uint32_t);
 static struct activeconn	*activeconn_byptr(struct conn *);
 
-static int			 activeconn_comparekeys(struct activeconn *, struct activeconn *);
-static int			 activeconn_compareptrs(struct activeconn *, struct activeconn *);
-
 static void			 activeconn_errortoclient(struct activeconn *, const char *, ...);
-static void			 activeconn_requesttoengine(struct activeconn *, int, char *);
+static void			 activeconn_requesttoengine(struct activeconn *, int, int, char *);
+static int			 activeconn_forwardpart(struct activeconn *, struct netmsg *);
+static void			 activeconn_submit(struct activeconn *, struct netmsg *);
+
+static int			 activeconn_startdelta(struct activeconn *, struct netmsg *);
+static int			 activeconn_putchunk(struct activeconn *, struct netmsg *);
+static void			 activeconn_finishdelta(struct activeconn *);
+static void			 activeconn_dropdelta(struct activeconn *);
 
 static void	conn_accept(struct conn *);
 static void	conn_timeout(struct conn *);
 static void	conn_getmsg(struct conn *, struct netmsg *);
 static void	proc_getmsg(int, int, struct ipcmsg *);
 
-static uint32_t			maxkey = 0;
-
 static struct freelist		freeconns = SLIST_HEAD_INITIALIZER(freeconns);
-static struct activekeytree	connsbykey = RB_INITIALIZER(&connsbykey);
-static struct activeptrtree	connsbyptr = RB_INITIALIZER(&connsbyptr);
-
 
-RB_PROTOTYPE_STATIC(activekeytree, activeconn, bykey_entries, activeconn_comparekeys)
-RB_PROTOTYPE_STATIC(activeptrtree, activeconn, byptr_entries, activeconn_compareptrs)
-
-RB_GENERATE_STATIC(activekeytree, activeconn, bykey_entries, activeconn_comparekeys)
-RB_GENERATE_STATIC(activeptrtree, activeconn, byptr_entries, activeconn_compareptrs)
+/* backend keys are handles into connsbykey, so a reply for
+ * a connection that went away can't land on its successor.
+ * connsbyconn mirrors the conn layer's own handles
+ */
+static struct slotmap		*connsbykey;
+static struct slotmap		*connsbyconn;
 
 
 static struct activeconn *
@@ -86,17 +115,16 @@ activeconn_new(struct conn *c)
 		SLIST_REMOVE_HEAD(&freeconns, freelist_entries);
 
 	} else {
-		if (maxkey == UINT32_MAX) {
-			errno = EAGAIN;
-			goto end;
-		}
-
 		/* explicitly zero data structure fields */
 		out = calloc(1, sizeof(struct activeconn));
 		if (out == NULL)
 			log_fatal("activeconn_new: malloc");
+	}
 
-		out->backendkey = ++maxkey;
+	if (slotmap_insert(connsbykey, out, &out->backendkey) < 0) {
+		SLIST_INSERT_HEAD(&freeconns, out, freelist_entries);
+		out = NULL;
+		goto end;
 	}
 
 	peer = conn_getsockpeer(c);
@@ -110,8 +138,8 @@ activeconn_new(struct conn *c)
 
 	out->c = c;
 
-	RB_INSERT(activekeytree, &connsbykey, out);
-	RB_INSERT(activeptrtree, &connsbyptr, out);
+	if (slotmap_insertat(connsbyconn, conn_gethandle(c), out) < 0)
+		log_fatal("activeconn_new: slotmap_insertat");
 end:
 	return out;
 }
@@ -123,21 +151,26 @@ activeconn_handleteardown(struct conn *c)
 
 	ac = activeconn_byptr(c);
 
-	if (ac->initialized)
-		activeconn_requesttoengine(ac, IMSG_TERMINATE, NULL);
+	/* a job still waiting in the engine's queue
+	 * needs cancelling just like a running one
+	 */
+	if (ac->submitted)
+		activeconn_requesttoengine(ac, IMSG_TERMINATE, -1, NULL);
 
-	RB_REMOVE(activekeytree, &connsbykey, ac);
-	RB_REMOVE(activeptrtree, &connsbyptr, ac);
+	slotmap_remove(connsbykey, ac->backendkey);
+	slotmap_remove(connsbyconn, conn_gethandle(c));
 
 	ac->c = NULL;
 	ac->shouldheartbeat = 0;
+	ac->submitted = 0;
 	ac->initialized = 0;
-
-	if (ac->pendingmsg != NULL) {
-		log_writex(LOGTYPE_WARN, "tearing down pending message for peer %s", ac->peer);
-		netmsg_teardown(ac->pendingmsg);
-		ac->pendingmsg = NULL;
-	}
+	ac->batching = 0;
+	ac->memoize = 0;
+	ac->announced = 0;
+	ac->uploading = 0;
+	ac->uploadoffset = 0;
+	ac->uploadsinflight = 0;
+	activeconn_dropdelta(ac);
 
 	SLIST_INSERT_HEAD(&freeconns, ac, freelist_entries);
 }
@@ -145,10 +178,9 @@ activeconn_handleteardown(struct conn *c)
 static struct activeconn *
 activeconn_bykey(uint32_t key)
 {
-	struct activeconn	*out, dummy;
+	struct activeconn	*out;
 
-	dummy.backendkey = key;
-	out = RB_FIND(activekeytree, &connsbykey, &dummy);
+	out = slotmap_get(connsbykey, key);
 
 	if (out == NULL) errno = EINVAL;
 	return out;
@@ -157,39 +189,16 @@ activeconn_bykey(uint32_t key)
 static struct activeconn *
 activeconn_byptr(struct conn *c)
 {
-	struct activeconn	*out, dummy;
+	struct activeconn	*out;
 
-	dummy.c = c;
-	out = RB_FIND(activeptrtree, &connsbyptr, &dummy);
+	out = slotmap_get(connsbyconn, conn_gethandle(c));
 
 	if (out == NULL)
-		log_fatal("activeconn_byptr: no such conn %p", c);
+		log_fatalx("activeconn_byptr: no such conn %p", c);
 
 	return out;
 }
 
-static int
-activeconn_comparekeys(struct activeconn *a, struct activeconn *b)
-{
-	int	result = 0;	
-
-	if (a->backendkey > b->backendkey) result = 1;
-	if (a->backendkey < b->backendkey) result = -1;
-
-	return result;
-}
-
-static int
-activeconn_compareptrs(struct activeconn *a, struct activeconn *b)
-{
-	int	result = 0;
-
-	if ((uintptr_t)a->c > (uintptr_t)b->c) result = 1;
-	if ((uintptr_t)a->c < (uintptr_t)b->c) result = -1;
-
-	return result;
-}
-
 static void
 activeconn_errortoclient(struct activeconn *ac, const char *fmt, ...)
 {
@@ -202,12 +211,9 @@ activeconn_errortoclient(struct activeconn *ac, const char *fmt, ...)
 	if (vasprintf(&label, fmt, ap) < 0)
 		log_fatal("activeconn_errortoclient: asprintf");
 		
-	response = netmsg_new(NETOP_ERROR);
+	response = netmsg_build(NETOP_ERROR, label, NULL, 0);
 	if (response == NULL)
-		log_fatal("activeconn_errortoclient: netmsg_new");
-
-	if (netmsg_setlabel(response, label) < 0)
-		log_fatalx("activeconn_errortoclient: netmsg_setlabel: %s", netmsg_error(response));
+		log_fatal("activeconn_errortoclient: netmsg_build");
 
 	conn_send(ac->c, response);
 	log_writex(LOGTYPE_DEBUG, "sent error '%s' to client", label);
@@ -217,19 +223,330 @@ activeconn_errortoclient(struct activeconn *ac, const char *fmt, ...)
 }
 
 static void
-activeconn_requesttoengine(struct activeconn *ac, int request, char *label)
+activeconn_requesttoengine(struct activeconn *ac, int request, int fd, char *label)
 {
 	struct ipcmsg	*imsg;
 
 	imsg = ipcmsg_new(ac->backendkey, label);
 	if (imsg == NULL) log_fatal("activeconn_requesttoengine: ipcmsg_new");
 
-	myproc_send(PROC_ENGINE, request, -1, imsg);
+	myproc_send(PROC_ENGINE, request, fd, imsg);
 	ipcmsg_teardown(imsg);
 
 	conn_stopreceiving(ac->c);
 }
 
+/* pass a piece of a chunked upload on to the engine,
+ * provided it picks up right where the last one left off
+ */
+static int
+activeconn_forwardpart(struct activeconn *ac, struct netmsg *m)
+{
+	const char	*errstr = NULL;
+	char		*label;
+	uint64_t	 claimed;
+	int		 fd, status = -1;
+
+	if ((label = netmsg_getlabel(m)) == NULL)
+		log_fatalx("activeconn_forwardpart: netmsg_getlabel: %s", netmsg_error(m));
+
+	if (!ac->submitted) {
+		activeconn_errortoclient(ac, "received file before the job it belongs to");
+		goto end;
+	}
+
+	if (netmsg_gettype(m) == NETOP_FILEBEGIN) {
+		if (ac->uploading) {
+			activeconn_errortoclient(ac, "received new file while another was in progress");
+			goto end;
+		}
+
+		ac->uploading = 1;
+		ac->uploadoffset = 0;
+
+		activeconn_requesttoengine(ac, IMSG_FILEBEGIN, -1, label);
+
+	} else {
+		if (!ac->uploading) {
+			activeconn_errortoclient(ac, "received file chunk with no file in progress");
+			goto end;
+		}
+
+		claimed = strtonum(label, 0, LLONG_MAX, &errstr);
+		if (errstr != NULL || claimed != ac->uploadoffset) {
+			activeconn_errortoclient(ac, "received file chunk at offset %s, expected %llu",
+				label, ac->uploadoffset);
+			goto end;
+		}
+
+		if (netmsg_gettype(m) == NETOP_FILEEND) {
+			ac->uploading = 0;
+			activeconn_requesttoengine(ac, IMSG_FILEEND, -1, label);
+
+		} else {
+			if ((fd = netmsg_getfd(m)) < 0)
+				log_fatalx("activeconn_forwardpart: netmsg_getfd: %s", netmsg_error(m));
+
+			ac->uploadoffset += netmsg_getdatasize(m);
+			ac->uploadsinflight++;
+			activeconn_requesttoengine(ac, IMSG_FILECHUNK, fd, NULL);
+		}
+	}
+
+	/* the engine only answers once the vm has taken
+	 * chunks off its hands, so keep going until the
+	 * client's got a window's worth out
+	 */
+	if (ac->uploadsinflight < FRONTEND_UPLOADWINDOW)
+		conn_receive(ac->c, conn_getmsg);
+	status = 0;
+end:
+	free(label);
+	return status;
+}
+
+/* hand a complete bundle over to the engine, holding
+ * on to it if the client announced it, i.e. would like to
+ * skip sending it next time. the engine hears its hash if
+ * the job should be remembered
+ */
+static void
+activeconn_submit(struct activeconn *ac, struct netmsg *m)
+{
+	char	hash[SHA256_DIGEST_STRING_LENGTH];
+	int	fd, hashed;
+
+	/* the engine gets its own handle on the upload, so
+	 * it doesn't matter when ours goes away
+	 */
+	if ((fd = netmsg_getfd(m)) < 0)
+		log_fatalx("activeconn_submit: netmsg_getfd: %s", netmsg_error(m));
+
+	/* hashing holds up everybody else, so only bother
+	 * for clients that will look the bundle up later
+	 */
+	hashed = (ac->announced || ac->memoize) && cache_insert(m, hash) == 0;
+
+	activeconn_requesttoengine(ac, IMSG_PUTARCHIVE, fd,
+		(ac->memoize && hashed) ? hash : NULL);
+	ac->submitted = 1;
+}
+
+/* fill in everything a manifest names that we have
+ * already, and tell the client what's left
+ */
+static int
+activeconn_startdelta(struct activeconn *ac, struct netmsg *m)
+{
+	static char		 chunk[CHUNK_MAXSIZE];
+	struct netmsg		*response;
+	struct delta		*d;
+	struct deltachunk	*dc;
+	struct iovec		 iov;
+	const char		*errstr = NULL;
+	char			*label, *data, *line, *end, *size, *wanted = NULL;
+	char			 countlabel[32];
+	uint64_t		 datasize, total, offset = 0;
+	uint32_t		 i, lines = 0;
+	size_t			 wantedlen = 0;
+	int			 status = -1;
+
+	if ((label = netmsg_getlabel(m)) == NULL)
+		log_fatalx("activeconn_startdelta: netmsg_getlabel: %s", netmsg_error(m));
+	else if ((data = netmsg_getdata(m, &datasize)) == NULL)
+		log_fatalx("activeconn_startdelta: netmsg_getdata: %s", netmsg_error(m));
+
+	if ((data = realloc(data, datasize + 1)) == NULL)
+		log_fatal("activeconn_startdelta: realloc");
+
+	data[datasize] = '\0';
+
+	if (ac->submitted || ac->delta != NULL) {
+		activeconn_errortoclient(ac, "received manifest for a second bundle "
+			"when only one expected - likely a client bug!");
+		goto end;
+	}
+
+	total = strtonum(label, 1, FRONTEND_MAXBUNDLE, &errstr);
+	if (errstr != NULL) {
+		activeconn_errortoclient(ac, "received manifest of bad size %s: %s", label, errstr);
+		goto end;
+	}
+
+	for (line = data; (line = strchr(line, '\n')) != NULL; line++)
+		lines++;
+
+	/* chunks are never smaller than CHUNK_MINSIZE except at
+	 * the end, which bounds how many the client can make us track
+	 */
+	if (lines == 0 || lines > total / CHUNK_MINSIZE + 1 ||
+	    (datasize > 0 && data[datasize - 1] != '\n')) {
+		activeconn_errortoclient(ac, "received manifest with bad chunk list");
+		goto end;
+	}
+
+	if ((d = calloc(1, sizeof(struct delta))) == NULL)
+		log_fatal("activeconn_startdelta: calloc");
+	else if ((d->chunks = calloc(lines, sizeof(struct deltachunk))) == NULL)
+		log_fatal("activeconn_startdelta: calloc");
+
+	ac->delta = d;
+
+	for (line = data; (end = strchr(line, '\n')) != NULL; line = end + 1) {
+		*end = '\0';
+		dc = &d->chunks[d->count++];
+
+		if ((size = strchr(line, ' ')) != NULL) *size++ = '\0';
+		dc->size = (size == NULL) ? 0 : strtonum(size, 1, CHUNK_MAXSIZE, &errstr);
+
+		if (dc->size == 0 || strlcpy(dc->hash, line, sizeof(dc->hash)) >= sizeof(dc->hash) ||
+		    (dc->size < CHUNK_MINSIZE && d->count < lines)) {
+			activeconn_errortoclient(ac, "received manifest with bad chunk %u", d->count - 1);
+			goto end;
+		}
+
+		dc->offset = offset;
+		offset += dc->size;
+	}
+
+	if (offset != total) {
+		activeconn_errortoclient(ac, "received manifest totalling %llu bytes, expected %llu",
+			offset, total);
+		goto end;
+	}
+
+	if ((d->m = netmsg_new(NETOP_SENDFILE)) == NULL)
+		log_fatal("activeconn_startdelta: netmsg_new");
+
+	for (i = 0; i < d->count; i++) {
+		dc = &d->chunks[i];
+
+		if (cache_readchunk(dc->hash, chunk, dc->size) < 0) {
+			if (errno != ENOENT) {
+				activeconn_errortoclient(ac, "received manifest with bad hash %s", dc->hash);
+				goto end;
+			}
+
+			dc->needed = 1;
+			d->missing++;
+			continue;
+		}
+
+		if (netmsg_seek(d->m, dc->offset, SEEK_SET) < 0 ||
+		    netmsg_write(d->m, chunk, dc->size) != (ssize_t)dc->size)
+			log_fatalx("activeconn_startdelta: netmsg_write: %s", netmsg_error(d->m));
+	}
+
+	if ((wanted = reallocarray(NULL, d->missing, sizeof(countlabel))) == NULL && d->missing > 0)
+		log_fatal("activeconn_startdelta: reallocarray");
+
+	for (i = 0; i < d->count; i++)
+		if (d->chunks[i].needed)
+			wantedlen += snprintf(wanted + wantedlen, sizeof(countlabel), "%u\n", i);
+
+	snprintf(countlabel, sizeof(countlabel), "%u", d->missing);
+
+	iov.iov_base = wanted;
+	iov.iov_len = wantedlen;
+
+	response = netmsg_build(NETOP_MANIFEST, countlabel, &iov, 1);
+	if (response == NULL)
+		log_fatal("activeconn_startdelta: netmsg_build");
+
+	conn_send(ac->c, response);
+	log_writex(LOGTYPE_DEBUG, "manifest of %u chunks, %u of them missing",
+		d->count, d->missing);
+
+	if (d->missing == 0) activeconn_finishdelta(ac);
+	status = 0;
+end:
+	if (status < 0) activeconn_dropdelta(ac);
+
+	free(label);
+	free(data);
+	free(wanted);
+	return status;
+}
+
+static int
+activeconn_putchunk(struct activeconn *ac, struct netmsg *m)
+{
+	struct delta		*d = ac->delta;
+	struct deltachunk	*dc;
+	const char		*errstr = NULL;
+	char			*label, *data = NULL;
+	uint64_t		 datasize;
+	uint32_t		 index;
+	int			 status = -1;
+
+	if ((label = netmsg_getlabel(m)) == NULL)
+		log_fatalx("activeconn_putchunk: netmsg_getlabel: %s", netmsg_error(m));
+
+	if (d == NULL) {
+		activeconn_errortoclient(ac, "received chunk with no manifest in progress");
+		goto end;
+	}
+
+	index = strtonum(label, 0, d->count - 1, &errstr);
+	if (errstr != NULL || !d->chunks[index].needed) {
+		activeconn_errortoclient(ac, "received unexpected chunk %s", label);
+		goto end;
+	}
+
+	dc = &d->chunks[index];
+
+	if ((data = netmsg_getdata(m, &datasize)) == NULL)
+		log_fatalx("activeconn_putchunk: netmsg_getdata: %s", netmsg_error(m));
+
+	if (datasize != dc->size || cache_putchunk(dc->hash, data, datasize) < 0) {
+		activeconn_errortoclient(ac, "received chunk %s not matching the manifest", label);
+		goto end;
+	}
+
+	if (netmsg_seek(d->m, dc->offset, SEEK_SET) < 0 ||
+	    netmsg_write(d->m, data, dc->size) != (ssize_t)dc->size)
+		log_fatalx("activeconn_putchunk: netmsg_write: %s", netmsg_error(d->m));
+
+	dc->needed = 0;
+	if (--d->missing == 0) activeconn_finishdelta(ac);
+
+	status = 0;
+end:
+	free(label);
+	free(data);
+	return status;
+}
+
+static void
+activeconn_finishdelta(struct activeconn *ac)
+{
+	int	fatal;
+
+	/* the chunks hash right, but that says nothing
+	 * about whether they add up to a sendfile
+	 */
+	if (netmsg_isvalid(ac->delta->m, &fatal) <= 0)
+		activeconn_errortoclient(ac, "reassembled bundle is not a valid sendfile message");
+	else {
+		log_writex(LOGTYPE_DEBUG, "reassembled bundle from %u chunks", ac->delta->count);
+		activeconn_submit(ac, ac->delta->m);
+	}
+
+	activeconn_dropdelta(ac);
+}
+
+static void
+activeconn_dropdelta(struct activeconn *ac)
+{
+	if (ac->delta == NULL) return;
+
+	if (ac->delta->m != NULL) netmsg_teardown(ac->delta->m);
+
+	free(ac->delta->chunks);
+	free(ac->delta);
+	ac->delta = NULL;
+}
+
 static void
 conn_accept(struct conn *c)
 {
@@ -247,6 +564,7 @@ conn_accept(struct conn *c)
 	tv.tv_usec = 0;
 
 	conn_settimeout(ac->c, &tv, conn_timeout);
+	conn_setcompress(ac->c, FRONTEND_COMPRESS);
 	conn_setteardowncb(ac->c, activeconn_handleteardown);
 	conn_receive(ac->c, conn_getmsg);
 }
@@ -279,7 +597,10 @@ static void
 conn_getmsg(struct conn *c, struct netmsg *m)
 {
 	struct activeconn	*ac;
-	char			*msgpath, *msglabel;
+	struct netmsg		*response;
+	const char		*errstr;
+	char			*msglabel;
+	int			 msgfd;
 
 	ac = activeconn_byptr(c);
 	ac->shouldheartbeat = 0;
@@ -306,7 +627,7 @@ conn_getmsg(struct conn *c, struct netmsg *m)
 
 	case NETOP_SENDLINE:
 		msglabel = netmsg_getlabel(m);
-		activeconn_requesttoengine(ac, IMSG_SENDLINE, msglabel);
+		activeconn_requesttoengine(ac, IMSG_SENDLINE, -1, msglabel);
 
 		free(msglabel);
 		break;
@@ -318,16 +639,89 @@ conn_getmsg(struct conn *c, struct netmsg *m)
 			return;
 		}
 
-		msgpath = netmsg_getpath(m);
-		netmsg_retain(m);
-		ac->pendingmsg = m;
+		activeconn_submit(ac, m);
+		break;
 
-		activeconn_requesttoengine(ac, IMSG_PUTARCHIVE, msgpath);
-		free(msgpath);
+	case NETOP_MANIFEST:
+		if (activeconn_startdelta(ac, m) < 0) return;
+		break;
+
+	case NETOP_MEMOIZE:
+		if (ac->submitted) {
+			activeconn_errortoclient(ac, "received memoize request after the bundle "
+				"it applies to - likely a client bug!");
+			return;
+		}
+
+		ac->memoize = 1;
+		break;
+
+	case NETOP_CHUNK:
+		if (activeconn_putchunk(ac, m) < 0) return;
+		break;
+
+	case NETOP_ANNOUNCE:
+		if (ac->submitted) {
+			activeconn_errortoclient(ac, "received bundle announcement "
+				"after the bundle itself - likely a client bug!");
+			return;
+		}
+
+		msglabel = netmsg_getlabel(m);
+
+		if ((msgfd = cache_lookup(msglabel)) < 0 && errno != ENOENT) {
+			activeconn_errortoclient(ac, "received bad bundle hash %s", msglabel);
+			free(msglabel);
+			return;
+		}
+
+		response = netmsg_build(NETOP_ANNOUNCE, (msgfd < 0) ? "miss" : "hit", NULL, 0);
+		if (response == NULL)
+			log_fatal("conn_getmsg: netmsg_build");
+
+		conn_send(ac->c, response);
+		log_writex(LOGTYPE_DEBUG, "bundle %s %s", msglabel,
+			(msgfd < 0) ? "not cached" : "cached, skipping upload");
+
+		/* on a miss, the sendfile ought to be next */
+		ac->announced = 1;
+		if (msgfd >= 0) {
+			activeconn_requesttoengine(ac, IMSG_PUTARCHIVE, msgfd,
+				ac->memoize ? msglabel : NULL);
+			ac->submitted = 1;
+		}
+
+		free(msglabel);
+		break;
+
+	case NETOP_FILEBEGIN:
+	case NETOP_FILECHUNK:
+	case NETOP_FILEEND:
+		if (activeconn_forwardpart(ac, m) < 0) return;
 		break;
 
 	case NETOP_ACK:
-		activeconn_requesttoengine(ac, IMSG_CLIENTACK, NULL);
+		activeconn_requesttoengine(ac, IMSG_CLIENTACK, -1, NULL);
+		break;
+
+	case NETOP_ACKUPTO:
+		msglabel = netmsg_getlabel(m);
+
+		(void)strtonum(msglabel, 0, LLONG_MAX, &errstr);
+		if (errstr != NULL) {
+			activeconn_errortoclient(ac, "received bad acknowledgement count %s: %s",
+				msglabel, errstr);
+			free(msglabel);
+			return;
+		}
+
+		/* anybody acking this way can take
+		 * their lines several at a time
+		 */
+		activeconn_requesttoengine(ac, IMSG_CLIENTACK, -1, msglabel);
+		ac->batching = 1;
+
+		free(msglabel);
 		break;
 
 	case NETOP_TERMINATE:
@@ -352,49 +746,83 @@ proc_getmsg(int type, int fd, struct ipcmsg *msg)
 {
 	struct netmsg		*response;	
 	struct activeconn	*ac;
-
-	char			*msglabel, *fname, *fdata;
-	size_t			 fdatasize;
+	struct iovec		 lines;
+	const char		*errstr;
+	char			*msglabel, *line, *end;
+	char			 countlabel[32];
+	uint64_t		 taken;
+	size_t			 count;
 
 	ac = activeconn_bykey(ipcmsg_getkey(msg));
 	msglabel = ipcmsg_getmsg(msg);
 
+	/* the engine can answer (or tell us where a job sits
+	 * in line) after the client has already gone away
+	 */
 	if (ac == NULL) {
-		if (type == IMSG_ERROR) {
-			log_writex(LOGTYPE_DEBUG, "teardown race observed");
-			return;
-		}
+		if (fd >= 0) close(fd);
+		log_writex(LOGTYPE_DEBUG, "teardown race observed");
 
-		log_fatalx("proc_getmsg: received engine reply for null connection");
+		free(msglabel);
+		return;
 	}
 
 	switch (type) {
 
 	case IMSG_SENDFILE:
-		wbfile_readout(msglabel, &fname, &fdata, &fdatasize);
+	case IMSG_STREAM:
+	case IMSG_FILECHUNK:
+		if ((response = netmsg_loadweakly(fd)) == NULL)
+			log_fatal("proc_getmsg: netmsg_loadweakly");
 
-		response = netmsg_new(NETOP_SENDFILE);
+		conn_send(ac->c, response);
+		break;
 
+	case IMSG_SENDLINE:
+		response = netmsg_build(NETOP_SENDLINE, msglabel, NULL, 0);
 		if (response == NULL)
-			log_fatal("proc_getmsg: netmsg_new");
-		else if (netmsg_setlabel(response, fname) < 0)
-			log_fatalx("proc_getmsg: netmsg_setlabel: %s", netmsg_error(response));
-		else if (netmsg_setdata(response, fdata, (uint64_t)fdatasize) < 0)
-			log_fatalx("proc_getmsg: netmsg_setdata: %s", netmsg_error(response));
-	
+			log_fatal("proc_getmsg: netmsg_build");
+
 		conn_send(ac->c, response);
+		break;
+
+	case IMSG_SENDLINES:
+		if (ac->batching) {
+			for (count = 0, line = msglabel; (line = strchr(line, '\n')) != NULL; line++)
+				count++;
+
+			snprintf(countlabel, sizeof(countlabel), "%zu", count);
+
+			lines.iov_base = msglabel;
+			lines.iov_len = strlen(msglabel);
+
+			response = netmsg_build(NETOP_SENDLINES, countlabel, &lines, 1);
+			if (response == NULL)
+				log_fatal("proc_getmsg: netmsg_build");
+
+			conn_send(ac->c, response);
+			break;
+		}
+
+		/* older clients get one message per line still */
+		for (line = msglabel; (end = strchr(line, '\n')) != NULL; line = end + 1) {
+			*end = '\0';
+
+			response = netmsg_build(NETOP_SENDLINE, line, NULL, 0);
+			if (response == NULL)
+				log_fatal("proc_getmsg: netmsg_build");
+
+			conn_send(ac->c, response);
+		}
 
-		free(fname);
-		free(fdata);
 		break;
 
-	case IMSG_SENDLINE:
-		response = netmsg_new(NETOP_SENDLINE);
-		
+	case IMSG_FILEBEGIN:
+	case IMSG_FILEEND:
+		response = netmsg_build((type == IMSG_FILEBEGIN) ? NETOP_FILEBEGIN : NETOP_FILEEND,
+			msglabel, NULL, 0);
 		if (response == NULL)
-			log_fatal("proc_getmsg: netmsg_new");
-		else if (netmsg_setlabel(response, msglabel) < 0)
-			log_fatalx("proc_getmsg: netmsg_setlabel: %s", netmsg_error(response));
+			log_fatal("proc_getmsg: netmsg_build");
 
 		conn_send(ac->c, response);
 		break;
@@ -407,13 +835,28 @@ proc_getmsg(int type, int fd, struct ipcmsg *msg)
 		conn_send(ac->c, response);
 		break;
 
-	case IMSG_INITIALIZED:
-		netmsg_teardown(ac->pendingmsg);
-		ac->pendingmsg = NULL;	
+	case IMSG_QUEUEPOSITION:
+		response = netmsg_build(NETOP_QUEUEPOSITION, msglabel, NULL, 0);
+		if (response == NULL)
+			log_fatal("proc_getmsg: netmsg_build");
 
+		log_writex(LOGTYPE_DEBUG, "job is number %s in line", msglabel);
+		conn_send(ac->c, response);
+		break;
+
+	case IMSG_INITIALIZED:
 		ac->initialized = 1;
 		return;		
 
+	case IMSG_PARTSTAKEN:
+		taken = strtonum(msglabel, 1, LLONG_MAX, &errstr);
+		if (errstr != NULL || taken > ac->uploadsinflight)
+			log_fatalx("proc_getmsg: engine took %s chunks of %llu",
+				msglabel, ac->uploadsinflight);
+
+		ac->uploadsinflight -= taken;
+		break;
+
 	case IMSG_REQUESTTERM:
 		conn_teardown(ac->c);
 		return;
@@ -432,10 +875,13 @@ proc_getmsg(int type, int fd, struct ipcmsg *msg)
 	}
 
 	
-	conn_receive(ac->c, conn_getmsg);
-	if (msglabel != NULL) free(msglabel);
+	/* a client that's filled its upload window
+	 * waits on the vm before it gets heard again
+	 */
+	if (ac->uploadsinflight < FRONTEND_UPLOADWINDOW)
+		conn_receive(ac->c, conn_getmsg);
 
-	(void)fd;
+	if (msglabel != NULL) free(msglabel);
 }
 
 void
@@ -443,7 +889,13 @@ frontend_launch(void)
 {
 	struct passwd *user;
 
+	if ((connsbykey = slotmap_new()) == NULL)
+		log_fatal("slotmap_new");
+	else if ((connsbyconn = slotmap_new()) == NULL)
+		log_fatal("slotmap_new");
+
 	conn_listen(conn_accept, FRONTEND_CONN_PORT, CONN_MODE_TLS);
+	cache_init();
 
 	if ((user = getpwnam(USER)) == NULL)
 		log_fatalx("no such user %s", USER);
@@ -457,15 +909,18 @@ frontend_launch(void)
 	if (unveil(MESSAGES, "rwc") < 0)
 		log_fatal("unveil %s", MESSAGES);
 
-	if (unveil(WRITEBACK, "r") < 0)
-		log_fatal("unveil %s", WRITEBACK);
+	if (unveil(FRONTEND_CACHE, "rwc") < 0)
+		log_fatal("unveil %s", FRONTEND_CACHE);
+
+	if (unveil(FRONTEND_CHUNKS, "rwc") < 0)
+		log_fatal("unveil %s", FRONTEND_CHUNKS);
 
 	if (setresgid(user->pw_gid, user->pw_gid, user->pw_gid) < 0)
 		log_fatal("setresgid");
 	else if (setresuid(user->pw_uid, user->pw_uid, user->pw_uid) < 0)
 		log_fatal("setresuid");
 
-	if (pledge("stdio rpath wpath cpath inet", "") < 0)
+	if (pledge("stdio rpath wpath cpath inet sendfd recvfd", "") < 0)
 		log_fatal("pledge");
 
 	myproc_listen(PROC_PARENT, nothing);
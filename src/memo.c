@@ -0,0 +1,480 @@
+/* workerd job memo
+ * plenty of jobs are deterministic, so for bundles whose
+ * clients say as much, the engine writes down everything
+ * the job sends back. the next time the same bundle comes
+ * in for the same vm images, that transcript gets played
+ * back instead of tying up a vm. jobs that take any input,
+ * report an error or get cut short are never kept
+ *
+ * a transcript is just the messages the vm sent, one after
+ * another as they went over the wire, ending in a terminate.
+ * playback paces itself on client acks through the same
+ * window a vm would
+ *
+ * (c) jay lang 2023
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <sha2.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "workerd.h"
+
+#define MEMO_READSIZE	65536
+
+/* a job being written down */
+struct recording {
+	char			 hash[SHA256_DIGEST_STRING_LENGTH];
+	char			*path;
+	int			 fd;
+	off_t			 size;
+};
+
+/* a job being played back */
+struct playback {
+	uint32_t		 key;
+	struct vm_interface	 vmi;
+
+	int			 fd;
+	off_t			 offset;
+	struct window		*window;
+	int			 finished;
+};
+
+static void		 memo_key(const char *, char *);
+static char		*memo_path(const char *);
+static int		 memo_append(struct recording *, struct iovec *, int);
+static void		 memo_droprecording(uint32_t);
+static struct netmsg	*memo_readrecord(struct playback *);
+static void		 memo_pump(struct playback *);
+static void		 memo_report(int, short, void *);
+
+static struct store	*transcripts;
+
+static struct slotmap	*recordingsbykey;
+static struct slotmap	*playbacksbykey;
+
+/* which vm images transcripts were made on, since
+ * new ones could well change a job's output
+ */
+static char		 imageclass[64];
+
+static struct event	 reporttimer;
+
+/* transcripts go by the bundle's hash and the images */
+static void
+memo_key(const char *bundle, char *out)
+{
+	char	*both;
+
+	if (asprintf(&both, "%s %s", bundle, imageclass) < 0)
+		log_fatal("memo_key: asprintf");
+
+	SHA256Data((uint8_t *)both, strlen(both), out);
+	free(both);
+}
+
+static char *
+memo_path(const char *name)
+{
+	char	*out;
+
+	if (asprintf(&out, "%s/%s", ENGINE_MEMO, name) < 0)
+		log_fatal("memo_path: asprintf");
+
+	return out;
+}
+
+static int
+memo_append(struct recording *r, struct iovec *iov, int iovcnt)
+{
+	ssize_t	total = 0, written;
+	int	i;
+
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	if (r->size + total > MEMO_MAXSIZE) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	if ((written = writev(r->fd, iov, iovcnt)) != total) {
+		if (written >= 0) errno = EIO;
+		return -1;
+	}
+
+	r->size += total;
+	return 0;
+}
+
+static void
+memo_droprecording(uint32_t key)
+{
+	struct recording	*r;
+
+	if ((r = slotmap_remove(recordingsbykey, key)) == NULL)
+		return;
+
+	close(r->fd);
+	unlink(r->path);
+
+	free(r->path);
+	free(r);
+}
+
+/* pull the next whole message out of a transcript,
+ * feeding it to a new one the same way conn does
+ */
+static struct netmsg *
+memo_readrecord(struct playback *p)
+{
+	static char	 chunk[MEMO_READSIZE];
+	struct netmsg	*m;
+	uint64_t	 missing;
+	ssize_t		 n;
+	uint8_t		 opcode;
+	int		 fatal;
+
+	if (pread(p->fd, &opcode, sizeof(uint8_t), p->offset) != sizeof(uint8_t))
+		return NULL;
+	else if ((m = netmsg_new(opcode)) == NULL)
+		return NULL;
+
+	do {
+		missing = netmsg_getmissing(m);
+		if (missing > sizeof(chunk)) missing = sizeof(chunk);
+
+		if ((n = pread(p->fd, chunk, missing, p->offset)) <= 0)
+			goto fail;
+		else if (netmsg_write(m, chunk, n) != n)
+			goto fail;
+
+		p->offset += n;
+
+		if (netmsg_isvalid(m, &fatal) == 1)
+			return m;
+	} while (!fatal);
+fail:
+	netmsg_teardown(m);
+	return NULL;
+}
+
+/* send whatever the client has room for, and
+ * wrap up once it's seen all of it
+ */
+static void
+memo_pump(struct playback *p)
+{
+	struct vm_interface	 vmi = p->vmi;
+	struct netmsg		*m;
+	char			*label;
+	uint32_t		 key = p->key;
+
+	while (!p->finished && !window_isfull(p->window)) {
+		if ((m = memo_readrecord(p)) == NULL) {
+			log_writex(LOGTYPE_WARN, "memo_pump: transcript for key %u is damaged", key);
+			memo_cancel(key);
+			vmi.reporterror(key, "could not replay this job's earlier run");
+			return;
+		}
+
+		switch (netmsg_gettype(m)) {
+		case NETOP_SENDLINE:
+			if ((label = netmsg_getlabel(m)) == NULL)
+				log_fatalx("memo_pump: netmsg_getlabel: %s", netmsg_error(m));
+
+			window_track(p->window, m);
+			vmi.print(key, label);
+			free(label);
+			break;
+
+		case NETOP_SENDFILE:
+			window_track(p->window, m);
+			vmi.commitfile(key, m);
+			break;
+
+		case NETOP_STREAM:
+			window_track(p->window, m);
+			vmi.stream(key, m);
+			break;
+
+		default:
+			p->finished = 1;
+		}
+
+		netmsg_teardown(m);
+	}
+
+	/* p goes away here, so anything after uses copies */
+	if (p->finished && window_getacked(p->window) == window_getsent(p->window)) {
+		memo_cancel(key);
+		vmi.signaldone(key);
+	}
+}
+
+static void
+memo_report(int fd, short event, void *arg)
+{
+	struct timeval	tv;
+
+	store_report(transcripts, "job memo", "bytes replayed");
+
+	tv.tv_sec = MEMO_REPORTINTERVAL;
+	tv.tv_usec = 0;
+	evtimer_add(&reporttimer, &tv);
+
+	(void)fd;
+	(void)event;
+	(void)arg;
+}
+
+/* before unveil, so the images can still be looked at */
+void
+memo_init(void)
+{
+	struct stat	base, vivado;
+
+	if (stat(VM_BASEIMAGE, &base) < 0)
+		log_fatal("memo_init: stat %s", VM_BASEIMAGE);
+	else if (stat(VM_VIVADOIMAGE, &vivado) < 0)
+		log_fatal("memo_init: stat %s", VM_VIVADOIMAGE);
+
+	snprintf(imageclass, sizeof(imageclass), "%lld.%lld",
+		(long long)base.st_mtime, (long long)vivado.st_mtime);
+
+	if ((transcripts = store_new(ENGINE_MEMO, MEMO_MAXENTRIES, MEMO_MAXBYTES)) == NULL)
+		log_fatal("memo_init: store_new");
+	else if ((recordingsbykey = slotmap_new()) == NULL)
+		log_fatal("memo_init: slotmap_new");
+	else if ((playbacksbykey = slotmap_new()) == NULL)
+		log_fatal("memo_init: slotmap_new");
+
+	evtimer_set(&reporttimer, memo_report, NULL);
+	memo_report(-1, EV_TIMEOUT, NULL);
+}
+
+/* a descriptor for bundle's transcript, or
+ * -1 with errno set to ENOENT if there isn't one
+ */
+int
+memo_lookup(const char *bundle)
+{
+	char	hash[SHA256_DIGEST_STRING_LENGTH];
+
+	memo_key(bundle, hash);
+	return store_open(transcripts, hash, -1);
+}
+
+/* play the transcript behind fd back to key, through
+ * the same interface a vm would use
+ */
+void
+memo_replay(uint32_t key, int fd, struct vm_interface vmi)
+{
+	struct playback	*p;
+
+	if ((p = calloc(1, sizeof(struct playback))) == NULL)
+		log_fatal("memo_replay: calloc");
+	else if ((p->window = window_new()) == NULL)
+		log_fatal("memo_replay: window_new");
+	else if (slotmap_insertat(playbacksbykey, key, p) < 0)
+		log_fatal("memo_replay: slotmap_insertat");
+
+	p->key = key;
+	p->vmi = vmi;
+	p->fd = fd;
+
+	log_writex(LOGTYPE_DEBUG, "replaying earlier run for key %u", key);
+	memo_pump(p);
+}
+
+int
+memo_isreplaying(uint32_t key)
+{
+	return slotmap_get(playbacksbykey, key) != NULL;
+}
+
+void
+memo_injectack(uint32_t key)
+{
+	struct playback	*p;
+	uint64_t	 acked;
+
+	if ((p = slotmap_get(playbacksbykey, key)) == NULL)
+		return;
+
+	if ((acked = window_getacked(p->window)) < window_getsent(p->window))
+		window_ack(p->window, acked + 1);
+
+	memo_pump(p);
+}
+
+int
+memo_injectacks(uint32_t key, uint64_t total)
+{
+	struct playback	*p;
+
+	if ((p = slotmap_get(playbacksbykey, key)) == NULL)
+		return 0;
+
+	if (window_ack(p->window, total) < 0)
+		return -1;
+
+	memo_pump(p);
+
+	return 0;
+}
+
+/* stop playing back, i.e. because the client left */
+void
+memo_cancel(uint32_t key)
+{
+	struct playback	*p;
+
+	if ((p = slotmap_remove(playbacksbykey, key)) == NULL)
+		return;
+
+	close(p->fd);
+	window_teardown(p->window);
+	free(p);
+}
+
+void
+memo_record(uint32_t key, const char *bundle)
+{
+	struct recording	*r;
+	char			 name[32];
+
+	if ((r = calloc(1, sizeof(struct recording))) == NULL)
+		log_fatal("memo_record: calloc");
+
+	memo_key(bundle, r->hash);
+
+	snprintf(name, sizeof(name), "recording.%u", key);
+	r->path = memo_path(name);
+
+	r->fd = open(r->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (r->fd < 0) {
+		log_write(LOGTYPE_WARN, "memo_record: open %s", r->path);
+		free(r->path);
+		free(r);
+		return;
+	}
+
+	if (slotmap_insertat(recordingsbykey, key, r) < 0)
+		log_fatal("memo_record: slotmap_insertat");
+}
+
+void
+memo_recordline(uint32_t key, char *line)
+{
+	struct recording	*r;
+	struct iovec		 iov[3];
+	uint64_t		 labelsize;
+	uint8_t			 opcode = NETOP_SENDLINE;
+
+	if ((r = slotmap_get(recordingsbykey, key)) == NULL)
+		return;
+
+	labelsize = htobe64(strlen(line));
+
+	iov[0].iov_base = &opcode;
+	iov[0].iov_len = sizeof(uint8_t);
+	iov[1].iov_base = &labelsize;
+	iov[1].iov_len = sizeof(uint64_t);
+	iov[2].iov_base = line;
+	iov[2].iov_len = strlen(line);
+
+	if (memo_append(r, iov, 3) < 0)
+		memo_droprecording(key);
+}
+
+/* disk messages get copied in whole */
+void
+memo_recordmsg(uint32_t key, struct netmsg *m)
+{
+	static char		 chunk[MEMO_READSIZE];
+	struct recording	*r;
+	struct iovec		 iov;
+	off_t			 offset = 0;
+	ssize_t			 n;
+	int			 fd;
+
+	if ((r = slotmap_get(recordingsbykey, key)) == NULL)
+		return;
+
+	if ((fd = netmsg_getfd(m)) < 0)
+		log_fatalx("memo_recordmsg: netmsg_getfd: %s", netmsg_error(m));
+
+	while ((n = pread(fd, chunk, sizeof(chunk), offset)) > 0) {
+		iov.iov_base = chunk;
+		iov.iov_len = n;
+
+		if (memo_append(r, &iov, 1) < 0) break;
+		offset += n;
+	}
+
+	close(fd);
+	if (n != 0) memo_droprecording(key);
+}
+
+/* the job did something that means it can't be
+ * replayed, or isn't going to finish
+ */
+void
+memo_abandon(uint32_t key)
+{
+	memo_droprecording(key);
+}
+
+/* the job finished on its own, so keep what it said */
+void
+memo_commit(uint32_t key)
+{
+	struct recording	*r;
+	struct iovec		 iov;
+	char			*path;
+	uint8_t			 opcode = NETOP_TERMINATE;
+
+	if ((r = slotmap_get(recordingsbykey, key)) == NULL)
+		return;
+
+	iov.iov_base = &opcode;
+	iov.iov_len = sizeof(uint8_t);
+
+	/* somebody else with the same bundle got here first */
+	if (store_touch(transcripts, r->hash) == 0 || memo_append(r, &iov, 1) < 0) {
+		memo_droprecording(key);
+		return;
+	}
+
+	slotmap_remove(recordingsbykey, key);
+	close(r->fd);
+
+	path = store_path(transcripts, r->hash);
+
+	if (rename(r->path, path) < 0) {
+		log_write(LOGTYPE_WARN, "memo_commit: rename %s", r->path);
+		unlink(r->path);
+	} else {
+		store_add(transcripts, r->hash, r->size);
+		log_writex(LOGTYPE_DEBUG, "kept transcript for key %u", key);
+	}
+
+	free(path);
+	free(r->path);
+	free(r);
+}
@@ -30,6 +30,12 @@ struct msgqueue {
 
 	size_t			  cachedoffset;
 
+	/* the send callback is allowed to tear down the
+	 * connection and us along with it, so defer that
+	 */
+	int			  indispatch;
+	int			  shouldteardown;
+
 	void			(*cb)(struct msgqueue *, struct conn *);
 	struct conn		 *c;
 };
@@ -56,8 +62,12 @@ msgqueue_event(int fd, short event, void *arg)
 {
 	struct msgqueue		*mq = (struct msgqueue *)arg;
 
+	mq->indispatch = 1;
 	mq->cb(mq, mq->c);
-	msgqueue_tryeventing(mq);
+	mq->indispatch = 0;
+
+	if (mq->shouldteardown) msgqueue_teardown(mq);
+	else msgqueue_tryeventing(mq);
 
 	(void)fd;
 	(void)event;
@@ -76,6 +86,8 @@ msgqueue_new(struct conn *c, void (*cb)(struct msgqueue *, struct conn *))
 	event_set(&mq->sendevent, conn_getfd(c), EV_WRITE, msgqueue_event, mq);
 
 	mq->cachedoffset = 0;
+	mq->indispatch = 0;
+	mq->shouldteardown = 0;
 	mq->cb = cb;
 	mq->c = c;
 
@@ -90,7 +102,8 @@ msgqueue_teardown(struct msgqueue *mq)
 	while (!SIMPLEQ_EMPTY(&mq->queuehead))
 		msgqueue_deletehead(mq);
 
-	free(mq);
+	if (mq->indispatch) mq->shouldteardown = 1;
+	else free(mq);
 }
 
 void
@@ -138,6 +151,20 @@ end:
 	return out;
 }
 
+int
+msgqueue_getheads(struct msgqueue *mq, struct netmsg **out, int max)
+{
+	struct queuedmsg	*entry;
+	int			 count = 0;
+
+	SIMPLEQ_FOREACH(entry, &mq->queuehead, entries) {
+		if (count == max) break;
+		out[count++] = entry->msg;
+	}
+
+	return count;
+}
+
 size_t
 msgqueue_getcachedoffset(struct msgqueue *mq)
 {
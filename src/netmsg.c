@@ -3,8 +3,10 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/queue.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <endian.h>
 #include <errno.h>
@@ -15,6 +17,7 @@
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "workerd.h"
 
@@ -36,7 +39,27 @@ static uint64_t			maxfileid = 0;
 
 /* netmsg proper */
 
+/* incremental decoder states. the wire format is
+ * opcode -> label size -> label -> data size -> data,
+ * and messages which don't carry a label or data simply
+ * finish early
+ */
+#define NETMSG_PARSE_OPCODE	0
+#define NETMSG_PARSE_LABELSIZE	1
+#define NETMSG_PARSE_LABEL	2
+#define NETMSG_PARSE_DATASIZE	3
+#define NETMSG_PARSE_DATA	4
+#define NETMSG_PARSE_DONE	5
+#define NETMSG_PARSE_ERROR	6
+
+#define NETMSG_LABELOFFSET	(sizeof(uint8_t) + sizeof(uint64_t))
+
+/* zlib works through payloads this much at a time */
+#define NETMSG_ZCHUNK		65536
 
+/* opcode is as it goes over the wire, i.e. including
+ * NETOP_COMPRESSED. netmsg_gettype strips it off
+ */
 struct netmsg {
 	uint8_t	 	  opcode;
 	char		 *path;
@@ -44,20 +67,47 @@ struct netmsg {
 
 	int		  retain;
 
+	/* decoder state, so that validation only ever
+	 * looks at bytes it hasn't seen before
+	 */
+	int		  parsestate;
+	int		  needlabel;
+	int		  needdata;
+	uint64_t	  parsed;
+	uint64_t	  labelsize;
+	uint64_t	  datasize;
+
 	int		(*closestorage)(int);
 	ssize_t		(*readstorage)(int, void *, size_t);
 	ssize_t		(*writestorage)(int, const void *, size_t);
+	ssize_t		(*writevstorage)(int, const struct iovec *, int);
 	off_t		(*seekstorage)(int, off_t, int);
 	int		(*truncatestorage)(int, off_t);
+	int		(*iovstorage)(int, off_t, struct iovec *, int);
+
+	/* disk storage gets mapped read-only for sending, so that
+	 * nothing has to be copied out of the page cache by hand
+	 */
+	void		 *map;
+	size_t		  mapsize;
 
 	char		  errstr[ERRSTRSIZE];
 };
 
 static int	netmsg_getclaimedlabelsize(struct netmsg *, uint64_t *);
 static int	netmsg_getclaimeddatasize(struct netmsg *, uint64_t *);
-static ssize_t	netmsg_getexpectedsizeifvalid(struct netmsg *);
+
+static struct netmsg	*netmsg_alloc(uint8_t);
 
 static void	netmsg_committype(struct netmsg *);
+static int	netmsg_hasdata(uint8_t);
+static struct netmsg	*netmsg_transform(struct netmsg *, int);
+static void	netmsg_unmap(struct netmsg *);
+
+static void	netmsg_resetparser(struct netmsg *);
+static int	netmsg_parsesize(struct netmsg *, uint64_t *, uint64_t);
+static int	netmsg_parselabel(struct netmsg *, uint64_t);
+static int	netmsg_advance(struct netmsg *, uint64_t);
 
 static char *
 msgfile_reservepath(void)
@@ -111,8 +161,11 @@ msgfile_releasepath(char *oldpath)
 	STAILQ_INSERT_HEAD(&freefiles, freefile, entries);
 }
 
-struct netmsg *
-netmsg_new(uint8_t opcode)
+/* set up storage for a message without writing anything
+ * to it yet, see netmsg_new and netmsg_build
+ */
+static struct netmsg *
+netmsg_alloc(uint8_t opcode)
 {
 	struct netmsg	*out = NULL;
 	char		*path = NULL;
@@ -123,8 +176,10 @@ netmsg_new(uint8_t opcode)
 	int		 flags = O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC;
 	mode_t		 mode = S_IRUSR | S_IWUSR | S_IRGRP;
 
-	switch (opcode) {
+	switch (opcode & ~NETOP_COMPRESSED) {
 	case NETOP_SENDFILE:
+	case NETOP_STREAM:
+	case NETOP_FILECHUNK:
 		diskmsg = 1;
 		path = msgfile_reservepath();
 
@@ -147,6 +202,16 @@ netmsg_new(uint8_t opcode)
 	case NETOP_ERROR:
 	case NETOP_ACK:
 	case NETOP_HEARTBEAT:
+	case NETOP_IDENTIFY:
+	case NETOP_QUEUEPOSITION:
+	case NETOP_ACKUPTO:
+	case NETOP_SENDLINES:
+	case NETOP_FILEBEGIN:
+	case NETOP_FILEEND:
+	case NETOP_ANNOUNCE:
+	case NETOP_MANIFEST:
+	case NETOP_CHUNK:
+	case NETOP_MEMOIZE:
 		descriptor = buffer_open();
 		break;
 
@@ -166,21 +231,19 @@ netmsg_new(uint8_t opcode)
 		out->closestorage = close;
 		out->readstorage = read;
 		out->writestorage = write;
+		out->writevstorage = writev;
 		out->seekstorage = lseek;
 		out->truncatestorage = ftruncate;
 	} else {
 		out->closestorage = buffer_close;
 		out->readstorage = buffer_read;
 		out->writestorage = buffer_write;
+		out->writevstorage = buffer_writev;
 		out->seekstorage = buffer_seek;
 		out->truncatestorage = buffer_truncate;
+		out->iovstorage = buffer_getiov;
 	}
 
-	/* ensure that the struct stays consistent
-	 * with the marshalled in-memory data
-	 */
-	netmsg_committype(out);
-
 end:
 	if (error) {
 		if (descriptor >= 0) {
@@ -198,35 +261,128 @@ end:
 }
 
 struct netmsg *
-netmsg_loadweakly(char *path)
+netmsg_new(uint8_t opcode)
+{
+	struct netmsg	*out;
+
+	out = netmsg_alloc(opcode);
+
+	/* ensure that the struct stays consistent
+	 * with the marshalled in-memory data
+	 */
+	if (out != NULL) netmsg_committype(out);
+
+	return out;
+}
+
+/* lay out a whole outgoing message at once: opcode, then the
+ * label if there is one, then data if iov isn't NULL. the
+ * pieces go to storage in a single vectored write
+ */
+struct netmsg *
+netmsg_build(uint8_t opcode, char *label, struct iovec *data, int datacnt)
 {
 	struct netmsg	*out = NULL;
-	int		 loadfd;
-	uint8_t		 opcode;
+	struct iovec	*iov = NULL;
+
+	uint64_t	 labelsize = 0, datasize = 0;
+	uint64_t	 belabelsize, bedatasize;
+	ssize_t		 total, written;
+	int		 i, iovcnt = 0;
+
+	if (datacnt < 0 || (data == NULL && datacnt > 0)) {
+		errno = EINVAL;
+		goto end;
+	}
+
+	if (label != NULL && (labelsize = strlen(label)) > MAXNAMESIZE) {
+		errno = ENAMETOOLONG;
+		goto end;
+	}
+
+	for (i = 0; i < datacnt; i++)
+		datasize += data[i].iov_len;
+
+	if (datasize > MAXFILESIZE) {
+		errno = EFBIG;
+		goto end;
+	}
+
+	iov = reallocarray(NULL, 5 + datacnt, sizeof(struct iovec));
+	if (iov == NULL) goto end;
+
+	out = netmsg_alloc(opcode);
+	if (out == NULL) goto end;
+
+	iov[iovcnt].iov_base = &out->opcode;
+	iov[iovcnt++].iov_len = sizeof(uint8_t);
+
+	if (label != NULL) {
+		belabelsize = htobe64(labelsize);
+
+		iov[iovcnt].iov_base = &belabelsize;
+		iov[iovcnt++].iov_len = sizeof(uint64_t);
+		iov[iovcnt].iov_base = label;
+		iov[iovcnt++].iov_len = labelsize;
+	}
+
+	if (data != NULL) {
+		bedatasize = htobe64(datasize);
+
+		iov[iovcnt].iov_base = &bedatasize;
+		iov[iovcnt++].iov_len = sizeof(uint64_t);
 
-	loadfd = open(path, O_RDONLY);
-	if (loadfd < 0) goto end;
+		for (i = 0; i < datacnt; i++)
+			iov[iovcnt++] = data[i];
+	}
+
+	total = sizeof(uint8_t) + ((label != NULL) ? sizeof(uint64_t) + labelsize : 0) +
+		((data != NULL) ? sizeof(uint64_t) + datasize : 0);
+
+	written = out->writevstorage(out->descriptor, iov, iovcnt);
+	if (written != total) {
+		if (written >= 0) errno = EIO;
+
+		netmsg_teardown(out);
+		out = NULL;
+	}
+end:
+	free(iov);
+	return out;
+}
+
+/* wrap a disk message somebody handed us as a descriptor,
+ * e.g. over imsg. we own fd from here on, but not the file
+ */
+struct netmsg *
+netmsg_loadweakly(int fd)
+{
+	struct netmsg	*out = NULL;
+	ssize_t		 n;
+	uint8_t		 opcode;
 
-	if (read(loadfd, &opcode, sizeof(uint8_t)) != sizeof(uint8_t))
+	if ((n = pread(fd, &opcode, sizeof(uint8_t), 0)) != sizeof(uint8_t)) {
+		if (n >= 0) errno = EINVAL;
 		goto end;
-	else if (lseek(loadfd, 0, SEEK_SET) != 0)
+	} else if (lseek(fd, 0, SEEK_SET) != 0)
 		goto end;
 
 	out = calloc(1, sizeof(struct netmsg));
 	if (out == NULL) goto end;
 
 	out->opcode = opcode;
-	out->descriptor = loadfd;
+	out->descriptor = fd;
 
 	out->closestorage = close;
 	out->readstorage = read;
 	out->writestorage = write;
+	out->writevstorage = writev;
 	out->seekstorage = lseek;
 	out->truncatestorage = ftruncate;
 
 end:
 	if (out == NULL)
-		if (loadfd > 0) close(loadfd);
+		if (fd >= 0) close(fd);
 
 	return out;
 }
@@ -244,6 +400,7 @@ netmsg_teardown(struct netmsg *m)
 		m->retain--;
 
 	else {
+		netmsg_unmap(m);
 		m->closestorage(m->descriptor);
 
 		if (m->path != NULL) {
@@ -272,6 +429,8 @@ netmsg_write(struct netmsg *m, void *bytes, size_t count)
 {
 	ssize_t	status;
 
+	netmsg_unmap(m);
+
 	status = m->writestorage(m->descriptor, bytes, count);
 	if (status < 0)
 		strncpy(m->errstr, strerror(errno), ERRSTRSIZE);
@@ -308,19 +467,85 @@ netmsg_truncate(struct netmsg *m, ssize_t offset)
 {
 	ssize_t status;
 
+	netmsg_unmap(m);
+
 	status = m->truncatestorage(m->descriptor, offset);
 	if (status < 0)
 		strncpy(m->errstr, strerror(errno), ERRSTRSIZE);
 
+	netmsg_resetparser(m);
 	return status;	
 }
 
+int
+netmsg_getiov(struct netmsg *m, size_t offset, struct iovec *iov, int iovcnt)
+{
+	struct stat	st;
+	int		filled = -1;
+
+	if (m->iovstorage != NULL) {
+		filled = m->iovstorage(m->descriptor, offset, iov, iovcnt);
+		if (filled < 0)
+			strncpy(m->errstr, strerror(errno), ERRSTRSIZE);
+
+		goto end;
+	}
+
+	if (m->map == NULL) {
+		if (fstat(m->descriptor, &st) < 0) {
+			strncpy(m->errstr, strerror(errno), ERRSTRSIZE);
+			goto end;
+
+		} else if (st.st_size == 0) {
+			filled = 0;
+			goto end;
+		}
+
+		m->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, m->descriptor, 0);
+		if (m->map == MAP_FAILED) {
+			m->map = NULL;
+			strncpy(m->errstr, strerror(errno), ERRSTRSIZE);
+			goto end;
+		}
+
+		m->mapsize = st.st_size;
+	}
+
+	filled = 0;
+
+	if (offset < m->mapsize && iovcnt > 0) {
+		iov->iov_base = (char *)m->map + offset;
+		iov->iov_len = m->mapsize - offset;
+		filled = 1;
+	}
+end:
+	return filled;
+}
+
+static void
+netmsg_unmap(struct netmsg *m)
+{
+	if (m->map != NULL) {
+		if (munmap(m->map, m->mapsize) < 0)
+			log_fatal("netmsg_unmap: munmap");
+
+		m->map = NULL;
+		m->mapsize = 0;
+	}
+}
+
 static int
 netmsg_getclaimedlabelsize(struct netmsg *m, uint64_t *out)
 {
 	ssize_t		offset, bytesread;
 	int		status = -1;
 
+	if (m->needlabel && m->parsestate > NETMSG_PARSE_LABELSIZE &&
+	    m->parsestate != NETMSG_PARSE_ERROR) {
+		*out = m->labelsize;
+		return 0;
+	}
+
 	offset = sizeof(uint8_t);
 
 	if (m->seekstorage(m->descriptor, offset, SEEK_SET) != offset)
@@ -354,6 +579,12 @@ netmsg_getclaimeddatasize(struct netmsg *m, uint64_t *out)
 	ssize_t		offset, bytesread;
 	int		status = -1;
 
+	if (m->needdata && m->parsestate > NETMSG_PARSE_DATASIZE &&
+	    m->parsestate != NETMSG_PARSE_ERROR) {
+		*out = m->datasize;
+		return 0;
+	}
+
 	if (netmsg_getclaimedlabelsize(m, &labelsize) < 0) goto end;
 	else offset = sizeof(uint8_t) + sizeof(uint64_t) + labelsize;
 
@@ -381,26 +612,6 @@ end:
 	return status;
 }
 
-static ssize_t
-netmsg_getexpectedsizeifvalid(struct netmsg *m)
-{
-	uint64_t	scratchsize;
-	ssize_t		total = -1;
-
-	/* XXX: be careful, this assumes the message is valid */
-
-	total = sizeof(uint8_t);
-
-	if (netmsg_getclaimedlabelsize(m, &scratchsize) == 0)
-		total += (ssize_t)scratchsize + sizeof(uint64_t);
-
-	if (netmsg_getclaimeddatasize(m, &scratchsize) == 0)
-		total += (ssize_t)scratchsize + sizeof(uint64_t);
-
-	netmsg_clearerror(m);
-	return total;
-}
-
 static void
 netmsg_committype(struct netmsg *m)
 {
@@ -423,124 +634,271 @@ netmsg_committype(struct netmsg *m)
 uint8_t
 netmsg_gettype(struct netmsg *m)
 {
-	return m->opcode;
+	return m->opcode & ~NETOP_COMPRESSED;
 }
 
-char *
-netmsg_getpath(struct netmsg *m)
+int
+netmsg_iscompressed(struct netmsg *m)
 {
-	char	*pathout;
-
-	pathout = strdup(m->path);
-	if (pathout == NULL) log_fatal("netmsg_getpath: strdup");
+	return (m->opcode & NETOP_COMPRESSED) != 0;
+}
 
-	return pathout;
+/* keep in step with the needdata cases in netmsg_isvalid */
+static int
+netmsg_hasdata(uint8_t opcode)
+{
+	switch (opcode & ~NETOP_COMPRESSED) {
+	case NETOP_SENDFILE:
+	case NETOP_SENDLINES:
+	case NETOP_STREAM:
+	case NETOP_FILECHUNK:
+	case NETOP_MANIFEST:
+	case NETOP_CHUNK:
+		return 1;
+	default:
+		return 0;
+	}
 }
 
-char *
-netmsg_getlabel(struct netmsg *m)
+/* copy m into a new message with its data run through
+ * zlib one NETMSG_ZCHUNK at a time, so neither side ever
+ * has to hold the whole payload. the label is left alone
+ */
+static struct netmsg *
+netmsg_transform(struct netmsg *m, int compress)
 {
-	char		*out = NULL;
-	ssize_t		 bytesread, offset;
-	uint64_t	 labelsize;
+	static char	 zin[NETMSG_ZCHUNK], zout[NETMSG_ZCHUNK];
 
-	offset = sizeof(uint8_t) + sizeof(uint64_t);
-	if (netmsg_getclaimedlabelsize(m, &labelsize) < 0) {
-		snprintf(m->errstr, ERRSTRSIZE,
-			"netmsg_getlabel: netmsg_getclaimedlabelsize: %s", strerror(errno));
+	struct netmsg	*out = NULL;
+	z_stream	 zs;
+	char		*label = NULL;
+	uint64_t	 labelsize, datasize, remaining, written = 0, be;
+	off_t		 sizeoffset;
+	ssize_t		 n;
+	size_t		 produced;
+	uint8_t		 opcode;
+	int		 ret, flush, zstarted = 0, status = -1;
+
+	if ((label = netmsg_getlabel(m)) == NULL) {
+		errno = EINVAL;
+		goto end;
+	} else if (netmsg_getclaimeddatasize(m, &datasize) < 0)
+		goto end;
+
+	opcode = compress ? (m->opcode | NETOP_COMPRESSED) : (m->opcode & ~NETOP_COMPRESSED);
+	if ((out = netmsg_alloc(opcode)) == NULL)
+		goto end;
+
+	/* header first, with the data size filled in at the end */
+	labelsize = strlen(label);
+	sizeoffset = NETMSG_LABELOFFSET + labelsize;
+	be = htobe64(labelsize);
+
+	if (out->writestorage(out->descriptor, &out->opcode, sizeof(uint8_t)) != sizeof(uint8_t) ||
+	    out->writestorage(out->descriptor, &be, sizeof(uint64_t)) != sizeof(uint64_t) ||
+	    out->writestorage(out->descriptor, label, labelsize) != (ssize_t)labelsize ||
+	    out->writestorage(out->descriptor, &be, sizeof(uint64_t)) != sizeof(uint64_t))
+		goto end;
+
+	bzero(&zs, sizeof(z_stream));
+
+	ret = compress ? deflateInit(&zs, Z_DEFAULT_COMPRESSION) : inflateInit(&zs);
+	if (ret != Z_OK) {
+		errno = ENOMEM;
 		goto end;
 	}
 
-	if (m->seekstorage(m->descriptor, offset, SEEK_SET) < 0)
-		log_fatal("netmsg_getlabel: could not seek to %lu", offset);
+	zstarted = 1;
 
-	out = reallocarray(NULL, labelsize + 1, sizeof(char));
-	if (out == NULL)
-		log_fatal("netmsg_getlabel: reallocarray for netmsg label copy");
+	if (m->seekstorage(m->descriptor, sizeoffset + sizeof(uint64_t), SEEK_SET) < 0)
+		log_fatal("netmsg_transform: seek to start of data");
 
-	bytesread = m->readstorage(m->descriptor, out, labelsize);
+	for (remaining = datasize;;) {
+		if (zs.avail_in == 0 && remaining > 0) {
+			n = m->readstorage(m->descriptor, zin,
+				(remaining < sizeof(zin)) ? remaining : sizeof(zin));
 
-	if (bytesread < 0)
-		log_fatal("netmsg_getlabel: could not read buffer");
+			if (n < 0)
+				log_fatal("netmsg_transform: read data");
+			else if (n == 0)
+				log_fatalx("netmsg_transform: short read of data");
 
-	out[bytesread] = '\0';
-end:
-	return out;
-}
+			remaining -= n;
+			zs.next_in = (Bytef *)zin;
+			zs.avail_in = n;
+		}
 
+		flush = (remaining == 0) ? Z_FINISH : Z_NO_FLUSH;
+		zs.next_out = (Bytef *)zout;
+		zs.avail_out = sizeof(zout);
 
-int
-netmsg_setlabel(struct netmsg *m, char *newlabel)
-{
-	char		*datacopy = NULL;
-	uint64_t	 labelsize, datacopysize = 0;
-	uint64_t	 newlabelsize, benewlabelsize;
+		ret = compress ? deflate(&zs, flush) : inflate(&zs, Z_NO_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+			errno = EINVAL;
+			goto end;
+		}
 
-	int		 status = -1;
+		produced = sizeof(zout) - zs.avail_out;
+		if ((written += produced) > MAXFILESIZE) {
+			errno = EFBIG;
+			goto end;
+		}
 
-	/* if there's already a label here, there also might be
-	 * some data...
-	 */
+		if (out->writestorage(out->descriptor, zout, produced) != (ssize_t)produced)
+			goto end;
 
-	newlabelsize = strlen(newlabel);
+		if (ret == Z_STREAM_END) break;
 
-	if (newlabelsize > MAXNAMESIZE) {
-		snprintf(m->errstr, ERRSTRSIZE,
-			"new label size %llu exceeds allowed maximum", newlabelsize);
+		/* no room to make progress, and nothing left to feed
+		 * in - the compressed stream was cut short
+		 */
+		if (ret == Z_BUF_ERROR && zs.avail_in == 0 && remaining == 0) {
+			errno = EINVAL;
+			goto end;
+		}
+	}
+
+	/* trailing junk after the end of the stream */
+	if (zs.avail_in > 0 || remaining > 0) {
+		errno = EINVAL;
 		goto end;
 	}
 
-	benewlabelsize = htobe64(newlabelsize);
+	be = htobe64(written);
 
-	if (netmsg_getclaimedlabelsize(m, &labelsize) == 0) {
-		ssize_t	totalsize, offset;
+	if (out->seekstorage(out->descriptor, sizeoffset, SEEK_SET) < 0)
+		log_fatal("netmsg_transform: seek to data size");
+	else if (out->writestorage(out->descriptor, &be, sizeof(uint64_t)) != sizeof(uint64_t))
+		goto end;
+	else if (out->seekstorage(out->descriptor, 0, SEEK_SET) != 0)
+		log_fatal("netmsg_transform: seek to start of message");
 
-		totalsize = m->seekstorage(m->descriptor, 0, SEEK_END);
-		if (totalsize < 0) log_fatal("netmsg_setlabel: failed to find eof");
+	status = 0;
+end:
+	if (zstarted) {
+		if (compress) deflateEnd(&zs);
+		else inflateEnd(&zs);
+	}
 
-		offset = labelsize + sizeof(uint64_t) + sizeof(uint8_t);
-		datacopysize = totalsize - offset;
+	if (status < 0 && out != NULL) {
+		netmsg_teardown(out);
+		out = NULL;
+	}
 
-		if (datacopysize > 0) {
-			datacopy = reallocarray(NULL, datacopysize, sizeof(char));
-			if (datacopy == NULL) log_fatal("netmsg_setlabel: reallocarray datacopy");
+	free(label);
+	return out;
+}
 
-			if (m->seekstorage(m->descriptor, offset, SEEK_SET) < 0)
-				log_fatal("netmsg_setlabel: could not seek to data to be backed up");
+/* returns a compressed copy of m, or NULL. EINVAL means
+ * m has no data worth compressing, or it wouldn't shrink
+ */
+struct netmsg *
+netmsg_compress(struct netmsg *m)
+{
+	struct netmsg	*out;
+	uint64_t	 before, after;
 
-			if (m->readstorage(m->descriptor, datacopy, datacopysize)
-				!= (ssize_t)datacopysize)
+	if (netmsg_iscompressed(m) || !netmsg_hasdata(m->opcode)) {
+		errno = EINVAL;
+		return NULL;
+	} else if (netmsg_getclaimeddatasize(m, &before) < 0)
+		return NULL;
+	else if (before < NETMSG_COMPRESSMIN) {
+		errno = EINVAL;
+		return NULL;
+	}
 
-				log_fatal("netmsg_setlabel: could not read out data to be backed up");
-		}
+	if ((out = netmsg_transform(m, 1)) == NULL)
+		return NULL;
+
+	if (netmsg_getclaimeddatasize(out, &after) < 0 || after >= before) {
+		netmsg_teardown(out);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return out;
+}
+
+/* returns a plain copy of a compressed m. bad or
+ * oversized compressed data is noted in m's errstr.
+ * EINVAL alone means there was no data to decompress
+ */
+struct netmsg *
+netmsg_decompress(struct netmsg *m)
+{
+	struct netmsg	*out;
+
+	if (!netmsg_iscompressed(m) || !netmsg_hasdata(m->opcode)) {
+		errno = EINVAL;
+		return NULL;
 	}
 
-	if (m->truncatestorage(m->descriptor, sizeof(uint8_t)) < 0)
-		log_fatal("netmsg_setlabel: failed to truncate buffer down before relabel");
+	if ((out = netmsg_transform(m, 0)) == NULL)
+		snprintf(m->errstr, ERRSTRSIZE, "could not decompress message: %s",
+			strerror(errno));
 
-	if (m->seekstorage(m->descriptor, 0, SEEK_END) < 0)
-		log_fatal("netmsg_setlabel: failed to seek to end of truncated buffer");
+	return out;
+}
 
-	if (m->writestorage(m->descriptor, &benewlabelsize, sizeof(uint64_t))
-		!= sizeof(uint64_t))
+/* a descriptor for the same open file, which can be passed
+ * to another process. only disk messages have one
+ */
+int
+netmsg_getfd(struct netmsg *m)
+{
+	int	fd;
 
-		log_fatal("netmsg_setlabel: failed to write new label size");
+	if (m->iovstorage != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	if (m->writestorage(m->descriptor, newlabel, newlabelsize) != (ssize_t)newlabelsize)
-		log_fatal("netmsg_setlabel: failed to write new label");
+	fd = dup(m->descriptor);
+	if (fd < 0) strncpy(m->errstr, strerror(errno), ERRSTRSIZE);
 
-	if (datacopysize > 0) {
-		if (m->writestorage(m->descriptor, datacopy, datacopysize) !=
-			(ssize_t)datacopysize)
+	return fd;
+}
+
+/* where a disk message we created lives, for as long as
+ * it does. messages loaded from a descriptor have no path
+ */
+const char *
+netmsg_getpath(struct netmsg *m)
+{
+	if (m->path == NULL) errno = EINVAL;
+	return m->path;
+}
 
-			log_fatal("netmsg_setlabel: failed to restore backed up data");
+char *
+netmsg_getlabel(struct netmsg *m)
+{
+	char		*out = NULL;
+	ssize_t		 bytesread, offset;
+	uint64_t	 labelsize;
 
-		free(datacopy);
+	offset = sizeof(uint8_t) + sizeof(uint64_t);
+	if (netmsg_getclaimedlabelsize(m, &labelsize) < 0) {
+		snprintf(m->errstr, ERRSTRSIZE,
+			"netmsg_getlabel: netmsg_getclaimedlabelsize: %s", strerror(errno));
+		goto end;
 	}
 
-	status = 0;
+	if (m->seekstorage(m->descriptor, offset, SEEK_SET) < 0)
+		log_fatal("netmsg_getlabel: could not seek to %lu", offset);
+
+	out = reallocarray(NULL, labelsize + 1, sizeof(char));
+	if (out == NULL)
+		log_fatal("netmsg_getlabel: reallocarray for netmsg label copy");
+
+	bytesread = m->readstorage(m->descriptor, out, labelsize);
+
+	if (bytesread < 0)
+		log_fatal("netmsg_getlabel: could not read buffer");
+
+	out[bytesread] = '\0';
 end:
-	return status;
+	return out;
 }
 
 char *
@@ -580,84 +938,293 @@ end:
 	return out;
 }
 
-int
-netmsg_setdata(struct netmsg *m, char *newdata, uint64_t datasize)
+/* how much data the message carries, without
+ * reading any of it in
+ */
+uint64_t
+netmsg_getdatasize(struct netmsg *m)
 {
-	uint64_t	labelsize, bedatasize;
-	ssize_t		offset;
-	int		status = -1;	
+	uint64_t	datasize;
 
-	if (datasize > MAXFILESIZE) {
+	if (netmsg_getclaimeddatasize(m, &datasize) < 0) {
 		snprintf(m->errstr, ERRSTRSIZE,
-			"new data size %llu exceeds allowed maximum", datasize);
-		goto end;
+			"netmsg_getdatasize: netmsg_getclaimeddatasize: %s", strerror(errno));
+		return 0;
 	}
 
-	bedatasize = htobe64(datasize);
+	return datasize;
+}
 
-	if (netmsg_getclaimedlabelsize(m, &labelsize) < 0) {
-		snprintf(m->errstr, ERRSTRSIZE,
-			"netmsg_setdata: netmsg_getclaimedlabelsize: %s", strerror(errno));
+static void
+netmsg_resetparser(struct netmsg *m)
+{
+	m->parsestate = NETMSG_PARSE_OPCODE;
+	m->parsed = 0;
+	m->labelsize = 0;
+	m->datasize = 0;
+}
+
+/* pull a big endian size header out of storage at
+ * the parser's current position, returns -1 and sets
+ * errno to ERANGE if the size is over the given cap
+ */
+static int
+netmsg_parsesize(struct netmsg *m, uint64_t *out, uint64_t max)
+{
+	ssize_t		bytesread;
+	int		status = -1;
+
+	if (m->seekstorage(m->descriptor, m->parsed, SEEK_SET) < 0)
+		log_fatal("netmsg_parsesize: could not seek to %llu", m->parsed);
+
+	bytesread = m->readstorage(m->descriptor, out, sizeof(uint64_t));
+
+	if (bytesread < 0)
+		log_fatal("netmsg_parsesize: could not read buffer");
+	else if (bytesread != sizeof(uint64_t))
+		log_fatalx("netmsg_parsesize: short read of size header");
+
+	*out = be64toh(*out);
+
+	if (*out > max) {
+		errno = ERANGE;
 		goto end;
 	}
 
-	offset = sizeof(uint8_t) + sizeof(uint64_t) + labelsize;
+	m->parsed += sizeof(uint64_t);
+	status = 0;
+end:
+	return status;
+}
 
-	if (m->truncatestorage(m->descriptor, offset) < 0)
-		log_fatal("netmsg_setdata: failed to truncate buffer to type+label");
+/* the label is a string, so the only thing to check
+ * is that the sender didn't sneak a terminator into it
+ */
+static int
+netmsg_parselabel(struct netmsg *m, uint64_t count)
+{
+	char		scratch[MAXNAMESIZE];
+	ssize_t		bytesread;
+	int		status = -1;
 
-	if (m->seekstorage(m->descriptor, 0, SEEK_END) < 0)
-		log_fatal("netmsg_setdata: failed to seek to end of label");
+	if (m->seekstorage(m->descriptor, m->parsed, SEEK_SET) < 0)
+		log_fatal("netmsg_parselabel: could not seek to %llu", m->parsed);
 
-	if (m->writestorage(m->descriptor, &bedatasize, sizeof(uint64_t))
-		!= sizeof(uint64_t))
+	bytesread = m->readstorage(m->descriptor, scratch, count);
 
-		log_fatal("netmsg_setdata: failed to write new data size");
+	if (bytesread < 0)
+		log_fatal("netmsg_parselabel: could not read buffer");
+	else if ((uint64_t)bytesread != count)
+		log_fatalx("netmsg_parselabel: short read of label");
 
-	if (m->writestorage(m->descriptor, newdata, datasize) != (ssize_t)datasize)
-		log_fatal("netmsg_setdata: failed to write new data");
+	if (memchr(scratch, '\0', count) != NULL) {
+		snprintf(m->errstr, ERRSTRSIZE,
+			"label of claimed size %llu contains a null byte", m->labelsize);
+		goto end;
+	}
 
+	m->parsed += count;
 	status = 0;
 end:
 	return status;
 }
 
-int
-netmsg_isvalid(struct netmsg *m, int *fatal)
+/* run the decoder over whatever bytes have arrived since the
+ * last call, given the total number of bytes in storage. returns
+ * -1 on a malformed message, with the reason left in errstr
+ */
+static int
+netmsg_advance(struct netmsg *m, uint64_t total)
 {
-	char		*copied;
-	uint64_t	 claimedsize, copiedsize;
-	int		 needlabel, needdata, status = 0;
+	uint8_t		actualtype;
+	uint64_t	labelend, dataend;
+	ssize_t		actualtypesize;
+
+	for (;;) {
+		labelend = NETMSG_LABELOFFSET + m->labelsize;
+		dataend = labelend + sizeof(uint64_t) + m->datasize;
+
+		switch (m->parsestate) {
+		case NETMSG_PARSE_OPCODE:
+			if (total < sizeof(uint8_t))
+				return 0;
+
+			if (m->seekstorage(m->descriptor, 0, SEEK_SET) < 0)
+				log_fatal("netmsg_advance: seek to start of message");
+
+			actualtypesize = m->readstorage(m->descriptor, &actualtype,
+				sizeof(uint8_t));
+
+			if (actualtypesize < 0)
+				log_fatal("netmsg_advance: failed to pull type off message");
+			else if (actualtypesize != sizeof(uint8_t))
+				log_fatalx("netmsg_advance: short read of message type");
+
+			if (actualtype != m->opcode) {
+				snprintf(m->errstr, ERRSTRSIZE,
+					"cached opcode %u doesn't match marshalled opcode %u",
+					m->opcode, actualtype);
+				return -1;
+			}
+
+			m->parsed = sizeof(uint8_t);
+
+			if (m->needlabel) m->parsestate = NETMSG_PARSE_LABELSIZE;
+			else m->parsestate = NETMSG_PARSE_DONE;
+			break;
+
+		case NETMSG_PARSE_LABELSIZE:
+			if (total - m->parsed < sizeof(uint64_t))
+				return 0;
+
+			if (netmsg_parsesize(m, &m->labelsize, MAXNAMESIZE) < 0) {
+				snprintf(m->errstr, ERRSTRSIZE,
+					"claimed label size %llu exceeds allowed maximum",
+					m->labelsize);
+				return -1;
+			}
+
+			m->parsestate = NETMSG_PARSE_LABEL;
+			break;
+
+		case NETMSG_PARSE_LABEL:
+			if (m->parsed < labelend) {
+				if (m->parsed == total)
+					return 0;
+
+				if (netmsg_parselabel(m,
+				    ((total < labelend) ? total : labelend) - m->parsed) < 0)
+					return -1;
+
+				if (m->parsed < labelend)
+					return 0;
+			}
+
+			if (m->needdata) m->parsestate = NETMSG_PARSE_DATASIZE;
+			else m->parsestate = NETMSG_PARSE_DONE;
+			break;
+
+		case NETMSG_PARSE_DATASIZE:
+			if (total - m->parsed < sizeof(uint64_t))
+				return 0;
+
+			if (netmsg_parsesize(m, &m->datasize, MAXFILESIZE) < 0) {
+				snprintf(m->errstr, ERRSTRSIZE,
+					"claimed data size %llu exceeds allowed maximum",
+					m->datasize);
+				return -1;
+			}
+
+			m->parsestate = NETMSG_PARSE_DATA;
+			break;
+
+		case NETMSG_PARSE_DATA:
+			/* nothing to check in the payload itself, so
+			 * just account for it without touching storage
+			 */
+			m->parsed = (total < dataend) ? total : dataend;
+			if (m->parsed < dataend)
+				return 0;
+
+			m->parsestate = NETMSG_PARSE_DONE;
+			break;
+
+		case NETMSG_PARSE_DONE:
+			if (total > m->parsed) {
+				snprintf(m->errstr, ERRSTRSIZE,
+					"claimed message size %llu != actual message size %llu",
+					m->parsed, total);
+				return -1;
+			}
+
+			return 0;
+
+		default:
+			log_fatalx("netmsg_advance: bug - illegal parser state %d",
+				m->parsestate);
+		}
+	}
+}
 
-	ssize_t		 actualtypesize;
-	uint8_t		 actualtype;
+uint64_t
+netmsg_getmissing(struct netmsg *m)
+{
+	uint64_t	labelend, missing = 0;
+
+	labelend = NETMSG_LABELOFFSET + m->labelsize;
+
+	/* until a size header has been parsed, the best we can say
+	 * is how far away the next header boundary is. once the last
+	 * one is in, this is exactly what's left of the message
+	 */
+	switch (m->parsestate) {
+	case NETMSG_PARSE_OPCODE:
+		missing = sizeof(uint8_t) - m->parsed;
+		break;
 
-	ssize_t		 actualmessagesize, calculatedmessagesize;
+	case NETMSG_PARSE_LABELSIZE:
+		missing = NETMSG_LABELOFFSET - m->parsed;
+		break;
+
+	case NETMSG_PARSE_LABEL:
+		missing = labelend - m->parsed;
+		if (m->needdata) missing += sizeof(uint64_t);
+		break;
+
+	case NETMSG_PARSE_DATASIZE:
+		missing = labelend + sizeof(uint64_t) - m->parsed;
+		break;
+
+	case NETMSG_PARSE_DATA:
+		missing = labelend + sizeof(uint64_t) + m->datasize - m->parsed;
+		break;
+	}
+
+	return missing;
+}
+
+int
+netmsg_isvalid(struct netmsg *m, int *fatal)
+{
+	ssize_t		 actualmessagesize;
 	off_t		 savedoffset;
+	int		 status = 0;
 
 	/* usually, validity failures are not fatal, i.e.
 	 * more data can resolve the issue at hand
 	 */
 	*fatal = 0;
 
-	switch (m->opcode) {
+	switch (m->opcode & ~NETOP_COMPRESSED) {
 	case NETOP_SENDFILE:
-		needlabel = 1;
-		needdata = 1;
+	case NETOP_SENDLINES:
+	case NETOP_STREAM:
+	case NETOP_FILECHUNK:
+	case NETOP_MANIFEST:
+	case NETOP_CHUNK:
+		m->needlabel = 1;
+		m->needdata = 1;
 		break;
 
 	case NETOP_SENDLINE:
 	case NETOP_ERROR:
-		needlabel = 1;
-		needdata = 0;
+	case NETOP_IDENTIFY:
+	case NETOP_QUEUEPOSITION:
+	case NETOP_ACKUPTO:
+	case NETOP_FILEBEGIN:
+	case NETOP_FILEEND:
+	case NETOP_ANNOUNCE:
+		m->needlabel = 1;
+		m->needdata = 0;
 		break;
 
 	case NETOP_REQUESTLINE:
 	case NETOP_TERMINATE:
 	case NETOP_ACK:
 	case NETOP_HEARTBEAT:
-		needlabel = 0;
-		needdata = 0;
+	case NETOP_MEMOIZE:
+		m->needlabel = 0;
+		m->needdata = 0;
 		break;
 
 	default:
@@ -666,93 +1233,26 @@ netmsg_isvalid(struct netmsg *m, int *fatal)
 		goto end;
 	}
 
-	if ((savedoffset = m->seekstorage(m->descriptor, 0, SEEK_CUR)) < 0)
-		log_fatal("netmsg_isvalid: seek to get current offset into message");
-
-	if (m->seekstorage(m->descriptor, 0, SEEK_SET) < 0)
-		log_fatal("netmsg_isvalid: failed to seek to start of message to check type");
-
-	actualtypesize = m->readstorage(m->descriptor, &actualtype, sizeof(uint8_t));
-
-	if (actualtypesize < 0)
-		log_fatal("netmsg_isvalid: failed to pull actual type off message");
-
-	else if (actualtypesize != sizeof(uint8_t)) {
-		strncpy(m->errstr, "netmsg_isvalid: complete message type not present",
-			ERRSTRSIZE);
-		goto end;
-
-	} else if (actualtype != m->opcode) {
-		snprintf(m->errstr, ERRSTRSIZE,
-			"cached opcode %u doesn't match marshalled opcode %u",
-			m->opcode, actualtype);
+	if (m->parsestate == NETMSG_PARSE_ERROR) {
 		*fatal = 1;
 		goto end;
 	}
 
-	if (needlabel) {
-		if (netmsg_getclaimedlabelsize(m, &claimedsize) < 0) {
-			snprintf(m->errstr, ERRSTRSIZE,
-				"netmsg_isvalid: netmsg_getclaimedlabelsize: %s", strerror(errno));
-
-			if (errno == ERANGE) *fatal = 1;
-			goto end;
-		}
-
-		copied = netmsg_getlabel(m);
-		if (copied == NULL) goto end;
-
-		copiedsize = strlen(copied);
-		free(copied);
-
-		if (copiedsize != claimedsize) {
-			snprintf(m->errstr, ERRSTRSIZE, "claimed label size %llu != actual label strlen %llu",
-				claimedsize, copiedsize);
-			goto end;
-		}
-	}
-
-	if (needdata) {
-		if (netmsg_getclaimeddatasize(m, &claimedsize) < 0) {
-			snprintf(m->errstr, ERRSTRSIZE,
-				"netmsg_isvalid: netmsg_getclaimeddatasize: %s", strerror(errno));
-
-			if (errno == ERANGE) *fatal = 1;
-			goto end;
-		}
-
-		copied = netmsg_getdata(m, &copiedsize);
-		if (copied == NULL) goto end;
-
-		free(copied);
-
-		if (copiedsize != claimedsize) {
-			strncpy(m->errstr, "claimed data size != actual data size",
-				ERRSTRSIZE);
-			goto end;
-		}
-	}
+	if ((savedoffset = m->seekstorage(m->descriptor, 0, SEEK_CUR)) < 0)
+		log_fatal("netmsg_isvalid: seek to get current offset into message");
 
-	calculatedmessagesize = netmsg_getexpectedsizeifvalid(m);
 	actualmessagesize = m->seekstorage(m->descriptor, 0, SEEK_END);
-
 	if (actualmessagesize < 0)
 		log_fatal("netmsg_isvalid: seek for actual message size");
 
-	else if (actualmessagesize != calculatedmessagesize) {
-		snprintf(m->errstr, ERRSTRSIZE,
-			"claimed message size %ld != actual message size %ld",
-			calculatedmessagesize, actualmessagesize);
-
+	if (netmsg_advance(m, (uint64_t)actualmessagesize) < 0) {
+		m->parsestate = NETMSG_PARSE_ERROR;
 		*fatal = 1;
-		goto end;
-	}
+	} else if (m->parsestate == NETMSG_PARSE_DONE)
+		status = 1;
 
-	status = 1;
+	if (m->seekstorage(m->descriptor, savedoffset, SEEK_SET) != savedoffset)
+		log_fatal("netmsg_isvalid: restore message offset prior to validation");
 end:
-	if (*fatal == 0 || status == 1) {
-		if (m->seekstorage(m->descriptor, savedoffset, SEEK_SET) != savedoffset)
-			log_fatal("netmsg_isvalid: restore message offset prior to validation");
-	}
 	return status;
 }
@@ -0,0 +1,255 @@
+/* workerd generational slot map
+ * hands out small integer handles for objects and
+ * looks them up again in constant time. each slot
+ * carries a generation which is folded into the handle,
+ * so a handle to something that has since been removed
+ * (and maybe replaced) no longer resolves
+ *
+ * (c) jay lang 2023
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "workerd.h"
+
+#define SLOTMAP_INITIALSLOTS	64
+
+#define SLOTMAP_NOSLOT		UINT32_MAX
+
+#define SLOTMAP_MODENONE	0
+#define SLOTMAP_MODEALLOCATE	1
+#define SLOTMAP_MODEMIRROR	2
+
+#define SLOTMAP_INDEX(H)	((H) & SLOTMAP_INDEXMASK)
+#define SLOTMAP_GENERATION(H)	(((H) >> SLOTMAP_INDEXBITS) & SLOTMAP_GENERATIONMASK)
+#define SLOTMAP_HANDLE(I, G)	(((G) << SLOTMAP_INDEXBITS) | (I))
+
+struct slot {
+	void		*obj;
+	uint32_t	 generation;
+	uint32_t	 nextfree;
+};
+
+struct slotmap {
+	struct slot	*slots;
+	uint32_t	 capacity;
+	uint32_t	 used;
+	uint32_t	 count;
+
+	uint32_t	 freehead;
+
+	/* maps filled with slotmap_insertat mirror somebody
+	 * else's handles, so they don't keep a free list
+	 */
+	int		 mode;
+};
+
+static int	slotmap_accomodate(struct slotmap *, uint32_t);
+
+static int
+slotmap_accomodate(struct slotmap *sm, uint32_t count)
+{
+	struct slot	*newslots;
+	uint32_t	 newcapacity;
+
+	if (count <= sm->capacity) return 0;
+
+	if (count > SLOTMAP_MAXSLOTS) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	newcapacity = (sm->capacity > 0) ? sm->capacity : SLOTMAP_INITIALSLOTS;
+	while (newcapacity < count) newcapacity *= 2;
+	if (newcapacity > SLOTMAP_MAXSLOTS) newcapacity = SLOTMAP_MAXSLOTS;
+
+	newslots = recallocarray(sm->slots, sm->capacity, newcapacity, sizeof(struct slot));
+	if (newslots == NULL) return -1;
+
+	sm->slots = newslots;
+	sm->capacity = newcapacity;
+
+	return 0;
+}
+
+struct slotmap *
+slotmap_new(void)
+{
+	struct slotmap	*out;
+
+	out = calloc(1, sizeof(struct slotmap));
+	if (out == NULL) goto end;
+
+	out->freehead = SLOTMAP_NOSLOT;
+end:
+	return out;
+}
+
+void
+slotmap_teardown(struct slotmap *sm)
+{
+	free(sm->slots);
+	free(sm);
+}
+
+int
+slotmap_insert(struct slotmap *sm, void *obj, uint32_t *handle)
+{
+	struct slot	*s;
+	uint32_t	 index;
+	int		 status = -1;
+
+	if (sm->mode == SLOTMAP_MODEMIRROR)
+		log_fatalx("slotmap_insert: bug - allocating handles in a mirror map");
+
+	if (obj == NULL) {
+		errno = EINVAL;
+		goto end;
+	}
+
+	sm->mode = SLOTMAP_MODEALLOCATE;
+
+	if (sm->freehead != SLOTMAP_NOSLOT) {
+		index = sm->freehead;
+		sm->freehead = sm->slots[index].nextfree;
+
+	} else {
+		if (slotmap_accomodate(sm, sm->used + 1) < 0)
+			goto end;
+
+		index = sm->used++;
+	}
+
+	s = &sm->slots[index];
+	s->obj = obj;
+	s->nextfree = SLOTMAP_NOSLOT;
+
+	sm->count++;
+
+	*handle = SLOTMAP_HANDLE(index, s->generation);
+	status = 0;
+end:
+	return status;
+}
+
+/* place obj under a handle that was issued by some other
+ * map, e.g. to find things by a conn's handle. anything
+ * still sitting at that index under an older generation
+ * is stale by definition and gets displaced
+ */
+int
+slotmap_insertat(struct slotmap *sm, uint32_t handle, void *obj)
+{
+	struct slot	*s;
+	uint32_t	 index;
+	int		 status = -1;
+
+	if (obj == NULL || handle > SLOTMAP_MAXHANDLE) {
+		errno = EINVAL;
+		goto end;
+	} else if (sm->mode == SLOTMAP_MODEALLOCATE)
+		log_fatalx("slotmap_insertat: bug - mirroring into an allocating map");
+
+	sm->mode = SLOTMAP_MODEMIRROR;
+
+	index = SLOTMAP_INDEX(handle);
+	if (slotmap_accomodate(sm, index + 1) < 0)
+		goto end;
+
+	if (index >= sm->used) sm->used = index + 1;
+
+	s = &sm->slots[index];
+
+	if (s->obj != NULL) {
+		if (s->generation == SLOTMAP_GENERATION(handle)) {
+			errno = EEXIST;
+			goto end;
+		}
+	} else sm->count++;
+
+	s->obj = obj;
+	s->generation = SLOTMAP_GENERATION(handle);
+
+	status = 0;
+end:
+	return status;
+}
+
+void *
+slotmap_get(struct slotmap *sm, uint32_t handle)
+{
+	struct slot	*s;
+	uint32_t	 index;
+
+	index = SLOTMAP_INDEX(handle);
+
+	if (handle > SLOTMAP_MAXHANDLE || index >= sm->used)
+		goto bad;
+
+	s = &sm->slots[index];
+	if (s->obj == NULL || s->generation != SLOTMAP_GENERATION(handle))
+		goto bad;
+
+	return s->obj;
+bad:
+	errno = ENOENT;
+	return NULL;
+}
+
+void *
+slotmap_remove(struct slotmap *sm, uint32_t handle)
+{
+	struct slot	*s;
+	void		*out;
+
+	out = slotmap_get(sm, handle);
+	if (out == NULL) goto end;
+
+	s = &sm->slots[SLOTMAP_INDEX(handle)];
+	s->obj = NULL;
+
+	/* mirrors take their generations from whoever
+	 * allocated the handle, so only bump our own
+	 */
+	if (sm->mode == SLOTMAP_MODEALLOCATE) {
+		s->generation = (s->generation + 1) & SLOTMAP_GENERATIONMASK;
+		s->nextfree = sm->freehead;
+		sm->freehead = SLOTMAP_INDEX(handle);
+	}
+
+	sm->count--;
+end:
+	return out;
+}
+
+uint32_t
+slotmap_count(struct slotmap *sm)
+{
+	return sm->count;
+}
+
+/* walk live objects in slot order. start with *cursor = 0;
+ * removing the object just returned is fine
+ */
+void *
+slotmap_iterate(struct slotmap *sm, uint32_t *cursor, uint32_t *handle)
+{
+	struct slot	*s;
+
+	while (*cursor < sm->used) {
+		s = &sm->slots[(*cursor)++];
+
+		if (s->obj != NULL) {
+			if (handle != NULL)
+				*handle = SLOTMAP_HANDLE(*cursor - 1, s->generation);
+
+			return s->obj;
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,236 @@
+/* workerd on-disk store
+ * a directory of files named by their sha256, along with
+ * what we know about them in memory. the least recently
+ * used ones go once there are too many or they take up
+ * too much space. the frontend keeps bundles and chunks in
+ * these, and the engine keeps job transcripts
+ *
+ * (c) jay lang 2023
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sha2.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "workerd.h"
+
+struct storeentry {
+	char			hash[SHA256_DIGEST_STRING_LENGTH];
+	off_t			size;
+
+	TAILQ_ENTRY(storeentry)	entries;
+	RB_ENTRY(storeentry)	byhash;
+};
+
+TAILQ_HEAD(storelist, storeentry);
+RB_HEAD(storetree, storeentry);
+
+/* most recently used at the head of lru, with
+ * a tree to find things by, since there can be
+ * tens of thousands of entries
+ */
+struct store {
+	const char		*dir;
+	struct storelist	 lru;
+	struct storetree	 tree;
+
+	uint32_t		 count, maxcount;
+	off_t			 bytes, maxbytes;
+
+	uint64_t		 hits, misses, served;
+	uint64_t		 lasthits, lastmisses;
+};
+
+static int			 store_cmp(struct storeentry *, struct storeentry *);
+static struct storeentry	*store_find(struct store *, const char *);
+static void			 store_touchentry(struct store *, struct storeentry *);
+static void			 store_evict(struct store *, struct storeentry *);
+
+RB_GENERATE_STATIC(storetree, storeentry, byhash, store_cmp);
+
+static int
+store_cmp(struct storeentry *a, struct storeentry *b)
+{
+	return strcmp(a->hash, b->hash);
+}
+
+static struct storeentry *
+store_find(struct store *s, const char *hash)
+{
+	struct storeentry	key;
+
+	strlcpy(key.hash, hash, sizeof(key.hash));
+	return RB_FIND(storetree, &s->tree, &key);
+}
+
+static void
+store_touchentry(struct store *s, struct storeentry *e)
+{
+	TAILQ_REMOVE(&s->lru, e, entries);
+	TAILQ_INSERT_HEAD(&s->lru, e, entries);
+}
+
+static void
+store_evict(struct store *s, struct storeentry *e)
+{
+	char	*path;
+
+	path = store_path(s, e->hash);
+	if (unlink(path) < 0 && errno != ENOENT)
+		log_write(LOGTYPE_WARN, "store_evict: unlink %s", path);
+
+	TAILQ_REMOVE(&s->lru, e, entries);
+	RB_REMOVE(storetree, &s->tree, e);
+	s->count--;
+	s->bytes -= e->size;
+
+	free(path);
+	free(e);
+}
+
+struct store *
+store_new(const char *dir, uint32_t maxcount, off_t maxbytes)
+{
+	struct store	*s;
+
+	if ((s = calloc(1, sizeof(struct store))) == NULL)
+		return NULL;
+
+	s->dir = dir;
+	s->maxcount = maxcount;
+	s->maxbytes = maxbytes;
+
+	TAILQ_INIT(&s->lru);
+	RB_INIT(&s->tree);
+
+	return s;
+}
+
+char *
+store_path(struct store *s, const char *hash)
+{
+	char	*out;
+
+	if (asprintf(&out, "%s/%s", s->dir, hash) < 0)
+		log_fatal("store_path: asprintf");
+
+	return out;
+}
+
+/* a descriptor for whatever is kept under hash, or -1
+ * with errno set to ENOENT if there's nothing. if size
+ * isn't -1, that's how big it has to be
+ */
+int
+store_open(struct store *s, const char *hash, off_t size)
+{
+	struct storeentry	*e;
+	char			*path;
+	int			 fd = -1;
+
+	if ((e = store_find(s, hash)) == NULL || (size >= 0 && e->size != size)) {
+		errno = ENOENT;
+		goto end;
+	}
+
+	path = store_path(s, hash);
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		log_write(LOGTYPE_WARN, "store_open: open %s", path);
+		store_evict(s, e);
+		errno = ENOENT;
+	} else {
+		store_touchentry(s, e);
+		s->served += e->size;
+	}
+
+	free(path);
+end:
+	if (fd < 0) s->misses++;
+	else s->hits++;
+
+	return fd;
+}
+
+/* freshen up hash, or -1 with errno set
+ * to ENOENT if it isn't here
+ */
+int
+store_touch(struct store *s, const char *hash)
+{
+	struct storeentry	*e;
+
+	if ((e = store_find(s, hash)) == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	store_touchentry(s, e);
+	return 0;
+}
+
+/* take in the file at store_path for hash, which
+ * the store can't have already
+ */
+void
+store_add(struct store *s, const char *hash, off_t size)
+{
+	struct storeentry	*e;
+
+	if ((e = calloc(1, sizeof(struct storeentry))) == NULL)
+		log_fatal("store_add: calloc");
+
+	strlcpy(e->hash, hash, sizeof(e->hash));
+	e->size = size;
+
+	if (RB_INSERT(storetree, &s->tree, e) != NULL)
+		log_fatalx("store_add: already have %s", hash);
+
+	TAILQ_INSERT_HEAD(&s->lru, e, entries);
+	s->count++;
+	s->bytes += e->size;
+
+	while (s->count > s->maxcount || s->bytes > s->maxbytes)
+		store_evict(s, TAILQ_LAST(&s->lru, storelist));
+}
+
+/* get rid of hash, i.e. because it can't be read */
+void
+store_remove(struct store *s, const char *hash)
+{
+	struct storeentry	*e;
+
+	if ((e = store_find(s, hash)) != NULL)
+		store_evict(s, e);
+}
+
+/* log how lookups have gone under what, unless
+ * there haven't been any since last time
+ */
+void
+store_report(struct store *s, const char *what, const char *served)
+{
+	uint64_t	lookups;
+
+	if (s->hits == s->lasthits && s->misses == s->lastmisses)
+		return;
+
+	lookups = s->hits + s->misses;
+
+	log_writex(LOGTYPE_MSG, "%s: %llu hits, %llu misses (%llu%%), "
+		"%llu %s, %u entries in %lld bytes",
+		what, s->hits, s->misses, s->hits * 100 / lookups, s->served,
+		served, s->count, (long long)s->bytes);
+
+	s->lasthits = s->hits;
+	s->lastmisses = s->misses;
+}
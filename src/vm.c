@@ -12,6 +12,7 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 
 #include <errno.h>
@@ -24,52 +25,58 @@
 
 #include "workerd.h"
 
-#define VM_BOOTSTATE	0
-#define VM_READYSTATE	1
-#define VM_WORKSTATE	2
-#define VM_ZOMBIESTATE	3
-#define VM_MAXSTATE	4
+#define VM_CREATESTATE	0
+#define VM_BOOTSTATE	1
+#define VM_READYSTATE	2
+#define VM_WORKSTATE	3
+#define VM_ZOMBIESTATE	4
+#define VM_MAXSTATE	5
 
 #define VM_NOKEY	-1
 
-#define VMCTL(ASSERT, ...) do {						\
-	int	wstatus;						\
-	pid_t	pid;							\
+#define VMCTL(V, CB, ...) do {						\
+	if (cmd_run((CB), (V), VMCTL_PATH, __VA_ARGS__, NULL) < 0)	\
+		log_fatal("VMCTL: cmd_run");				\
 									\
-	if ((pid = fork()) < 0)						\
-		log_fatal("VMCTL: fork");				\
-									\
-	if (pid == 0) {							\
-		if (!debug) {						\
-                	freopen("/dev/null", "a", stdout);		\
-			freopen("/dev/null", "a", stderr);		\
-		}							\
-									\
-		execl(VMCTL_PATH, VMCTL_PATH, __VA_ARGS__, NULL);	\
-		log_fatal("VMCTL: execl");				\
-	}								\
-									\
-	do {								\
-		if (wait(&wstatus) < 0)					\
-			log_fatal("VMCTL: wait");			\
-	} while (!WIFEXITED(wstatus) && !WIFSIGNALED(wstatus));		\
-									\
-	if (WIFSIGNALED(wstatus))					\
-		log_fatalx("VMCTL: terminated by signal %d",		\
-			WTERMSIG(wstatus));				\
-									\
-	else if ((ASSERT) && WEXITSTATUS(wstatus) != 0)			\
-		log_fatalx("VMCTL: exited with status %d",		\
-			WEXITSTATUS(wstatus));				\
+	(V)->pending++;							\
 } while (0)
 
 struct vm {
-	int	 	 initialized;
+	uint32_t	 id;
 	int	 	 state;	
 	uint32_t	 key;
 
 	int		 shouldheartbeat;
 
+	/* vmctl runs asynchronously. while anything is
+	 * pending, the next step waits for it to finish
+	 */
+	int		 pending;
+	int		 started;
+
+	/* retired vms are freed once vmctl has
+	 * torn them down, i.e. once they're gone
+	 */
+	int		 retired;
+	int		 gone;
+
+	struct timeval	 readysince;
+
+	/* output the client hasn't acknowledged yet. the vm
+	 * runs ahead until the window fills up, and then we hold
+	 * its ack back. termination waits for the client to
+	 * catch up entirely
+	 */
+	struct window	*window;
+
+	int		 blocked;
+	int		 terminating;
+
+	/* chunks of a client's upload we've queued up for
+	 * the vm and that haven't gone out to it yet
+	 */
+	uint64_t	 partsout;
+
 	char		*basedisk;
 	char		*vivadodisk;
 
@@ -79,80 +86,119 @@ struct vm {
 	struct conn		*conn;
 	struct vm_interface	 callbacks;
 
-	SIMPLEQ_ENTRY(vm)	 entries;
+	/* boot queue or ready queue, never both */
+	TAILQ_ENTRY(vm)		 entries;
 };
 
-SIMPLEQ_HEAD(vmqueue, vm);
+TAILQ_HEAD(vmqueue, vm);
+
+/* vms with fresh disks wait here for one of the
+ * VM_MAXBOOTS boot slots. a slot frees up once its vm
+ * identifies itself on a new connection, or gets reaped
+ */
+static struct vmqueue	 bootqueue = TAILQ_HEAD_INITIALIZER(bootqueue);
+static int		 booting = 0;
 
-static struct vmqueue	 bootqueue = SIMPLEQ_HEAD_INITIALIZER(bootqueue);
+static void		 bootqueue_enqboot(struct vm *);
+static void	 	 bootqueue_kick(void);
+static void		 bootqueue_remove(struct vm *);
 
-static void		 bootqueue_enqmachine(struct vm *);
-static void	 	 bootqueue_bootfirst(void);
-static struct vm	*bootqueue_popfirst(void);
-static void		 bootqueue_clear(void);
+/* ready vms, longest idle first. claims come off the
+ * back, so the front ages out while we have more than
+ * VM_IDLETARGET of them
+ */
+static struct vmqueue	 readyqueue = TAILQ_HEAD_INITIALIZER(readyqueue);
+static struct event	 idletimer;
 
-static struct vm	 allvms[VM_MAXCOUNT] = { 0 };
+/* every vm we own, by id. the id also names the vm,
+ * so a guest's identity leads straight back here
+ */
+static struct slotmap	*allvms = NULL;
+static int		 statecount[VM_MAXSTATE] = { 0 };
+static int		 shuttingdown = 0;
 
-static int		 allvms_getvmindex(struct vm *);
+/* somebody may be waiting on vms to come up */
+static void		(*readycb)(void) = NULL;
 
-static void	 	 vm_reset(struct vm *);
+/* claimed vms by the key they work for, and live vms
+ * by the handle of their connection
+ */
+static struct slotmap	*vmsbykey = NULL;
+static struct slotmap	*vmsbyconn = NULL;
+
+static void		 vm_new(void);
+static void		 vm_setstate(struct vm *, int);
+static int		 vm_livecount(void);
+static void		 vm_replenish(void);
+static void		 vm_idlereap(int, short, void *);
+
+static void		 vm_created(int, void *);
+static void		 vm_started(int, void *);
+static void		 vm_destroy(struct vm *);
+static void		 vm_stopped(int, void *);
+static void		 vm_cleanup(struct vm *);
+static void		 vm_initdone(int, void *);
+
+static void	 	 vm_retire(struct vm *);
+static void		 vm_free(struct vm *);
 static struct vm	*vm_byconn(struct conn *);
+static struct vm	*vm_byname(char *);
 
 static void		 vm_reporterror(struct vm *, const char *, ...);
 static void		 vm_reap(struct vm *, int);
 
+static void		 vm_trackout(struct vm *, struct netmsg *);
+static void		 vm_pump(struct vm *);
+static void		 vm_sendack(struct vm *);
+
 static void		 vm_handleteardown(struct conn *);
+static void		 vm_handledrain(struct conn *);
 static void		 vm_accept(struct conn *);
+static void		 vm_identify(struct conn *, struct netmsg *);
+static void		 vm_identifytimeout(struct conn *);
 static void		 vm_timeout(struct conn *);
 static void		 vm_getmsg(struct conn *, struct netmsg *);
 
 static void		 signaldone_annuled(uint32_t);
 
-static int
-allvms_getvmindex(struct vm *v)
-{
-	return v - (struct vm *)allvms;
-}
-
 static void
 bootqueue_enqboot(struct vm *v)
 {
-	SIMPLEQ_INSERT_TAIL(&bootqueue, v, entries);
-	if (SIMPLEQ_FIRST(&bootqueue) == v) 
-		bootqueue_bootfirst();
+	TAILQ_INSERT_TAIL(&bootqueue, v, entries);
+	bootqueue_kick();
 }
 
 static void
-bootqueue_bootfirst(void)
+bootqueue_kick(void)
 {
 	struct vm	*v;
 
-	v = SIMPLEQ_FIRST(&bootqueue);
-
-	VMCTL(1, "start", "-t", VM_TEMPLATENAME,
-		"-d", v->basedisk,
-		"-d", v->vivadodisk,
-		v->name);
-}
-
-static struct vm *
-bootqueue_popfirst(void)
-{
-	struct vm	*v;
+	while (!shuttingdown && booting < VM_MAXBOOTS) {
+		if ((v = TAILQ_FIRST(&bootqueue)) == NULL)
+			break;
 
-	v = SIMPLEQ_FIRST(&bootqueue);
-	SIMPLEQ_REMOVE_HEAD(&bootqueue, entries);
+		TAILQ_REMOVE(&bootqueue, v, entries);
 
-	if (!SIMPLEQ_EMPTY(&bootqueue)) bootqueue_bootfirst();
+		booting++;
+		v->started = 1;
 
-	return v;
+		VMCTL(v, vm_started, "start", "-t", VM_TEMPLATENAME,
+			"-d", v->basedisk,
+			"-d", v->vivadodisk,
+			v->name);
+	}
 }
 
+/* v is leaving the boot state, either because it
+ * came up or because it's being reaped
+ */
 static void
-bootqueue_clear(void)
+bootqueue_remove(struct vm *v)
 {
-	while (!SIMPLEQ_EMPTY(&bootqueue))
-		SIMPLEQ_REMOVE_HEAD(&bootqueue, entries);
+	if (v->started) booting--;
+	else TAILQ_REMOVE(&bootqueue, v, entries);
+
+	bootqueue_kick();
 }
 
 static void
@@ -172,6 +218,185 @@ vm_reporterror(struct vm *v, const char *fmt, ...)
 	va_end(ap);
 }
 
+/* a brand new vm: lay down fresh disks, then queue
+ * up to boot. both images get made at the same time
+ */
+static void
+vm_new(void)
+{
+	struct vm	*v;
+
+	if ((v = calloc(1, sizeof(struct vm))) == NULL)
+		log_fatal("vm_new: calloc");
+	else if (slotmap_insert(allvms, v, &v->id) < 0)
+		log_fatal("vm_new: slotmap_insert");
+	else if ((v->window = window_new()) == NULL)
+		log_fatal("vm_new: window_new");
+
+	v->state = VM_CREATESTATE;
+	v->key = VM_NOKEY;
+	statecount[v->state]++;
+
+	if (asprintf(&v->basedisk, "%s/base%u.qcow2", DISKS, v->id) < 0)
+		log_fatal("vm_new: asprintf base disk name");
+
+	if (asprintf(&v->vivadodisk, "%s/vivado%u.qcow2", DISKS, v->id) < 0)
+		log_fatal("vm_new: asprintf vivado disk name");
+
+	if (asprintf(&v->name, "%s%u", VM_NAMEPREFIX, v->id) < 0)
+		log_fatal("vm_new: asprintf vm name");
+
+	log_writex(LOGTYPE_DEBUG, "creating vm %s", v->name);
+
+	VMCTL(v, vm_created, "create", "-b", VM_BASEIMAGE, v->basedisk);	
+	VMCTL(v, vm_created, "create", "-b", VM_VIVADOIMAGE, v->vivadodisk);
+}
+
+static void
+vm_setstate(struct vm *v, int state)
+{
+	statecount[v->state]--;
+	statecount[state]++;
+
+	v->state = state;
+}
+
+/* zombies don't count; they're on their way out */
+static int
+vm_livecount(void)
+{
+	return slotmap_count(allvms) - statecount[VM_ZOMBIESTATE];
+}
+
+/* keep at least VM_MINCOUNT vms alive, and enough of
+ * them ready or on their way to meet VM_IDLETARGET. zombies
+ * count towards VM_MAXCOUNT until vmctl is done with them,
+ * since they still have a guest and disks
+ */
+static void
+vm_replenish(void)
+{
+	int	spare;
+
+	while (!shuttingdown && slotmap_count(allvms) < VM_MAXCOUNT) {
+		spare = statecount[VM_CREATESTATE] +
+			statecount[VM_BOOTSTATE] +
+			statecount[VM_READYSTATE];
+
+		if (vm_livecount() >= VM_MINCOUNT && spare >= VM_IDLETARGET)
+			break;
+
+		vm_new();
+	}
+}
+
+/* reap ready vms above VM_IDLETARGET once they've sat
+ * idle for VM_IDLECOOLDOWN, and come back for the rest
+ */
+static void
+vm_idlereap(int fd, short event, void *arg)
+{
+	struct timeval	 now, idle, tv;
+	struct vm	*v;
+
+	gettimeofday(&now, NULL);
+
+	while (statecount[VM_READYSTATE] > VM_IDLETARGET && vm_livecount() > VM_MINCOUNT) {
+		v = TAILQ_FIRST(&readyqueue);
+		timersub(&now, &v->readysince, &idle);
+
+		if (idle.tv_sec < VM_IDLECOOLDOWN) {
+			tv.tv_sec = VM_IDLECOOLDOWN;
+			tv.tv_usec = 0;
+
+			timersub(&tv, &idle, &tv);
+			evtimer_add(&idletimer, &tv);
+			break;
+		}
+
+		log_writex(LOGTYPE_DEBUG, "reaping idle vm %s", v->name);
+		vm_reap(v, 1);
+	}
+
+	(void)fd;
+	(void)event;
+	(void)arg;
+}
+
+static void
+vm_created(int status, void *arg)
+{
+	struct vm	*v = arg;
+
+	if (status != 0)
+		log_fatalx("vm_created: vmctl create exited with status %d", status);
+
+	if (--v->pending > 0) return;
+
+	/* reaped while the disks were being made */
+	if (v->state == VM_ZOMBIESTATE)
+		vm_destroy(v);
+
+	else {
+		vm_setstate(v, VM_BOOTSTATE);
+		bootqueue_enqboot(v);
+	}
+}
+
+static void
+vm_started(int status, void *arg)
+{
+	struct vm	*v = arg;
+
+	v->pending--;
+
+	if (v->state == VM_ZOMBIESTATE) {
+		if (v->pending == 0) vm_destroy(v);
+
+	} else if (status != 0)
+		log_fatalx("vm_started: vmctl start exited with status %d", status);
+}
+
+/* shut down the underlying vm if it ever got started,
+ * and get rid of its disks once it's gone
+ */
+static void
+vm_destroy(struct vm *v)
+{
+	if (v->started) VMCTL(v, vm_stopped, "stop", "-fw", v->name);
+	else vm_cleanup(v);
+}
+
+static void
+vm_stopped(int status, void *arg)
+{
+	struct vm	*v = arg;
+
+	/* the vm may well have powered itself off already */
+	if (status != 0)
+		log_writex(LOGTYPE_DEBUG, "vm_stopped: vmctl stop %s exited with status %d",
+			v->name, status);
+
+	v->pending--;
+	vm_cleanup(v);
+}
+
+static void
+vm_cleanup(struct vm *v)
+{
+	if (unlink(v->basedisk) < 0)
+		log_fatal("vm_cleanup: unlink vm base image");
+	else if (unlink(v->vivadodisk) < 0)
+		log_fatal("vm_cleanup: unlink vm vivado image");
+
+	free(v->basedisk);
+	free(v->vivadodisk);
+	free(v->name);
+
+	v->gone = 1;
+	if (v->retired) vm_free(v);
+}
+
 /* move to the zombie state, clean up connection,
  * and shut down the underlying VM
  * be careful! this code is used by lots of different callers
@@ -180,95 +405,156 @@ vm_reporterror(struct vm *v, const char *fmt, ...)
 static void
 vm_reap(struct vm *v, int graceful)
 {
+	int	wasworking;
+
 	if (v->state == VM_ZOMBIESTATE)
 		log_fatalx("vm_reap: tried to reap vm twice");
 
 	if (v->state == VM_BOOTSTATE)
-		bootqueue_popfirst();
+		bootqueue_remove(v);
+	else if (v->state == VM_READYSTATE)
+		TAILQ_REMOVE(&readyqueue, v, entries);
 
 	if (v->conn != NULL) {
+		slotmap_remove(vmsbyconn, conn_gethandle(v->conn));
+
 		conn_setteardowncb(v->conn, NULL);		
 		conn_teardown(v->conn);
 		v->conn = NULL;
 	}
 
-	VMCTL(v->state == VM_BOOTSTATE, "stop", "-fw", v->name);
+	wasworking = (v->state == VM_WORKSTATE);
+	vm_setstate(v, VM_ZOMBIESTATE);
 
-	if (unlink(v->basedisk) < 0)
-		log_fatal("vm_reap: unlink vm base image");
-	else if (unlink(v->vivadodisk) < 0)
-		log_fatal("vm_reap: unlink vm vivado image");
-
-	free(v->basedisk);
-	free(v->vivadodisk);
-	free(v->name);
+	/* if vmctl is still creating or starting us, its
+	 * completion sees the zombie state and carries on from here
+	 */
+	if (v->pending == 0) vm_destroy(v);
 
 	/* if we're in the work state, we have to wait
-	 * to be released by our caller. otherwise, we can
-	 * recycle ourself
+	 * to be released by our caller. otherwise, nobody
+	 * is using us and we can retire ourself. either way
+	 * v may be gone after this, so top up the pool first
 	 */
-	if (v->state != VM_WORKSTATE) {
-		v->state = VM_ZOMBIESTATE;
-		log_writex(LOGTYPE_DEBUG, "resetting zombie vm");
-		vm_reset(v);
-	} else {
-		v->state = VM_ZOMBIESTATE;
+	vm_replenish();
 
+	if (!wasworking) {
+		log_writex(LOGTYPE_DEBUG, "retiring zombie vm");
+		vm_retire(v);
+	} else {
 		log_writex(LOGTYPE_DEBUG, "calling back work state vm reap, graceful = %d", graceful);
 		if (graceful) v->callbacks.signaldone(v->key);
 		else v->callbacks.reporterror(v->key, "connection to vm terminated unexpectedly");
 	}
 }
 
+/* nobody can get at v anymore. it's freed for good once
+ * vmctl is done tearing it down, which may be right now
+ */
+static void
+vm_retire(struct vm *v)
+{
+	log_writex(LOGTYPE_DEBUG, "retiring vm");
+
+	if (v->state != VM_ZOMBIESTATE)
+		log_fatalx("vm_retire: bug: tried to retire vm in non-zombie state");
+
+	slotmap_remove(vmsbykey, v->key);
+	v->key = VM_NOKEY;
+
+	memset(&v->callbacks, 0, sizeof(struct vm_interface));
+	vm_clearaux(v);
+
+	v->retired = 1;
+	if (v->gone) vm_free(v);
+}
 
 static void
-vm_reset(struct vm *v)
+vm_free(struct vm *v)
 {
-	int	vmid;
+	slotmap_remove(allvms, v->id);
+	statecount[v->state]--;
 
-	log_writex(LOGTYPE_DEBUG, "resetting vm");
-	vmid = allvms_getvmindex(v);
+	window_teardown(v->window);
+	free(v);
+	vm_replenish();
+}
 
-	if (!v->initialized) {
-		v->initialized = 1;
-		v->conn = NULL;
+static struct vm *
+vm_byconn(struct conn *c)
+{
+	struct vm	*v;
 
-	} else if (v->state != VM_ZOMBIESTATE)
-		log_fatalx("vm_reset: bug: tried to reset vm in non-zombie state");
+	v = slotmap_get(vmsbyconn, conn_gethandle(c));
+	if (v == NULL) log_fatalx("vm_byconn: no such conn %p", c);
 
-	v->state = VM_BOOTSTATE;
-	v->key = VM_NOKEY;
+	return v;
+}
 
-	v->shouldheartbeat = 0;
+/* note down a message on its way to the client */
+static void
+vm_trackout(struct vm *v, struct netmsg *m)
+{
+	window_track(v->window, m);
+	v->blocked = 1;
+}
 
-	memset(&v->callbacks, 0, sizeof(struct vm_interface));
+/* let the vm carry on if the client has caught up
+ * far enough for whatever it's waiting on
+ */
+static void
+vm_pump(struct vm *v)
+{
+	uint64_t	outstanding;
 
-	if (asprintf(&v->basedisk, "%s/base%d.qcow2", DISKS, vmid) < 0)
-		log_fatal("vm_init: asprintf base disk name");
+	if (v->conn == NULL) return;
+	outstanding = window_getsent(v->window) - window_getacked(v->window);
 
-	if (asprintf(&v->vivadodisk, "%s/vivado%d.qcow2", DISKS, vmid) < 0)
-		log_fatal("vm_init: asprintf vivado disk name");
+	if (v->terminating) {
+		if (outstanding > 0) return;
 
-	if (asprintf(&v->name, "vm%d", vmid) < 0)
-		log_fatal("vm_init: asprintf vm name");
+		v->terminating = 0;
+		vm_reap(v, 1);
+		return;
+	}
 
-	vm_clearaux(v);
+	if (!v->blocked || window_isfull(v->window)) return;
 
-	VMCTL(1, "create", "-b", VM_BASEIMAGE, v->basedisk);	
-	VMCTL(1, "create", "-b", VM_VIVADOIMAGE, v->vivadodisk);
+	v->blocked = 0;
+	vm_sendack(v);
+}
 
-	bootqueue_enqboot(v);
+static void
+vm_sendack(struct vm *v)
+{
+	struct netmsg	*response;
+
+	response = netmsg_new(NETOP_ACK);
+	if (response == NULL)
+		log_fatal("vm_sendack: netmsg_new");
+
+	log_writex(LOGTYPE_DEBUG, "vm_sendack: sending NETOP_ACK to key %u", v->key);
+
+	conn_send(v->conn, response);
+	conn_receive(v->conn, vm_getmsg);
 }
 
-static struct vm *
-vm_byconn(struct conn *c)
+/* everything we queued for the vm has been written out,
+ * so the client can have its upload window back
+ */
+static void
+vm_handledrain(struct conn *c)
 {
-	int i;
+	struct vm	*v;
+	uint64_t	 count;
 
-	for (i = 0; i < VM_MAXCOUNT; i++) 
-		if (allvms[i].conn == c) return &allvms[i];
+	v = vm_byconn(c);
+	if (v->partsout == 0) return;
 
-	log_fatalx("vm_byconn: no such conn %p", c);
+	count = v->partsout;
+	v->partsout = 0;
+
+	v->callbacks.partstaken(v->key, count);
 }
 
 /* VM connection blew up on us; ungraceful teardown */
@@ -278,29 +564,111 @@ vm_handleteardown(struct conn *c)
 	struct vm	*dead;
 	
 	dead = vm_byconn(c);
+	slotmap_remove(vmsbyconn, conn_gethandle(c));
 
 	dead->conn = NULL;
 	vm_reap(dead, 0);
 }
 
+/* guests are named after their id, so this is
+ * just a slot map lookup
+ */
+static struct vm *
+vm_byname(char *name)
+{
+	struct vm	*v;
+	const char	*errstr;
+	uint32_t	 id;
+
+	if (strncmp(name, VM_NAMEPREFIX, strlen(VM_NAMEPREFIX)) != 0)
+		return NULL;
+
+	id = strtonum(name + strlen(VM_NAMEPREFIX), 0, SLOTMAP_MAXHANDLE, &errstr);
+	if (errstr != NULL) return NULL;
+
+	if ((v = slotmap_get(allvms, id)) == NULL)
+		return NULL;
+	else if (v->state != VM_BOOTSTATE || !v->started || v->conn != NULL)
+		return NULL;
+
+	return v;
+}
+
+/* vms come up in whatever order they like, so a new
+ * connection isn't anybody's until it says who it is
+ */
 static void
 vm_accept(struct conn *c)
 {
-	struct vm	*new;
 	struct timeval	 tv;
 
 	log_writex(LOGTYPE_DEBUG, "accepted connection from new vm");
 
-	new = bootqueue_popfirst();	
-	new->state = VM_READYSTATE;
+	tv.tv_sec = VM_IDENTIFYTIMEOUT;
+	tv.tv_usec = 0;
+
+	conn_settimeout(c, &tv, vm_identifytimeout);
+	conn_setcompress(c, VM_COMPRESS);
+	conn_receive(c, vm_identify);
+}
+
+static void
+vm_identify(struct conn *c, struct netmsg *m)
+{
+	struct vm	*new;
+	struct timeval	 tv;
+	char		*name;
+
+	if (m == NULL || strlen(netmsg_error(m)) > 0 || netmsg_gettype(m) != NETOP_IDENTIFY) {
+		log_writex(LOGTYPE_WARN, "vm_identify: new vm connection did not identify itself");
+		conn_teardown(c);
+		return;
+	}
+
+	if ((name = netmsg_getlabel(m)) == NULL)
+		log_fatalx("vm_identify: netmsg_getlabel: %s", netmsg_error(m));
+
+	if ((new = vm_byname(name)) == NULL) {
+		log_writex(LOGTYPE_WARN, "vm_identify: connection claims to be %s, "
+			"which is not booting", name);
+		conn_teardown(c);
+		free(name);
+		return;
+	}
+
+	log_writex(LOGTYPE_DEBUG, "vm %s identified itself", name);
+	free(name);
+
+	bootqueue_remove(new);
+
+	vm_setstate(new, VM_READYSTATE);
 	new->conn = c;	
 
+	gettimeofday(&new->readysince, NULL);
+	TAILQ_INSERT_TAIL(&readyqueue, new, entries);
+
+	if (slotmap_insertat(vmsbyconn, conn_gethandle(c), new) < 0)
+		log_fatal("vm_identify: slotmap_insertat");
+
 	tv.tv_sec = VM_TIMEOUT;
 	tv.tv_usec = 0;
 
 	conn_settimeout(new->conn, &tv, vm_timeout);
 	conn_setteardowncb(new->conn, vm_handleteardown);
+	conn_setdraincb(new->conn, vm_handledrain);
 	conn_receive(new->conn, vm_getmsg);
+
+	if (readycb != NULL) readycb();
+
+	if (!evtimer_pending(&idletimer, NULL))
+		vm_idlereap(-1, 0, NULL);
+}
+
+static void
+vm_identifytimeout(struct conn *c)
+{
+	log_writex(LOGTYPE_WARN, "vm_identifytimeout: new vm connection never identified itself");
+	conn_teardown(c);
 }
 
 static void
@@ -332,8 +700,7 @@ static void
 vm_getmsg(struct conn *c, struct netmsg *m)
 {
 	struct vm	*v;
-	char		*label, *data;
-	size_t		 datasize;
+	char		*label;
 		
 	v = vm_byconn(c);
 	v->shouldheartbeat = 0;
@@ -359,7 +726,9 @@ vm_getmsg(struct conn *c, struct netmsg *m)
 		label = netmsg_getlabel(m);	
 
 		conn_stopreceiving(v->conn);
+		vm_trackout(v, m);
 		v->callbacks.print(v->key, label);			
+		vm_pump(v);
 
 		free(label);
 		break;
@@ -370,14 +739,32 @@ vm_getmsg(struct conn *c, struct netmsg *m)
 		break;
 
 	case NETOP_SENDFILE:
-		label = netmsg_getlabel(m);
-		data = netmsg_getdata(m, (uint64_t *)(&datasize));
+		conn_stopreceiving(v->conn);
+		vm_trackout(v, m);
 
+		v->callbacks.commitfile(v->key, m);
+		vm_pump(v);
+		break;
+
+	/* chunks hold real data, so they're limited by
+	 * VM_FILEDEPTH just like whole files are
+	 */
+	case NETOP_FILEBEGIN:
+	case NETOP_FILECHUNK:
+	case NETOP_FILEEND:
 		conn_stopreceiving(v->conn);
-		v->callbacks.commitfile(v->key, label, data, datasize);
+		vm_trackout(v, m);
 
-		free(data);
-		free(label);
+		v->callbacks.filepart(v->key, m);
+		vm_pump(v);
+		break;
+
+	case NETOP_STREAM:
+		conn_stopreceiving(v->conn);
+		vm_trackout(v, m);
+
+		v->callbacks.stream(v->key, m);
+		vm_pump(v);
 		break;
 
 	case NETOP_ERROR:
@@ -393,13 +780,16 @@ vm_getmsg(struct conn *c, struct netmsg *m)
 		/* will call signaldone as needed, move us
 		 * to zombie state for eventual release
 		 * connection stays up for now; this is a graceful
-		 * teardown
+		 * teardown. lines still on their way to the
+		 * client hold this up until they've been acked
 		 */
-		vm_reap(v, 1);
+		conn_stopreceiving(v->conn);
+		v->terminating = 1;
+		vm_pump(v);
 		break;
 
 	case NETOP_HEARTBEAT:
-		vm_injectack(v);
+		vm_sendack(v);
 		break;
 
 	/* don't expect to receive acks from the VM */
@@ -414,74 +804,109 @@ vm_getmsg(struct conn *c, struct netmsg *m)
 	}
 }
 
+static void
+vm_initdone(int status, void *arg)
+{
+	if (status != 0)
+		log_fatalx("vm_initdone: vmctl stop exited with status %d", status);
+
+	vm_replenish();
+
+	(void)arg;
+}
+
 void
 vm_init(void)
 {
-	int	i;
+	cmd_init();
 
-	VMCTL(1, "stop", "-fwa");
+	if ((allvms = slotmap_new()) == NULL)
+		log_fatal("vm_init: slotmap_new");
+	else if ((vmsbykey = slotmap_new()) == NULL)
+		log_fatal("vm_init: slotmap_new");
+	else if ((vmsbyconn = slotmap_new()) == NULL)
+		log_fatal("vm_init: slotmap_new");
 
+	evtimer_set(&idletimer, vm_idlereap, NULL);
 	conn_listen(vm_accept, VM_CONN_PORT, CONN_MODE_TCP);
-	for (i = 0; i < VM_MAXCOUNT; i++) vm_reset(&allvms[i]);
+
+	/* get rid of anything a previous run left behind
+	 * before bringing up our own machines
+	 */
+	if (cmd_run(vm_initdone, NULL, VMCTL_PATH, "stop", "-fwa", NULL) < 0)
+		log_fatal("vm_init: cmd_run");
 }
 
 void
 vm_killall(void)
 {
 	struct vm	*subject;
-	int		 i;
-
-	bootqueue_clear();
+	uint32_t	 cursor = 0;
 
-	/* - put all VMs that are initialized into the work state;
-	 *	they work for us now. this ensures they won't reset...
+	/* - stop anything from being created or booted
 	 * - annul the callback for signaldone
 	 * - reap each VM gracefully
+	 * - wait out vmctl, since nobody will run the
+	 *	event loop for us anymore
 	 * - you are now safe to exit
 	 */
-	for (i = 0; i < VM_MAXCOUNT; i++) {
-		subject = &allvms[i];
+	shuttingdown = 1;
+	evtimer_del(&idletimer);
 
-		if (subject->initialized && subject->state != VM_ZOMBIESTATE) {
-			subject->state = VM_WORKSTATE;
+	while ((subject = slotmap_iterate(allvms, &cursor, NULL)) != NULL) {
+		if (subject->state != VM_ZOMBIESTATE) {
 			subject->callbacks.signaldone = signaldone_annuled;
 			vm_reap(subject, 1);
 		}
 	}
+
+	cmd_drain();
 }
 
+/* hand out the most recently readied vm, and boot
+ * a replacement if there's room for one. coming up
+ * empty means we're short, so grow the pool past
+ * VM_IDLETARGET; the idle timer shrinks it back later
+ */
 struct vm *
 vm_claim(uint32_t key, struct vm_interface vmi)
 {
 	struct vm	*subject;
-	int 		 i;
+	int		 coming;
 
-	for (i = 0; i < VM_MAXCOUNT; i++) {
-		subject = &allvms[i];
+	if ((subject = TAILQ_LAST(&readyqueue, vmqueue)) == NULL) {
+		coming = statecount[VM_CREATESTATE] + statecount[VM_BOOTSTATE];
 
-		if (subject->state == VM_READYSTATE) {
-			subject->state = VM_WORKSTATE;
-			subject->key = key;
-			subject->callbacks = vmi;
+		if (!shuttingdown && coming < VM_MAXBOOTS &&
+		    slotmap_count(allvms) < VM_MAXCOUNT)
+			vm_new();
 
-			return subject;
-		}
-	}	
+		errno = EAGAIN;
+		return NULL;
+	}
+
+	if (slotmap_insertat(vmsbykey, key, subject) < 0)
+		return NULL;
+
+	TAILQ_REMOVE(&readyqueue, subject, entries);
+	vm_setstate(subject, VM_WORKSTATE);
+
+	subject->key = key;
+	subject->callbacks = vmi;
 
-	errno = EAGAIN;
-	return NULL;
+	vm_replenish();
+	return subject;
 }
 
 struct vm *
 vm_fromkey(uint32_t key)
 {
-	int i;
+	struct vm	*v;
 
-	for (i = 0; i < VM_MAXCOUNT; i++)
-		if (allvms[i].key == key) return &allvms[i];
+	v = slotmap_get(vmsbykey, key);
+	if (v == NULL) errno = EINVAL;
 
-	errno = EINVAL;
-	return NULL;
+	return v;
 }
 
 static void
@@ -502,28 +927,55 @@ vm_release(struct vm *v)
 		vm_reap(v, 1);
 	}
 
-	vm_reset(v);
+	vm_retire(v);
+}
+
+void
+vm_setreadycb(void (*cb)(void))
+{
+	readycb = cb;
 }
 
 void
 vm_injectfile(struct vm *v, char *label, char *data, size_t datasize)
 {
 	struct netmsg	*response;
+	struct iovec	 iov;
+
+	iov.iov_base = data;
+	iov.iov_len = datasize;
 
-	response = netmsg_new(NETOP_SENDFILE);
+	response = netmsg_build(NETOP_SENDFILE, label, &iov, 1);
 	if (response == NULL)
-		log_fatal("vm_injectfile: netmsg_new");
+		log_fatal("vm_injectfile: netmsg_build");
 
-	if (netmsg_setlabel(response, label) < 0)
-		log_fatalx("vm_injectfile: netmsg_setlabel: %s", netmsg_error(response));
+	vm_injectmsg(v, response);
+}
 
-	if (netmsg_setdata(response, data, datasize) < 0)
-		log_fatalx("vm_injectfile: netmsg_setdata: %s", netmsg_error(response));
+/* the vm speaks the same wire format as the client, so a
+ * message that came in from the frontend can be queued onto
+ * the vm's connection as is. the conn layer owns m after this
+ */
+void
+vm_injectmsg(struct vm *v, struct netmsg *m)
+{
+	/* the vm may have finished while this was on its way */
+	if (v->conn == NULL) {
+		netmsg_teardown(m);
+		return;
+	}
 
-	log_writex(LOGTYPE_DEBUG, "vm_injectfile: sending NETOP_SENDFILE to key %u", v->key);
+	log_writex(LOGTYPE_DEBUG, "vm_injectmsg: sending opcode %u to key %u",
+		netmsg_gettype(m), v->key);
 
-	conn_send(v->conn, response);
-	conn_receive(v->conn, vm_getmsg);
+	if (netmsg_gettype(m) == NETOP_FILECHUNK)
+		v->partsout++;
+
+	conn_send(v->conn, m);
+
+	/* don't let a vm waiting on the client run off */
+	if (!v->blocked && !v->terminating)
+		conn_receive(v->conn, vm_getmsg);
 }
 
 void
@@ -531,12 +983,9 @@ vm_injectline(struct vm *v, char *line)
 {
 	struct netmsg	*response;
 
-	response = netmsg_new(NETOP_SENDLINE);
+	response = netmsg_build(NETOP_SENDLINE, line, NULL, 0);
 	if (response == NULL)
-		log_fatal("vm_injectline: netmsg_new");
-
-	if (netmsg_setlabel(response, line) < 0)
-		log_fatalx("vm_injectfile: netmsg_setlabel: %s", netmsg_error(response));
+		log_fatal("vm_injectline: netmsg_build");
 
 	log_writex(LOGTYPE_DEBUG, "vm_injectline: sending NETOP_SENDLINE to key %u", v->key);
 
@@ -544,19 +993,31 @@ vm_injectline(struct vm *v, char *line)
 	conn_receive(v->conn, vm_getmsg);
 }
 
+/* the client acknowledged the oldest message it
+ * hadn't yet, i.e. a plain NETOP_ACK
+ */
 void
 vm_injectack(struct vm *v)
 {
-	struct netmsg	*response;
+	uint64_t	acked;
 
-	response = netmsg_new(NETOP_ACK);
-	if (response == NULL)
-		log_fatal("vm_injectack: netmsg_new");
+	if ((acked = window_getacked(v->window)) == window_getsent(v->window)) {
+		log_writex(LOGTYPE_DEBUG, "vm_injectack: nothing outstanding for key %u", v->key);
+		return;
+	}
+
+	vm_injectacks(v, acked + 1);
+}
 
-	log_writex(LOGTYPE_DEBUG, "vm_injectack: sending NETOP_ACK to key %u", v->key);
+/* the client has now seen total messages in all */
+int
+vm_injectacks(struct vm *v, uint64_t total)
+{
+	if (window_ack(v->window, total) < 0)
+		return -1;
 
-	conn_send(v->conn, response);
-	conn_receive(v->conn, vm_getmsg);
+	vm_pump(v);
+	return 0;
 }
 
 void
@@ -0,0 +1,128 @@
+/* workerd output window
+ * keeps count of what's gone out to a client that it
+ * hasn't acknowledged yet, so whoever is producing it -
+ * a vm, or a job memo playing one back - can hold off
+ * once the client falls too far behind. lines count for
+ * their length and streams for their data, while every
+ * file (or chunk of one) counts against VM_FILEDEPTH
+ *
+ * (c) jay lang 2023
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "workerd.h"
+
+/* something sent that the client has yet to ack */
+struct outbound {
+	size_t		 size;
+	int		 isfile;
+};
+
+/* oldest first, indexed by how many went before */
+struct window {
+	uint64_t	 sent;
+	uint64_t	 acked;
+	size_t		 inflight;
+	int		 files;
+	struct outbound	 outbound[VM_LINEWINDOW];
+};
+
+struct window *
+window_new(void)
+{
+	return calloc(1, sizeof(struct window));
+}
+
+void
+window_teardown(struct window *w)
+{
+	free(w);
+}
+
+/* note down m on its way to the client. callers check
+ * window_isfull first, so the ring never wraps onto
+ * anything still outstanding
+ */
+void
+window_track(struct window *w, struct netmsg *m)
+{
+	struct outbound	*o;
+	char		*label;
+
+	o = &w->outbound[++w->sent % VM_LINEWINDOW];
+	o->size = 0;
+	o->isfile = 0;
+
+	switch (netmsg_gettype(m)) {
+	case NETOP_SENDLINE:
+		if ((label = netmsg_getlabel(m)) == NULL)
+			log_fatalx("window_track: netmsg_getlabel: %s", netmsg_error(m));
+
+		o->size = strlen(label);
+		free(label);
+		break;
+
+	case NETOP_SENDFILE:
+	case NETOP_FILECHUNK:
+		o->isfile = 1;
+		break;
+
+	case NETOP_STREAM:
+		o->size = netmsg_getdatasize(m);
+		break;
+	}
+
+	w->inflight += o->size;
+	w->files += o->isfile;
+}
+
+/* the client has now seen total messages in all. each
+ * file is done with as soon as its own ack comes in,
+ * whatever is still behind it
+ */
+int
+window_ack(struct window *w, uint64_t total)
+{
+	struct outbound	*o;
+
+	if (total < w->acked || total > w->sent) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (w->acked < total) {
+		o = &w->outbound[++w->acked % VM_LINEWINDOW];
+
+		w->inflight -= o->size;
+		w->files -= o->isfile;
+	}
+
+	return 0;
+}
+
+int
+window_isfull(struct window *w)
+{
+	if (w->sent - w->acked >= VM_LINEWINDOW) return 1;
+	else if (w->inflight >= VM_BYTEWINDOW) return 1;
+
+	return w->files >= VM_FILEDEPTH;
+}
+
+uint64_t
+window_getsent(struct window *w)
+{
+	return w->sent;
+}
+
+uint64_t
+window_getacked(struct window *w)
+{
+	return w->acked;
+}
@@ -96,8 +96,10 @@ main(int argc, char *argv[])
 
 	empty_directory(DISKS);
 	empty_directory(FRONTEND_MESSAGES);
+	empty_directory(FRONTEND_CACHE);
+	empty_directory(FRONTEND_CHUNKS);
 	empty_directory(ENGINE_MESSAGES);
-	empty_directory(WRITEBACK);
+	empty_directory(ENGINE_MEMO);
 
 	parent = proc_new(PROC_PARENT);
 	if (parent == NULL) err(1, "proc_new -> parent process");
@@ -16,8 +16,10 @@
 #define ENGINE_MESSAGES		CHROOT "/emessages"
 #define MESSAGES		((myproc() == PROC_ENGINE) ? ENGINE_MESSAGES : FRONTEND_MESSAGES)
 
-#define WRITEBACK		CHROOT "/writeback"
 #define DISKS			CHROOT "/disks"
+#define FRONTEND_CACHE		CHROOT "/fcache"
+#define FRONTEND_CHUNKS		CHROOT "/fchunks"
+#define ENGINE_MEMO		CHROOT "/ememo"
 
 #define MAXNAMESIZE		1024
 #define MAXFILESIZE		10485760
@@ -28,6 +30,7 @@
 extern char *__progname;
 extern int debug, verbose;
 
+struct iovec;
 struct sockaddr_in;
 struct timeval;
 
@@ -52,7 +55,44 @@ int              buffer_close(int);
 int              buffer_truncate(int, off_t);
 ssize_t          buffer_read(int, void *, size_t);
 ssize_t          buffer_write(int, const void *, size_t);
+ssize_t          buffer_writev(int, const struct iovec *, int);
 off_t            buffer_seek(int, off_t, int);
+int              buffer_getiov(int, off_t, struct iovec *, int);
+
+
+/* slotmap.c */
+
+/* handles are 31 bits so they fit in an int: the low bits
+ * pick a slot, the rest count how often it was reused
+ */
+#define SLOTMAP_INDEXBITS	20
+#define SLOTMAP_GENERATIONBITS	11
+
+#define SLOTMAP_MAXSLOTS	(1U << SLOTMAP_INDEXBITS)
+#define SLOTMAP_INDEXMASK	(SLOTMAP_MAXSLOTS - 1)
+#define SLOTMAP_GENERATIONMASK	((1U << SLOTMAP_GENERATIONBITS) - 1)
+#define SLOTMAP_MAXHANDLE	((1U << (SLOTMAP_INDEXBITS + SLOTMAP_GENERATIONBITS)) - 1)
+
+struct slotmap;
+
+struct slotmap	*slotmap_new(void);
+void		 slotmap_teardown(struct slotmap *);
+
+int		 slotmap_insert(struct slotmap *, void *, uint32_t *);
+int		 slotmap_insertat(struct slotmap *, uint32_t, void *);
+void		*slotmap_get(struct slotmap *, uint32_t);
+void		*slotmap_remove(struct slotmap *, uint32_t);
+
+uint32_t	 slotmap_count(struct slotmap *);
+void		*slotmap_iterate(struct slotmap *, uint32_t *, uint32_t *);
+
+
+/* cmd.c */
+
+void		 cmd_init(void);
+int		 cmd_run(void (*)(int, void *), void *, const char *, ...);
+int		 cmd_pending(void);
+void		 cmd_drain(void);
 
 
 /* netmsg.c */
@@ -76,9 +116,10 @@ struct netmsg;
 
 /* if sent from vm, will make it all
  * the way to the remote host; engine
- * will block on ACK from frontend; disk
- * message -> have to retain and store a
- * handle to it until frontend gets back
+ * holds the vm back once VM_FILEDEPTH of
+ * these await an ACK from frontend; disk
+ * message -> crosses between processes
+ * as a descriptor, so nobody retains it
  */
 #define NETOP_SENDFILE		3
 
@@ -102,11 +143,101 @@ struct netmsg;
  */
 #define NETOP_HEARTBEAT		7
 
-#define NETOP_MAX       	8
+/* first thing a vm sends once it's up. the label
+ * is the guest's hostname, which vmd hands out over
+ * dhcp as the name we started it under
+ */
+#define NETOP_IDENTIFY		8
+
+/* sent to a client whose job is waiting for a
+ * vm, every so often and whenever its place changes.
+ * the label is its position in line, counting from 1
+ */
+#define NETOP_QUEUEPOSITION	9
+
+/* cumulative ack from the client. the label is how
+ * many lines, files and stream chunks it has received
+ * from its job so far. a plain NETOP_ACK still works,
+ * acknowledging the oldest of those not yet acked
+ */
+#define NETOP_ACKUPTO		10
+
+/* several lines in one frame, for clients that ack
+ * with NETOP_ACKUPTO. the label is how many lines there
+ * are, and the data is the lines, each followed by a
+ * newline - i.e. exactly what printing them one at a
+ * time would have produced
+ */
+#define NETOP_SENDLINES		11
+
+/* bulk output from the vm, passed along to the client
+ * as is. the label names the stream (i.e. stdout) and
+ * the data is the next chunk of it. a disk message like
+ * sendfile, so it isn't held to label or imsg sizes
+ */
+#define NETOP_STREAM		12
+
+/* a file too big for one sendfile, in either direction.
+ * begin's label is the file name, each chunk's label is
+ * its offset into the file with the bytes as data, and
+ * end's label is the final size. chunks are disk messages,
+ * and a client gets FRONTEND_UPLOADWINDOW of them ahead of
+ * the vm before we stop reading from it, so no hop holds
+ * more than a few at once
+ */
+#define NETOP_FILEBEGIN		13
+#define NETOP_FILECHUNK		14
+#define NETOP_FILEEND		15
+
+/* lets a client skip uploading a bundle the frontend
+ * already has. the client sends the sha256 of the sendfile
+ * message it would have sent, uncompressed and in lowercase
+ * hex, as the label. the frontend answers with the label
+ * "hit", in which case the job is under way, or "miss", in
+ * which case the client goes ahead with the sendfile. only
+ * bundles announced this way are kept for next time
+ */
+#define NETOP_ANNOUNCE		16
+
+/* the other way to skip (most of) an upload. the client
+ * cuts its sendfile message into chunks and sends their list:
+ * the label is the message's total size and each line of data
+ * is a chunk's sha256 in lowercase hex, a space and its size.
+ * the frontend answers with the same opcode, labelled with
+ * how many chunks it lacks and listing their indices (from 0)
+ * a line apiece. the client sends each of those as a
+ * NETOP_CHUNK labelled with its index, and the job starts
+ * once the last one is in
+ *
+ * cuts are made with a gear hash: starting from zero at each
+ * chunk, h = (h << 1) + gear[byte] for every byte, cutting
+ * after the first byte at which the chunk has CHUNK_MINSIZE
+ * bytes and h & CHUNK_MASK is zero, or at CHUNK_MAXSIZE.
+ * gear[i] is the ith output of splitmix64 seeded with zero
+ */
+#define NETOP_MANIFEST		17
+#define NETOP_CHUNK		18
+
+/* sent ahead of a bundle whose job always does the same
+ * thing. the engine keeps a transcript of the job's first
+ * clean run and plays it back to later submissions of the
+ * same bundle, without starting a vm
+ */
+#define NETOP_MEMOIZE		19
+
+#define NETOP_MAX       	20
+
+/* set in the opcode byte when a message's data has been
+ * deflated. a peer that sends one of these can take them
+ * too. payloads under NETMSG_COMPRESSMIN go out as is
+ */
+#define NETOP_COMPRESSED	0x80
+#define NETMSG_COMPRESSMIN	1024
 
 
 struct netmsg   *netmsg_new(uint8_t);
-struct netmsg   *netmsg_loadweakly(char *);
+struct netmsg   *netmsg_build(uint8_t, char *, struct iovec *, int);
+struct netmsg   *netmsg_loadweakly(int);
 
 void             netmsg_retain(struct netmsg *);
 void             netmsg_teardown(struct netmsg *);
@@ -118,17 +249,66 @@ ssize_t          netmsg_write(struct netmsg *, void *, size_t);
 ssize_t          netmsg_read(struct netmsg *, void *, size_t);
 ssize_t          netmsg_seek(struct netmsg *, ssize_t, int);
 int              netmsg_truncate(struct netmsg *, ssize_t);
+int              netmsg_getiov(struct netmsg *, size_t, struct iovec *, int);
 
 uint8_t          netmsg_gettype(struct netmsg *);
-char            *netmsg_getpath(struct netmsg *);
+int              netmsg_iscompressed(struct netmsg *);
+struct netmsg   *netmsg_compress(struct netmsg *);
+struct netmsg   *netmsg_decompress(struct netmsg *);
+int              netmsg_getfd(struct netmsg *);
+const char      *netmsg_getpath(struct netmsg *);
 
 char            *netmsg_getlabel(struct netmsg *);
-int              netmsg_setlabel(struct netmsg *, char *);
-
 char            *netmsg_getdata(struct netmsg *, uint64_t *);
-int              netmsg_setdata(struct netmsg *, char *, uint64_t);
+uint64_t         netmsg_getdatasize(struct netmsg *);
 
 int              netmsg_isvalid(struct netmsg *, int *);
+uint64_t         netmsg_getmissing(struct netmsg *);
+
+
+/* store.c */
+
+struct store;
+
+struct store	*store_new(const char *, uint32_t, off_t);
+char		*store_path(struct store *, const char *);
+
+int		 store_open(struct store *, const char *, off_t);
+int		 store_touch(struct store *, const char *);
+void		 store_add(struct store *, const char *, off_t);
+void		 store_remove(struct store *, const char *);
+
+void		 store_report(struct store *, const char *, const char *);
+
+
+/* cache.c */
+
+/* the frontend keeps up to CACHE_MAXENTRIES recently
+ * uploaded bundles, taking up at most CACHE_MAXBYTES, and
+ * logs how well that's going every CACHE_REPORTINTERVAL
+ * seconds
+ */
+#define CACHE_MAXENTRIES	128
+#define CACHE_MAXBYTES		(256 * 1024 * 1024)
+#define CACHE_REPORTINTERVAL	300
+
+/* chunks average around 8k, i.e. one cut in every
+ * CHUNK_MASK + 1 bytes past the minimum
+ */
+#define CHUNK_MINSIZE		2048
+#define CHUNK_MAXSIZE		65536
+#define CHUNK_MASK		((1 << 13) - 1)
+
+#define CACHE_MAXCHUNKS		65536
+#define CACHE_MAXCHUNKBYTES	(256 * 1024 * 1024)
+
+void		 cache_init(void);
+int		 cache_lookup(const char *);
+int		 cache_insert(struct netmsg *, char *);
+
+size_t		 cache_chunklen(const uint8_t *, size_t);
+int		 cache_readchunk(const char *, void *, size_t);
+int		 cache_putchunk(const char *, const void *, size_t);
 
 
 /* conn.c */
@@ -139,13 +319,26 @@ int              netmsg_isvalid(struct netmsg *, int *);
 
 #define FRONTEND_CONN_PORT	443
 #define FRONTEND_TIMEOUT	1
+#define FRONTEND_UPLOADWINDOW	4
 #define VM_CONN_PORT		8123
 #define VM_TIMEOUT		1
 
+/* whether to compress for peers that can take it,
+ * separately for clients and for vms
+ */
+#define FRONTEND_COMPRESS	1
+#define VM_COMPRESS		1
+
 #define CONN_CA_PATH    "/etc/ssl/cert.pem"
 #define CONN_CERT       "/etc/ssl/server.pem"
 #define CONN_KEY        "/etc/ssl/private/server.key"
 
+/* clients are ours, so we can insist on ecdhe
+ * and the cheaper curves first
+ */
+#define CONN_CIPHERS	"secure"
+#define CONN_CURVES	"X25519,P-256,P-384"
+
 struct conn;
 
 void                     conn_listen(void (*)(struct conn *), uint16_t, int);
@@ -156,13 +349,16 @@ void                     conn_receive(struct conn *, void (*)(struct conn *, str
 void                     conn_stopreceiving(struct conn *);
 
 void                     conn_setteardowncb(struct conn *, void (*)(struct conn *));
+void                     conn_setdraincb(struct conn *, void (*)(struct conn *));
 
 void                     conn_settimeout(struct conn *, struct timeval *, void (*)(struct conn *));
 void                     conn_canceltimeout(struct conn *);
 
 void                     conn_send(struct conn *, struct netmsg *);
+void                     conn_setcompress(struct conn *, int);
 
 int                      conn_getfd(struct conn *);
+uint32_t                 conn_gethandle(struct conn *);
 struct sockaddr_in      *conn_getsockpeer(struct conn *);
 
 
@@ -177,16 +373,41 @@ void             msgqueue_append(struct msgqueue *, struct netmsg *);
 void             msgqueue_deletehead(struct msgqueue *);
 
 struct netmsg   *msgqueue_gethead(struct msgqueue *);
+int              msgqueue_getheads(struct msgqueue *, struct netmsg **, int);
 size_t           msgqueue_getcachedoffset(struct msgqueue *);
 int              msgqueue_setcachedoffset(struct msgqueue *, size_t);
 
 
 /* vm.c */
 
-/* should be small - constrained by core count */
-#define VM_MAXCOUNT	4
+/* the pool never shrinks below VM_MINCOUNT vms, and
+ * boots more while fewer than VM_IDLETARGET are ready or
+ * on their way. ready vms beyond that get reaped after
+ * VM_IDLECOOLDOWN seconds. VM_MAXCOUNT should be small -
+ * constrained by core count
+ */
+#define VM_MINCOUNT		1
+#define VM_MAXCOUNT		4
+#define VM_IDLETARGET		2
+#define VM_IDLECOOLDOWN		60
+
+/* how many vms may be booting at once, and how long
+ * a fresh connection gets to say which vm it is
+ */
+#define VM_MAXBOOTS		VM_MAXCOUNT
+#define VM_IDENTIFYTIMEOUT	10
+
+/* how much output a vm (or a memo playing one back)
+ * may have on its way to the client before it has to
+ * wait for acknowledgements. VM_FILEDEPTH files at most,
+ * which must fit in the window
+ */
+#define VM_LINEWINDOW		32
+#define VM_BYTEWINDOW		(32 * 1024)
+#define VM_FILEDEPTH		8
 
 #define VM_TEMPLATENAME	"template"
+#define VM_NAMEPREFIX	"vm"
 
 #define VM_BASEIMAGE	"/home/" USER "/base.qcow2"
 #define VM_VIVADOIMAGE	"/home/" USER "/vivado.qcow2"
@@ -197,7 +418,10 @@ struct vm;
 struct vm_interface {
 	void	(*print)(uint32_t, char *);
 	void	(*readline)(uint32_t);
-	void	(*commitfile)(uint32_t, char *, char *, size_t);
+	void	(*commitfile)(uint32_t, struct netmsg *);
+	void	(*stream)(uint32_t, struct netmsg *);
+	void	(*filepart)(uint32_t, struct netmsg *);
+	void	(*partstaken)(uint32_t, uint64_t);
 
 	void	(*signaldone)(uint32_t);
 	void	(*reporterror)(uint32_t, char *);
@@ -209,14 +433,59 @@ void		 vm_killall(void);
 struct vm	*vm_claim(uint32_t, struct vm_interface);
 struct vm	*vm_fromkey(uint32_t);
 void		 vm_release(struct vm *);
+void		 vm_setreadycb(void (*)(void));
 
 void		 vm_injectfile(struct vm *, char *, char *, size_t);
+void		 vm_injectmsg(struct vm *, struct netmsg *);
 void		 vm_injectline(struct vm *, char *);
 void		 vm_injectack(struct vm *);
+int		 vm_injectacks(struct vm *, uint64_t);
 
 void		 vm_setaux(struct vm *, void *);
 void		*vm_clearaux(struct vm *);
 
+
+/* window.c */
+
+struct window;
+
+struct window	*window_new(void);
+void		 window_teardown(struct window *);
+
+void		 window_track(struct window *, struct netmsg *);
+int		 window_ack(struct window *, uint64_t);
+int		 window_isfull(struct window *);
+
+uint64_t	 window_getsent(struct window *);
+uint64_t	 window_getacked(struct window *);
+
+
+/* memo.c */
+
+/* at most MEMO_MAXENTRIES transcripts of up to MEMO_MAXSIZE
+ * bytes each, MEMO_MAXBYTES in all, with hit rates logged
+ * every MEMO_REPORTINTERVAL seconds
+ */
+#define MEMO_MAXENTRIES		256
+#define MEMO_MAXSIZE		(16 * 1024 * 1024)
+#define MEMO_MAXBYTES		(512 * 1024 * 1024)
+#define MEMO_REPORTINTERVAL	300
+
+void		 memo_init(void);
+int		 memo_lookup(const char *);
+
+void		 memo_replay(uint32_t, int, struct vm_interface);
+int		 memo_isreplaying(uint32_t);
+void		 memo_injectack(uint32_t);
+int		 memo_injectacks(uint32_t, uint64_t);
+void		 memo_cancel(uint32_t);
+
+void		 memo_record(uint32_t, const char *);
+void		 memo_recordline(uint32_t, char *);
+void		 memo_recordmsg(uint32_t, struct netmsg *);
+void		 memo_abandon(uint32_t);
+void		 memo_commit(uint32_t);
+
 /* ipcmsg.c */
 
 struct ipcmsg;
@@ -257,8 +526,16 @@ struct ipcmsg	*ipcmsg_unmarshal(char *, uint16_t);
 #define IMSG_REQUESTTERM	8
 #define IMSG_TERMINATE		9
 #define IMSG_ERROR		10
+#define IMSG_QUEUEPOSITION	11
+#define IMSG_SENDLINES		12
+#define IMSG_STREAM		13
 
-#define IMSG_MAX                11
+#define IMSG_FILEBEGIN		14
+#define IMSG_FILECHUNK		15
+#define IMSG_FILEEND		16
+#define IMSG_PARTSTAKEN		17
+
+#define IMSG_MAX                18
 
 struct proc;
 
@@ -279,6 +556,24 @@ int		 myproc_ischrooted(void);
 void		 frontend_launch(void);
 __dead void	 frontend_signal(int, short, void *);
 
+/* how many jobs may wait for a vm, and how often
+ * they hear about their place in line
+ */
+#define ENGINE_MAXQUEUE		64
+#define ENGINE_QUEUEINTERVAL	5
+
+/* file chunks a queued job may hold onto before its
+ * upload gets turned away
+ */
+#define ENGINE_MAXPARTBYTES	(32 * 1024 * 1024)
+
+/* lines a vm prints within ENGINE_LINEFLUSH usec of
+ * each other go to the frontend together, up to
+ * ENGINE_LINEBATCH bytes - well under the imsg limit
+ */
+#define ENGINE_LINEFLUSH	5000
+#define ENGINE_LINEBATCH	8192
+
 void		 engine_launch(void);
 __dead void	 engine_signal(int, short, void *);
 
@@ -292,10 +587,4 @@ nothing(int a, int b, struct ipcmsg *c)
 	(void)c;
 }
 
-/* wbfile.c */
-
-char	*wbfile_writeback(char *, char *, size_t);
-void	 wbfile_readout(char *, char **, char **, size_t *);
-void	 wbfile_teardown(char *);
-
 #endif /* WORKERD_H */
@@ -0,0 +1,119 @@
+/* buffer semantics across segment boundaries, plus
+ * the cost of building a maximum size file piecemeal
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "workerd.h"
+
+#define TEST_CHUNK	1000
+#define TEST_IOVCNT	8
+
+int	debug = 1, verbose = 1;
+
+int myproc() { return PROC_FRONTEND; }
+
+static void
+checkread(int b, off_t at, char *expect, size_t count)
+{
+	char	*got;
+
+	if ((got = malloc(count)) == NULL)
+		err(1, "malloc");
+
+	if (buffer_seek(b, at, SEEK_SET) != at)
+		err(1, "buffer_seek");
+	else if (buffer_read(b, got, count) != (ssize_t)count)
+		errx(1, "short read at %lld", (long long)at);
+	else if (memcmp(got, expect, count) != 0)
+		errx(1, "read back wrong bytes at %lld", (long long)at);
+
+	free(got);
+}
+
+int
+main()
+{
+	struct iovec	 iov[TEST_IOVCNT];
+	struct timeval	 start, now, diff;
+
+	char		*expect, chunk[TEST_CHUNK];
+	size_t		 i, total, covered;
+	int		 b, n;
+
+	if ((expect = calloc(1, MAXFILESIZE)) == NULL)
+		err(1, "calloc");
+	else if ((b = buffer_open()) < 0)
+		err(1, "buffer_open");
+
+	/* append a maximum size file a little at a time */
+	gettimeofday(&start, NULL);
+
+	for (total = 0; total + TEST_CHUNK <= MAXFILESIZE; total += TEST_CHUNK) {
+		for (i = 0; i < TEST_CHUNK; i++)
+			chunk[i] = expect[total + i] = (char)(total + i * 31);
+
+		if (buffer_write(b, chunk, TEST_CHUNK) != TEST_CHUNK)
+			err(1, "buffer_write");
+	}
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &start, &diff);
+
+	warnx("appended %zu bytes in %d byte writes in %lld.%06ld s", total, TEST_CHUNK,
+		(long long)diff.tv_sec, (long)diff.tv_usec);
+
+	checkread(b, 0, expect, total);
+	checkread(b, 4090, expect + 4090, 20);
+
+	/* segments come back in order, and only as many as asked for */
+	n = buffer_getiov(b, 10, iov, TEST_IOVCNT);
+	if (n != TEST_IOVCNT)
+		errx(1, "buffer_getiov filled %d entries, wanted %d", n, TEST_IOVCNT);
+
+	for (covered = 10, i = 0; i < (size_t)n; covered += iov[i++].iov_len)
+		if (memcmp(iov[i].iov_base, expect + covered, iov[i].iov_len) != 0)
+			errx(1, "iov %zu points at the wrong bytes", i);
+
+	if (buffer_getiov(b, total, iov, TEST_IOVCNT) != 0)
+		errx(1, "buffer_getiov past eof returned data");
+
+	/* shrinking, then growing again, reads back as zeroes */
+	if (buffer_truncate(b, 5000) < 0)
+		err(1, "buffer_truncate down");
+	else if (buffer_truncate(b, 9000) < 0)
+		err(1, "buffer_truncate up");
+
+	memset(expect + 5000, 0, 4000);
+	checkread(b, 0, expect, 9000);
+
+	/* so does a gap left by seeking past the end */
+	if (buffer_seek(b, 20000, SEEK_SET) != 20000)
+		err(1, "buffer_seek past eof");
+	else if (buffer_write(b, "x", 1) != 1)
+		err(1, "buffer_write past eof");
+
+	memset(expect + 9000, 0, 11000);
+	expect[20000] = 'x';
+	checkread(b, 0, expect, 20001);
+
+	if (buffer_seek(b, 0, SEEK_END) != 20001)
+		errx(1, "eof in the wrong place");
+
+	if (buffer_close(b) < 0)
+		err(1, "buffer_close");
+	else if (buffer_read(b, chunk, 1) >= 0)
+		errx(1, "read from closed buffer succeeded");
+
+	free(expect);
+	return 0;
+}
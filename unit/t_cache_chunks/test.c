@@ -0,0 +1,179 @@
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <err.h>
+#include <errno.h>
+#include <event.h>
+#include <sha2.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "workerd.h"
+
+#define TEST_LABEL	"bundle.tar"
+#define TEST_DATASIZE	(9 * 1024 * 1024)
+#define TEST_EDIT	"an edited line in the middle of one source file\n"
+
+int	debug = 1, verbose = 1;
+
+int myproc() { return PROC_FRONTEND; }
+
+/* the whole message as it would go over the wire */
+static uint8_t *
+flatten(struct netmsg *m, size_t *sizeout)
+{
+	uint8_t	*out;
+	off_t	 size;
+	int	 fd;
+
+	if ((fd = netmsg_getfd(m)) < 0)
+		errx(1, "netmsg_getfd: %s", netmsg_error(m));
+
+	if ((size = lseek(fd, 0, SEEK_END)) < 0)
+		err(1, "lseek");
+	else if ((out = malloc(size)) == NULL)
+		err(1, "malloc");
+	else if (pread(fd, out, size, 0) != size)
+		err(1, "pread");
+
+	close(fd);
+	*sizeout = size;
+	return out;
+}
+
+/* what a client's first upload against a manifest leaves
+ * behind: every chunk of the bundle, sent one at a time
+ */
+static void
+putchunks(uint8_t *wire, size_t size)
+{
+	char	hash[SHA256_DIGEST_STRING_LENGTH];
+	size_t	offset, len;
+
+	for (offset = 0; offset < size; offset += len) {
+		len = cache_chunklen(wire + offset, size - offset);
+		SHA256Data(wire + offset, len, hash);
+
+		if (cache_putchunk(hash, wire + offset, len) < 0)
+			err(1, "cache_putchunk");
+	}
+}
+
+int
+main()
+{
+	struct netmsg	*original, *edited = NULL;
+	struct iovec	 iov[3];
+	uint8_t		*data, *wire = NULL, *chunk;
+	char		 hash[SHA256_DIGEST_STRING_LENGTH];
+	size_t		 i, wiresize, offset, len, reused = 0;
+	uint32_t	 state = 1;
+	int		 status = -1;
+
+	event_init();
+	cache_init();
+
+	if ((data = malloc(TEST_DATASIZE)) == NULL)
+		err(1, "malloc");
+	else if ((chunk = malloc(CHUNK_MAXSIZE)) == NULL)
+		err(1, "malloc");
+
+	/* stand-ins for vendored cores: incompressible, but
+	 * the same every time
+	 */
+	for (i = 0; i < TEST_DATASIZE; i++) {
+		state = state * 1103515245 + 12345;
+		data[i] = state >> 16;
+	}
+
+	iov[0].iov_base = data;
+	iov[0].iov_len = TEST_DATASIZE;
+
+	if ((original = netmsg_build(NETOP_SENDFILE, TEST_LABEL, iov, 1)) == NULL)
+		err(1, "netmsg_build");
+
+	if (cache_insert(original, hash) < 0)
+		errx(1, "cache_insert failed");
+
+	/* whole bundles are only hashed, never cut up */
+	wire = flatten(original, &wiresize);
+	len = cache_chunklen(wire, wiresize);
+	SHA256Data(wire, len, hash);
+
+	if (cache_readchunk(hash, chunk, len) == 0 || errno != ENOENT) {
+		warnx("cache_insert filled the chunk store");
+		goto end;
+	}
+
+	putchunks(wire, wiresize);
+	free(wire);
+
+	/* the same bundle again, with a few bytes spliced into
+	 * the middle - every later byte moves along
+	 */
+	iov[0].iov_len = TEST_DATASIZE / 2;
+	iov[1].iov_base = TEST_EDIT;
+	iov[1].iov_len = strlen(TEST_EDIT);
+	iov[2].iov_base = data + TEST_DATASIZE / 2;
+	iov[2].iov_len = TEST_DATASIZE - TEST_DATASIZE / 2;
+
+	if ((edited = netmsg_build(NETOP_SENDFILE, TEST_LABEL, iov, 3)) == NULL)
+		err(1, "netmsg_build");
+
+	wire = flatten(edited, &wiresize);
+
+	for (offset = 0; offset < wiresize; offset += len) {
+		len = cache_chunklen(wire + offset, wiresize - offset);
+
+		if (len == 0 || len > CHUNK_MAXSIZE) {
+			warnx("chunk at %zu is %zu bytes", offset, len);
+			goto end;
+		} else if (len < CHUNK_MINSIZE && offset + len < wiresize) {
+			warnx("chunk at %zu is only %zu bytes", offset, len);
+			goto end;
+		}
+
+		SHA256Data(wire + offset, len, hash);
+
+		if (cache_readchunk(hash, chunk, len) == 0) {
+			if (memcmp(chunk, wire + offset, len) != 0) {
+				warnx("chunk at %zu came back different", offset);
+				goto end;
+			}
+
+			reused += len;
+		} else if (errno != ENOENT) {
+			warn("cache_readchunk");
+			goto end;
+		}
+	}
+
+	/* all but the chunks around the edit and the
+	 * header, whose size changed, should be there
+	 */
+	if (reused < wiresize / 10 * 9) {
+		warnx("only %zu of %zu bytes were already cached", reused, wiresize);
+		goto end;
+	}
+
+	/* and nobody gets to slip in a chunk under the wrong name */
+	memset(chunk, 0, CHUNK_MINSIZE);
+
+	if (cache_putchunk(hash, chunk, CHUNK_MINSIZE) == 0 || errno != EINVAL) {
+		warnx("cache took a chunk that does not match its hash");
+		goto end;
+	}
+
+	status = 0;
+end:
+	netmsg_teardown(original);
+	if (edited != NULL) netmsg_teardown(edited);
+
+	free(data);
+	free(chunk);
+	free(wire);
+
+	return status;
+}
@@ -0,0 +1,145 @@
+/* child commands run alongside the event loop rather
+ * than blocking it: several slow commands finish in about
+ * the time of one, timers keep firing meanwhile, and exit
+ * statuses make it back to the right callback
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <err.h>
+#include <event.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "workerd.h"
+
+#define TEST_SLEEPERS		4
+#define TEST_TICKUSEC		50000
+#define TEST_MINTICKS		10
+#define TEST_MAXSECONDS		2.0
+
+static void	sleeperdone(int, void *);
+static void	failerdone(int, void *);
+static void	drained(int, void *);
+static void	tick(int, short, void *);
+static double	elapsed(struct timeval *);
+
+static struct event	ticker;
+static struct timeval	start;
+
+static int	sleepersdone = 0, failerstatus = -1, ticks = 0, draindone = 0;
+int		debug = 1, verbose = 1;
+
+int myproc() { return PROC_ENGINE; }
+
+static double
+elapsed(struct timeval *from)
+{
+	struct timeval	now, diff;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, from, &diff);
+
+	return diff.tv_sec + diff.tv_usec / 1000000.0;
+}
+
+static void
+tick(int fd, short event, void *arg)
+{
+	struct timeval	tv;
+
+	ticks++;
+
+	tv.tv_sec = 0;
+	tv.tv_usec = TEST_TICKUSEC;
+	evtimer_add(&ticker, &tv);
+
+	(void)fd;
+	(void)event;
+	(void)arg;
+}
+
+static void
+failerdone(int status, void *arg)
+{
+	if (arg != &failerstatus)
+		errx(1, "failer callback got the wrong argument");
+
+	failerstatus = status;
+}
+
+static void
+sleeperdone(int status, void *arg)
+{
+	double	took;
+
+	if (status != 0)
+		errx(1, "sleeper %d exited with status %d", *(int *)arg, status);
+
+	if (++sleepersdone < TEST_SLEEPERS) return;
+
+	took = elapsed(&start);
+	warnx("%d sleepers done in %.2fs, %d ticks meanwhile", TEST_SLEEPERS, took, ticks);
+
+	if (took > TEST_MAXSECONDS)
+		errx(1, "sleepers ran one after another");
+	else if (ticks < TEST_MINTICKS)
+		errx(1, "event loop was blocked while commands ran");
+	else if (failerstatus != 3)
+		errx(1, "failer reported status %d, expected 3", failerstatus);
+
+	/* shutdown path: nothing left to run the loop */
+	if (cmd_run(drained, NULL, "/bin/sleep", "1", NULL) < 0)
+		err(1, "cmd_run");
+
+	cmd_drain();
+
+	if (!draindone || cmd_pending())
+		errx(1, "cmd_drain returned with commands outstanding");
+
+	warnx("all good");
+	exit(0);
+}
+
+static void
+drained(int status, void *arg)
+{
+	draindone = 1;
+
+	(void)status;
+	(void)arg;
+}
+
+int
+main()
+{
+	static int	ids[TEST_SLEEPERS];
+	struct timeval	tv;
+	int		i;
+
+	event_init();
+	cmd_init();
+
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < TEST_SLEEPERS; i++) {
+		ids[i] = i;
+		if (cmd_run(sleeperdone, &ids[i], "/bin/sleep", "1", NULL) < 0)
+			err(1, "cmd_run");
+	}
+
+	if (cmd_run(failerdone, &failerstatus, "/bin/sh", "-c", "exit 3", NULL) < 0)
+		err(1, "cmd_run");
+
+	tv.tv_sec = 0;
+	tv.tv_usec = TEST_TICKUSEC;
+
+	evtimer_set(&ticker, tick, NULL);
+	evtimer_add(&ticker, &tv);
+
+	event_dispatch();
+
+	/* never reached */
+	return 1;
+}
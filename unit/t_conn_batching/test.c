@@ -0,0 +1,207 @@
+/* benchmark: socket sends per delivered line, with lines trickled
+ * out one per event loop turn (what msgqueue used to cost for every
+ * message) versus queued in a burst and batched by conn_dosend
+ */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "workerd.h"
+
+#define TEST_PORT		8124
+#define TEST_TIMEOUT		60
+#define TEST_NLINES		2000
+#define TEST_LINE		"the quick brown fox jumps over the lazy dog"
+
+/* 1 byte opcode + 8 byte label size + the label */
+#define TEST_LINESIZE		(sizeof(uint8_t) + sizeof(uint64_t) + strlen(TEST_LINE))
+
+#define PHASE_TRICKLE		0
+#define PHASE_BURST		1
+#define PHASE_MAX		2
+
+static void	accepted(struct conn *);
+static void	getmsg(struct conn *, struct netmsg *);
+static void	trickle(int, short, void *);
+static void	killtest(int, short, void *);
+
+static void	sendline(void);
+static long	sendcount(void);
+static void	runclient(void);
+
+static struct event	trickletimer;
+static struct event	endtimer;
+
+static struct conn	*client = NULL;
+static int		 phase = PHASE_TRICKLE, trickled = 0;
+static long		 phasestart, phasesends[PHASE_MAX];
+
+int		 debug = 1, verbose = 1;
+
+int myproc() { return PROC_ENGINE; }
+
+static long
+sendcount(void)
+{
+	struct rusage	ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+		err(1, "getrusage");
+
+	return ru.ru_msgsnd;
+}
+
+static void
+sendline(void)
+{
+	struct netmsg	*line;
+
+	if ((line = netmsg_build(NETOP_SENDLINE, TEST_LINE, NULL, 0)) == NULL)
+		err(1, "netmsg_build");
+
+	conn_send(client, line);
+}
+
+static void
+trickle(int fd, short event, void *arg)
+{
+	struct timeval	tv = { 0, 0 };
+
+	sendline();
+
+	/* give the send event a chance to fire before the next one */
+	if (++trickled < TEST_NLINES)
+		evtimer_add(&trickletimer, &tv);
+
+	(void)fd;
+	(void)event;
+	(void)arg;
+}
+
+static void
+accepted(struct conn *c)
+{
+	struct timeval	tv = { 0, 0 };
+
+	client = c;
+	conn_receive(c, getmsg);
+
+	phasestart = sendcount();
+	evtimer_add(&trickletimer, &tv);
+}
+
+/* the client acks once it has read a whole phase worth of lines */
+static void
+getmsg(struct conn *c, struct netmsg *m)
+{
+	int	i;
+
+	if (m == NULL || netmsg_gettype(m) != NETOP_ACK)
+		errx(1, "client sent something other than an ack");
+
+	phasesends[phase] = sendcount() - phasestart;
+	warnx("%s: %ld sends for %d lines, %.3f sends per line",
+		(phase == PHASE_TRICKLE) ? "one per event" : "batched",
+		phasesends[phase], TEST_NLINES,
+		(double)phasesends[phase] / TEST_NLINES);
+
+	if (++phase == PHASE_MAX) {
+		if (phasesends[PHASE_BURST] * 4 > phasesends[PHASE_TRICKLE])
+			errx(1, "batching saved less than expected");
+
+		conn_teardown(c);
+		exit(0);
+	}
+
+	phasestart = sendcount();
+	for (i = 0; i < TEST_NLINES; i++)
+		sendline();
+}
+
+static void
+runclient(void)
+{
+	struct sockaddr_in	 sa;
+	char			*buf;
+	size_t			 phasesize, have;
+	ssize_t			 n;
+	uint8_t			 ack = NETOP_ACK;
+	int			 s, i;
+
+	phasesize = TEST_NLINES * TEST_LINESIZE;
+	if ((buf = malloc(phasesize)) == NULL)
+		err(1, "malloc");
+
+	memset(&sa, 0, sizeof(struct sockaddr_in));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(TEST_PORT);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		err(1, "socket");
+	else if (connect(s, (struct sockaddr *)&sa, sizeof(struct sockaddr_in)) < 0)
+		err(1, "connect");
+
+	for (i = 0; i < PHASE_MAX; i++) {
+		for (have = 0; have < phasesize; have += n)
+			if ((n = read(s, buf + have, phasesize - have)) <= 0)
+				err(1, "read");
+
+		if (write(s, &ack, sizeof(uint8_t)) != sizeof(uint8_t))
+			err(1, "write ack");
+	}
+
+	free(buf);
+	close(s);
+	_exit(0);
+}
+
+static void
+killtest(int fd, short event, void *arg)
+{
+	errx(1, "test maximum duration exceeded, exiting");
+
+	(void)fd;
+	(void)event;
+	(void)arg;
+}
+
+int
+main()
+{
+	struct timeval	tv;
+	pid_t		pid;
+
+	event_init();
+	conn_listen(accepted, TEST_PORT, CONN_MODE_TCP);
+
+	if ((pid = fork()) < 0)
+		err(1, "fork");
+	else if (pid == 0)
+		runclient();
+
+	tv.tv_sec = TEST_TIMEOUT;
+	tv.tv_usec = 0;
+
+	evtimer_set(&endtimer, killtest, NULL);
+	evtimer_add(&endtimer, &tv);
+
+	evtimer_set(&trickletimer, trickle, NULL);
+	event_dispatch();
+
+	/* never reached */
+	return 1;
+}
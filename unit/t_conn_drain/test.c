@@ -0,0 +1,179 @@
+/* the drain callback fires once everything queued on a
+ * connection has been written out, and not before: the
+ * client holds off reading until the server has heard
+ * from it, by which point the socket buffers are long full
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <event.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "workerd.h"
+
+#define TEST_PORT		8125
+#define TEST_TIMEOUT		60
+#define TEST_NMSGS		8
+#define TEST_DATASIZE		(1024 * 1024)
+#define TEST_LABEL		"0"
+
+/* opcode, label size, label, data size, data */
+#define TEST_MSGSIZE		(1 + 2 * sizeof(uint64_t) + strlen(TEST_LABEL) + TEST_DATASIZE)
+
+static void	accepted(struct conn *);
+static void	getmsg(struct conn *, struct netmsg *);
+static void	drained(struct conn *);
+static void	killtest(int, short, void *);
+
+static void	runclient(void);
+
+static struct event	endtimer;
+
+static int		 heard = 0, drains = 0;
+static pid_t		 pid;
+
+int		 debug = 1, verbose = 1;
+
+int myproc() { return PROC_ENGINE; }
+
+static void
+accepted(struct conn *c)
+{
+	struct netmsg	*m;
+	struct iovec	 iov;
+	char		*data;
+	int		 i;
+
+	if ((data = calloc(TEST_DATASIZE, sizeof(char))) == NULL)
+		err(1, "calloc");
+
+	iov.iov_base = data;
+	iov.iov_len = TEST_DATASIZE;
+
+	conn_setdraincb(c, drained);
+	conn_receive(c, getmsg);
+
+	for (i = 0; i < TEST_NMSGS; i++) {
+		if ((m = netmsg_build(NETOP_SENDLINES, TEST_LABEL, &iov, 1)) == NULL)
+			err(1, "netmsg_build");
+
+		conn_send(c, m);
+	}
+
+	free(data);
+}
+
+static void
+getmsg(struct conn *c, struct netmsg *m)
+{
+	if (m == NULL || netmsg_gettype(m) != NETOP_ACK)
+		errx(1, "client sent something other than an ack");
+	else if (drains > 0)
+		errx(1, "drained before the client started reading");
+
+	heard = 1;
+	(void)c;
+}
+
+static void
+drained(struct conn *c)
+{
+	int	status;
+
+	if (!heard)
+		errx(1, "drained before the client started reading");
+	else if (++drains > 1)
+		errx(1, "drained %d times for one batch", drains);
+
+	if (waitpid(pid, &status, 0) < 0)
+		err(1, "waitpid");
+	else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		errx(1, "client failed to read everything back");
+
+	conn_teardown(c);
+	exit(0);
+}
+
+static void
+runclient(void)
+{
+	struct sockaddr_in	 sa;
+	char			*buf;
+	size_t			 total, have;
+	ssize_t			 n;
+	uint8_t			 ack = NETOP_ACK;
+	int			 s;
+
+	total = TEST_NMSGS * TEST_MSGSIZE;
+	if ((buf = malloc(TEST_DATASIZE)) == NULL)
+		err(1, "malloc");
+
+	memset(&sa, 0, sizeof(struct sockaddr_in));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(TEST_PORT);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		err(1, "socket");
+	else if (connect(s, (struct sockaddr *)&sa, sizeof(struct sockaddr_in)) < 0)
+		err(1, "connect");
+
+	/* let the server fill up everything in between first */
+	sleep(1);
+
+	if (write(s, &ack, sizeof(uint8_t)) != sizeof(uint8_t))
+		err(1, "write ack");
+
+	for (have = 0; have < total; have += n)
+		if ((n = read(s, buf, TEST_DATASIZE)) <= 0)
+			err(1, "read");
+
+	free(buf);
+	close(s);
+	_exit(0);
+}
+
+static void
+killtest(int fd, short event, void *arg)
+{
+	errx(1, "test maximum duration exceeded, exiting");
+
+	(void)fd;
+	(void)event;
+	(void)arg;
+}
+
+int
+main()
+{
+	struct timeval	tv;
+
+	event_init();
+	conn_listen(accepted, TEST_PORT, CONN_MODE_TCP);
+
+	if ((pid = fork()) < 0)
+		err(1, "fork");
+	else if (pid == 0)
+		runclient();
+
+	tv.tv_sec = TEST_TIMEOUT;
+	tv.tv_usec = 0;
+
+	evtimer_set(&endtimer, killtest, NULL);
+	evtimer_add(&endtimer, &tv);
+
+	event_dispatch();
+
+	/* never reached */
+	return 1;
+}
@@ -0,0 +1,251 @@
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <err.h>
+#include <errno.h>
+#include <event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "workerd.h"
+
+#define TEST_KEY	1
+#define TEST_REPLAYKEY	2
+#define TEST_BUNDLE	"5891b5b522d5df086d0ff0b110fbd9d21bb4fc7163af34d08286a2e846f6be03"
+#define TEST_LINES	100
+#define TEST_FILEDATA	"module top(); endmodule\n"
+#define TEST_FILES	(VM_FILEDEPTH * 2)
+#define TEST_STREAMS	8
+#define TEST_STREAMSIZE	(VM_BYTEWINDOW / 4)
+
+int	debug = 1, verbose = 1;
+
+int myproc() { return PROC_ENGINE; }
+
+static void	replay_print(uint32_t, char *);
+static void	replay_readline(uint32_t);
+static void	replay_commitfile(uint32_t, struct netmsg *);
+static void	replay_stream(uint32_t, struct netmsg *);
+static void	replay_filepart(uint32_t, struct netmsg *);
+static void	replay_signaldone(uint32_t);
+static void	replay_reporterror(uint32_t, char *);
+
+static struct vm_interface vmi = {	.print = replay_print,
+					.readline = replay_readline,
+					.commitfile = replay_commitfile,
+					.stream = replay_stream,
+					.filepart = replay_filepart,
+					.signaldone = replay_signaldone,
+					.reporterror = replay_reporterror };
+
+static uint64_t	received = 0;
+static int	lines = 0, files = 0, streams = 0, done = 0, failed = 0;
+
+/* since the last round of acks */
+static int	filesout = 0;
+static uint64_t	bytesout = 0;
+
+static void
+replay_print(uint32_t key, char *line)
+{
+	char	expected[32];
+
+	snprintf(expected, sizeof(expected), "line %d", lines++);
+	if (key != TEST_REPLAYKEY || strcmp(line, expected) != 0) {
+		warnx("got line '%s' for key %u, expected '%s'", line, key, expected);
+		failed = 1;
+	}
+
+	bytesout += strlen(line);
+	received++;
+}
+
+static void
+replay_commitfile(uint32_t key, struct netmsg *m)
+{
+	char		*data;
+	uint64_t	 size;
+
+	data = netmsg_getdata(m, &size);
+	if (data == NULL || size != strlen(TEST_FILEDATA) ||
+	    memcmp(data, TEST_FILEDATA, size) != 0) {
+		warnx("replayed file does not match");
+		failed = 1;
+	}
+
+	free(data);
+	files++;
+	filesout++;
+	received++;
+
+	(void)key;
+}
+
+static void
+replay_signaldone(uint32_t key)
+{
+	done = 1;
+	(void)key;
+}
+
+static void
+replay_reporterror(uint32_t key, char *error)
+{
+	warnx("replay reported error: %s", error);
+	failed = 1;
+	(void)key;
+}
+
+static void
+replay_readline(uint32_t key)
+{
+	failed = 1;
+	(void)key;
+}
+
+static void
+replay_stream(uint32_t key, struct netmsg *m)
+{
+	if (netmsg_getdatasize(m) != TEST_STREAMSIZE) {
+		warnx("replayed stream has %llu bytes, expected %d",
+			netmsg_getdatasize(m), TEST_STREAMSIZE);
+		failed = 1;
+	}
+
+	bytesout += netmsg_getdatasize(m);
+	streams++;
+	received++;
+
+	(void)key;
+}
+
+static void
+replay_filepart(uint32_t key, struct netmsg *m)
+{
+	failed = 1;
+	(void)key;
+	(void)m;
+}
+
+int
+main()
+{
+	struct netmsg	*file, *stream;
+	struct iovec	 iov;
+	static char	 output[TEST_STREAMSIZE];
+	char		 line[32];
+	uint64_t	 acked = 0;
+	int		 i, fd, status = -1;
+
+	event_init();
+	memo_init();
+
+	/* nothing kept yet */
+	if ((fd = memo_lookup(TEST_BUNDLE)) >= 0 || errno != ENOENT) {
+		warnx("found a transcript before any was made");
+		goto end;
+	}
+
+	/* a job that asks for input never makes it in */
+	memo_record(TEST_KEY, TEST_BUNDLE);
+	memo_recordline(TEST_KEY, "what is your name?");
+	memo_abandon(TEST_KEY);
+	memo_commit(TEST_KEY);
+
+	if ((fd = memo_lookup(TEST_BUNDLE)) >= 0) {
+		warnx("kept a transcript for an abandoned job");
+		goto end;
+	}
+
+	/* but a clean run does */
+	memo_record(TEST_KEY, TEST_BUNDLE);
+
+	for (i = 0; i < TEST_LINES; i++) {
+		snprintf(line, sizeof(line), "line %d", i);
+		memo_recordline(TEST_KEY, line);
+	}
+
+	iov.iov_base = TEST_FILEDATA;
+	iov.iov_len = strlen(TEST_FILEDATA);
+
+	if ((file = netmsg_build(NETOP_SENDFILE, "top.v", &iov, 1)) == NULL)
+		err(1, "netmsg_build");
+
+	for (i = 0; i < TEST_FILES; i++)
+		memo_recordmsg(TEST_KEY, file);
+
+	netmsg_teardown(file);
+
+	memset(output, 'x', sizeof(output));
+	iov.iov_base = output;
+	iov.iov_len = sizeof(output);
+
+	if ((stream = netmsg_build(NETOP_STREAM, "stdout", &iov, 1)) == NULL)
+		err(1, "netmsg_build");
+
+	for (i = 0; i < TEST_STREAMS; i++)
+		memo_recordmsg(TEST_KEY, stream);
+
+	netmsg_teardown(stream);
+	memo_commit(TEST_KEY);
+
+	if ((fd = memo_lookup(TEST_BUNDLE)) < 0) {
+		warn("no transcript for a finished job");
+		goto end;
+	}
+
+	/* playback stays within the window, files and bytes
+	 * included, and only finishes once everything has been
+	 * acked. nothing goes out once the window is full, so
+	 * the last message is all it can overshoot by
+	 */
+	memo_replay(TEST_REPLAYKEY, fd, vmi);
+
+	while (!done && !failed) {
+		if (received - acked > VM_LINEWINDOW) {
+			warnx("playback has %llu messages out, window is %d",
+				received - acked, VM_LINEWINDOW);
+			goto end;
+		} else if (filesout > VM_FILEDEPTH) {
+			warnx("playback has %d files out, depth is %d",
+				filesout, VM_FILEDEPTH);
+			goto end;
+		} else if (bytesout >= VM_BYTEWINDOW + TEST_STREAMSIZE) {
+			warnx("playback has %llu bytes out, window is %d",
+				bytesout, VM_BYTEWINDOW);
+			goto end;
+		} else if (received == acked) {
+			warnx("playback stalled after %llu messages", received);
+			goto end;
+		}
+
+		if (memo_injectacks(TEST_REPLAYKEY, received + 1) == 0) {
+			warnx("acked more than was sent without complaint");
+			goto end;
+		}
+
+		/* the last ack finishes playback right away */
+		acked = received;
+		filesout = 0;
+		bytesout = 0;
+
+		if (memo_injectacks(TEST_REPLAYKEY, acked) < 0)
+			err(1, "memo_injectacks");
+	}
+
+	if (failed) goto end;
+
+	if (memo_isreplaying(TEST_REPLAYKEY)) {
+		warnx("playback is still going after it finished");
+		goto end;
+	} else if (lines != TEST_LINES || files != TEST_FILES || streams != TEST_STREAMS) {
+		warnx("replayed %d lines, %d files and %d streams", lines, files, streams);
+		goto end;
+	}
+
+	status = 0;
+end:
+	return status;
+}
@@ -0,0 +1,159 @@
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "workerd.h"
+
+#define TEST_LABEL	"3"
+#define TEST_LINE	"i am a line of output, and i repeat myself a lot\n"
+#define TEST_DATASIZE	(256 * 1024)
+
+int	debug = 1, verbose = 1;
+
+int myproc() { return PROC_FRONTEND; }
+
+int
+main()
+{
+	struct netmsg	*plain = NULL, *compressed = NULL, *restored = NULL;
+	struct iovec	 iov;
+	char		*data, *label = NULL, *out = NULL;
+	uint64_t	 outsize, zsize;
+	size_t		 i, linesize;
+	int		 fatal, status = -1;
+
+	if ((data = malloc(TEST_DATASIZE)) == NULL)
+		err(1, "malloc");
+
+	linesize = strlen(TEST_LINE);
+	for (i = 0; i < TEST_DATASIZE; i++)
+		data[i] = TEST_LINE[i % linesize];
+
+	iov.iov_base = data;
+	iov.iov_len = TEST_DATASIZE;
+
+	if ((plain = netmsg_build(NETOP_SENDLINES, TEST_LABEL, &iov, 1)) == NULL)
+		err(1, "netmsg_build");
+
+	/* repetitive data comes out flagged, smaller and well formed */
+	if ((compressed = netmsg_compress(plain)) == NULL)
+		err(1, "netmsg_compress");
+
+	if (!netmsg_iscompressed(compressed)) {
+		warnx("compressed message is not flagged as such");
+		goto end;
+	} else if (netmsg_gettype(compressed) != NETOP_SENDLINES) {
+		warnx("compressed message has type %u", netmsg_gettype(compressed));
+		goto end;
+	} else if ((zsize = netmsg_getdatasize(compressed)) >= TEST_DATASIZE) {
+		warnx("compressed data is %llu bytes, no smaller than %d", zsize, TEST_DATASIZE);
+		goto end;
+	} else if (!netmsg_isvalid(compressed, &fatal)) {
+		warnx("compressed message is not valid: %s", netmsg_error(compressed));
+		goto end;
+	}
+
+	label = netmsg_getlabel(compressed);
+	if (label == NULL || strcmp(label, TEST_LABEL) != 0) {
+		warnx("compression changed label to %s", label);
+		goto end;
+	}
+
+	/* and decompress back to exactly what went in */
+	if ((restored = netmsg_decompress(compressed)) == NULL)
+		errx(1, "netmsg_decompress: %s", netmsg_error(compressed));
+
+	if (netmsg_iscompressed(restored)) {
+		warnx("decompressed message is still flagged");
+		goto end;
+	}
+
+	out = netmsg_getdata(restored, &outsize);
+	if (out == NULL || outsize != TEST_DATASIZE || memcmp(out, data, TEST_DATASIZE) != 0) {
+		warnx("decompressed data does not match the original");
+		goto end;
+	}
+
+	netmsg_teardown(restored);
+	netmsg_teardown(compressed);
+	netmsg_teardown(plain);
+	free(label);
+	free(out);
+
+	restored = compressed = NULL;
+	label = out = NULL;
+
+	/* chunks of a delta upload get the same treatment */
+	if ((plain = netmsg_build(NETOP_CHUNK, TEST_LABEL, &iov, 1)) == NULL)
+		err(1, "netmsg_build");
+
+	if ((compressed = netmsg_compress(plain)) == NULL)
+		err(1, "netmsg_compress chunk");
+
+	if (!netmsg_iscompressed(compressed) ||
+	    netmsg_gettype(compressed) != NETOP_CHUNK) {
+		warnx("compressed chunk came out as opcode %u",
+			netmsg_gettype(compressed));
+		goto end;
+	}
+
+	if ((restored = netmsg_decompress(compressed)) == NULL)
+		errx(1, "netmsg_decompress chunk: %s", netmsg_error(compressed));
+
+	out = netmsg_getdata(restored, &outsize);
+	if (out == NULL || outsize != TEST_DATASIZE || memcmp(out, data, TEST_DATASIZE) != 0) {
+		warnx("decompressed chunk does not match the original");
+		goto end;
+	}
+
+	netmsg_teardown(restored);
+	netmsg_teardown(compressed);
+	free(out);
+
+	restored = compressed = NULL;
+	out = NULL;
+
+	/* small payloads aren't worth the trouble */
+	netmsg_teardown(plain);
+	iov.iov_len = NETMSG_COMPRESSMIN - 1;
+
+	if ((plain = netmsg_build(NETOP_SENDLINES, TEST_LABEL, &iov, 1)) == NULL)
+		err(1, "netmsg_build");
+
+	if ((restored = netmsg_compress(plain)) != NULL || errno != EINVAL) {
+		warnx("small message was compressed anyway");
+		goto end;
+	}
+
+	/* and garbage claiming to be compressed is caught */
+	netmsg_teardown(plain);
+
+	if ((plain = netmsg_build(NETOP_SENDLINES | NETOP_COMPRESSED,
+	    TEST_LABEL, &iov, 1)) == NULL)
+		err(1, "netmsg_build");
+
+	if ((restored = netmsg_decompress(plain)) != NULL) {
+		warnx("decompressed garbage without complaint");
+		goto end;
+	} else if (strlen(netmsg_error(plain)) == 0) {
+		warnx("bad compressed data left no error behind");
+		goto end;
+	}
+
+	status = 0;
+end:
+	if (plain != NULL) netmsg_teardown(plain);
+	if (compressed != NULL) netmsg_teardown(compressed);
+	if (restored != NULL) netmsg_teardown(restored);
+
+	free(data);
+	free(label);
+	free(out);
+
+	return status;
+}
@@ -0,0 +1,141 @@
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <endian.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "workerd.h"
+
+#define TEST_LINE	"i am a line of output"
+
+int	debug = 1, verbose = 1;
+
+int myproc() { return PROC_FRONTEND; }
+
+static size_t
+marshalline(char *out, char *line)
+{
+	uint64_t	benamesize;
+	size_t		namesize;
+
+	namesize = strlen(line);
+	benamesize = htobe64((uint64_t)namesize);
+
+	*out = NETOP_SENDLINE;
+	memcpy(out + sizeof(uint8_t), &benamesize, sizeof(uint64_t));
+	memcpy(out + sizeof(uint8_t) + sizeof(uint64_t), line, namesize);
+
+	return sizeof(uint8_t) + sizeof(uint64_t) + namesize;
+}
+
+int
+main()
+{
+	struct netmsg	*m = NULL;
+	struct iovec	 iov[1];
+	char		 wire[2 * (MAXNAMESIZE + 9)], *label = NULL;
+	size_t		 wiresize, i;
+	int		 fatal, n, status = -1;
+
+	wiresize = marshalline(wire, TEST_LINE);
+
+	/* dribble the message in a byte at a time, and make sure
+	 * the decoder never asks for more than the message holds
+	 */
+	if ((m = netmsg_new(NETOP_SENDLINE)) == NULL)
+		err(1, "netmsg_new");
+
+	for (i = 0; i < wiresize; i++) {
+		if (netmsg_getmissing(m) == 0) {
+			warnx("decoder claimed completion after %zu of %zu bytes", i, wiresize);
+			goto end;
+		} else if (netmsg_getmissing(m) > wiresize - i) {
+			warnx("decoder asked for %llu bytes with %zu left",
+				netmsg_getmissing(m), wiresize - i);
+			goto end;
+		}
+
+		if (netmsg_write(m, wire + i, 1) != 1)
+			errx(1, "netmsg_write: %s", netmsg_error(m));
+
+		if (netmsg_isvalid(m, &fatal) != (i == wiresize - 1)) {
+			warnx("message validity wrong after %zu of %zu bytes", i + 1, wiresize);
+			goto end;
+		} else if (fatal) {
+			warnx("well formed message was fatal: %s", netmsg_error(m));
+			goto end;
+		}
+	}
+
+	if (netmsg_getmissing(m) != 0) {
+		warnx("complete message still missing %llu bytes", netmsg_getmissing(m));
+		goto end;
+	}
+
+	label = netmsg_getlabel(m);
+	if (label == NULL || strcmp(label, TEST_LINE) != 0) {
+		warnx("decoded label %s does not match %s", label, TEST_LINE);
+		goto end;
+	}
+
+	netmsg_teardown(m);
+
+	/* trailing bytes past the claimed size are not recoverable */
+	if ((m = netmsg_new(NETOP_SENDLINE)) == NULL)
+		err(1, "netmsg_new");
+
+	wire[wiresize] = NETOP_HEARTBEAT;
+
+	if (netmsg_write(m, wire, wiresize + 1) != (ssize_t)wiresize + 1)
+		errx(1, "netmsg_write: %s", netmsg_error(m));
+
+	if (netmsg_isvalid(m, &fatal) || !fatal) {
+		warnx("overlong message was not flagged as fatal");
+		goto end;
+	}
+
+	netmsg_teardown(m);
+
+	/* neither are labels with a terminator embedded in them */
+	if ((m = netmsg_new(NETOP_SENDLINE)) == NULL)
+		err(1, "netmsg_new");
+
+	wire[sizeof(uint8_t) + sizeof(uint64_t) + 2] = '\0';
+
+	if (netmsg_write(m, wire, wiresize) != (ssize_t)wiresize)
+		errx(1, "netmsg_write: %s", netmsg_error(m));
+
+	if (netmsg_isvalid(m, &fatal) || !fatal) {
+		warnx("label with embedded null was not flagged as fatal");
+		goto end;
+	}
+
+	netmsg_teardown(m);
+
+	/* built messages come out byte for byte like received ones */
+	if ((m = netmsg_build(NETOP_SENDLINE, TEST_LINE, NULL, 0)) == NULL)
+		err(1, "netmsg_build");
+
+	wiresize = marshalline(wire, TEST_LINE);
+
+	if ((n = netmsg_getiov(m, 0, iov, 1)) != 1)
+		errx(1, "netmsg_getiov: %s", netmsg_error(m));
+
+	if (iov[0].iov_len != wiresize || memcmp(iov[0].iov_base, wire, wiresize) != 0) {
+		warnx("built message does not match its wire format");
+		goto end;
+	} else if (!netmsg_isvalid(m, &fatal)) {
+		warnx("built message is not valid: %s", netmsg_error(m));
+		goto end;
+	}
+
+	status = 0;
+end:
+	if (m != NULL) netmsg_teardown(m);
+	free(label);
+
+	return status;
+}
@@ -0,0 +1,150 @@
+/* benchmark: handle lookups against a slot map versus the
+ * red-black trees it replaced, with a realistic number of
+ * live objects. also checks that stale handles stay dead
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/tree.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "workerd.h"
+
+#define TEST_LIVE	16384
+#define TEST_LOOKUPS	4194304
+#define TEST_CHURN	65536
+
+struct object {
+	uint32_t		 key;
+	RB_ENTRY(object)	 entries;
+};
+
+RB_HEAD(objecttree, object);
+
+static int	object_compare(struct object *, struct object *);
+static double	elapsed(struct timeval *);
+
+RB_PROTOTYPE_STATIC(objecttree, object, entries, object_compare)
+RB_GENERATE_STATIC(objecttree, object, entries, object_compare)
+
+int	debug = 1, verbose = 1;
+
+int myproc() { return PROC_ENGINE; }
+
+static int
+object_compare(struct object *a, struct object *b)
+{
+	int	result = 0;
+
+	if (a->key > b->key) result = 1;
+	if (a->key < b->key) result = -1;
+
+	return result;
+}
+
+static double
+elapsed(struct timeval *start)
+{
+	struct timeval	now, diff;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, start, &diff);
+
+	return diff.tv_sec + diff.tv_usec / 1000000.0;
+}
+
+int
+main()
+{
+	struct objecttree	 tree = RB_INITIALIZER(&tree);
+	struct slotmap		*sm;
+	struct object		*objects, find, *o;
+	struct timeval		 start;
+
+	uint32_t		*handles, stale, cursor = 0;
+	double			 treetime, maptime;
+	size_t			 i, which;
+
+	if ((sm = slotmap_new()) == NULL)
+		err(1, "slotmap_new");
+	else if ((objects = calloc(TEST_LIVE, sizeof(struct object))) == NULL)
+		err(1, "calloc objects");
+	else if ((handles = calloc(TEST_LIVE, sizeof(uint32_t))) == NULL)
+		err(1, "calloc handles");
+
+	for (i = 0; i < TEST_LIVE; i++) {
+		if (slotmap_insert(sm, &objects[i], &handles[i]) < 0)
+			err(1, "slotmap_insert");
+
+		objects[i].key = handles[i];
+		RB_INSERT(objecttree, &tree, &objects[i]);
+	}
+
+	/* churn so generations and the free list get exercised,
+	 * and keep one handle around that must never resolve again
+	 */
+	stale = handles[0];
+
+	for (i = 0; i < TEST_CHURN; i++) {
+		which = arc4random_uniform(TEST_LIVE);
+
+		RB_REMOVE(objecttree, &tree, &objects[which]);
+		if (slotmap_remove(sm, handles[which]) != &objects[which])
+			errx(1, "slotmap_remove returned the wrong object");
+
+		if (slotmap_insert(sm, &objects[which], &handles[which]) < 0)
+			err(1, "slotmap_insert");
+
+		objects[which].key = handles[which];
+		RB_INSERT(objecttree, &tree, &objects[which]);
+	}
+
+	if (slotmap_count(sm) != TEST_LIVE)
+		errx(1, "slotmap_count is %u, expected %u", slotmap_count(sm), TEST_LIVE);
+
+	if (stale != handles[0] && slotmap_get(sm, stale) != NULL)
+		errx(1, "stale handle %u still resolves", stale);
+
+	for (i = 0; slotmap_iterate(sm, &cursor, NULL) != NULL; i++);
+	if (i != TEST_LIVE)
+		errx(1, "iterated over %zu objects, expected %u", i, TEST_LIVE);
+
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < TEST_LOOKUPS; i++) {
+		which = (i * 7919) % TEST_LIVE;
+		find.key = handles[which];
+
+		if ((o = RB_FIND(objecttree, &tree, &find)) != &objects[which])
+			errx(1, "RB_FIND returned the wrong object");
+	}
+
+	treetime = elapsed(&start);
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < TEST_LOOKUPS; i++) {
+		which = (i * 7919) % TEST_LIVE;
+
+		if ((o = slotmap_get(sm, handles[which])) != &objects[which])
+			errx(1, "slotmap_get returned the wrong object");
+	}
+
+	maptime = elapsed(&start);
+
+	warnx("%d live handles, %d lookups", TEST_LIVE, TEST_LOOKUPS);
+	warnx("rb tree:  %.1f ns per lookup", treetime * 1e9 / TEST_LOOKUPS);
+	warnx("slot map: %.1f ns per lookup", maptime * 1e9 / TEST_LOOKUPS);
+
+	if (maptime > treetime)
+		errx(1, "slot map lookups slower than the tree they replace");
+
+	slotmap_teardown(sm);
+	free(handles);
+	free(objects);
+
+	return 0;
+}
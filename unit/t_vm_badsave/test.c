@@ -22,7 +22,7 @@
 #define TEST_FINALCONTENTLEN	1581966
 
 static void	print(uint32_t, char *);
-static void	commitfile(uint32_t, char *, char *, size_t);
+static void	commitfile(uint32_t, struct netmsg *);
 static void	fail(uint32_t, char *);
 static void	ackdone(uint32_t);
 
@@ -52,10 +52,18 @@ print(uint32_t key, char *msg)
 }
 
 static void
-commitfile(uint32_t key, char *filename, char *data, size_t datasize)
+commitfile(uint32_t key, struct netmsg *m)
 {
+	char		*filename, *data;
+	uint64_t	 datasize;
+
 	if (key != TEST_KEY) errx(1, "got error from unknown vm");
 
+	if ((filename = netmsg_getlabel(m)) == NULL)
+		errx(1, "netmsg_getlabel: %s", netmsg_error(m));
+	else if ((data = netmsg_getdata(m, &datasize)) == NULL)
+		errx(1, "netmsg_getdata: %s", netmsg_error(m));
+
 	warnx("committing %s", filename);
 
 	if (strcmp(filename, TEST_FILENAME) != 0) {
@@ -65,7 +73,7 @@ commitfile(uint32_t key, char *filename, char *data, size_t datasize)
 
 	if (TEST_FINALCONTENTLEN != datasize) {
 		vm_killall();
-		errx(1, "got bad filelength - expected %d, got %lu",
+		errx(1, "got bad filelength - expected %d, got %llu",
 			TEST_FINALCONTENTLEN,
 			datasize);
 	}
@@ -73,7 +81,8 @@ commitfile(uint32_t key, char *filename, char *data, size_t datasize)
 	committed = 1;
  	vm_injectack(vm_fromkey(key));
 
-	(void)data;
+	free(filename);
+	free(data);
 }
 
 static void
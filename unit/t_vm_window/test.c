@@ -0,0 +1,182 @@
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <event.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "workerd.h"
+
+#define TEST_TIMEOUT		60
+#define TEST_POLL_INTERVAL	1
+#define TEST_ACK_INTERVAL	100000
+#define TEST_KEY		69420
+#define TEST_LINES		200
+
+#define TEST_BUNDLENAME		"build.bundle"
+#define TEST_BUNDLEMAXSIZE	10240
+
+static void	print(uint32_t, char *);
+static void	fail(uint32_t, char *);
+static void	ackdone(uint32_t);
+
+static void	killtest(int, short, void *);
+static void	bootpoll(int, short, void *);
+static void	ackpoll(int, short, void *);
+
+static struct event     boottimer;
+static struct event	acktimer;
+static struct event	endtimer;
+
+static struct vm_interface vmi = { .print = print, .signaldone = ackdone, .reporterror = fail };
+
+static uint64_t	printed = 0, acked = 0;
+static int	ranahead = 0;
+int		debug = 1, verbose = 1;
+
+int myproc() { return PROC_ENGINE; }
+
+/* don't ack here - the vm should keep going
+ * without us until its window fills up
+ */
+static void
+print(uint32_t key, char *msg)
+{
+	if (key != TEST_KEY) errx(1, "got print request from unknown vm");
+
+	printed++;
+	warnx("from vm: %s", msg);
+
+	if (printed - acked > VM_LINEWINDOW) {
+		vm_killall();
+		errx(1, "vm ran %llu lines ahead with a window of %d",
+			printed - acked, VM_LINEWINDOW);
+	} else if (printed - acked > 1) ranahead = 1;
+}
+
+static void
+fail(uint32_t key, char *msg)
+{
+	if (key != TEST_KEY) errx(1, "got error from unknown vm");
+
+	vm_killall();
+	errx(1, "error callback: %s", msg);	
+}
+
+static void
+ackdone(uint32_t key)
+{
+	warnx("finishing up...");
+	if (key != TEST_KEY) errx(1, "got termination notification from unknown vm");
+	else if (printed != TEST_LINES) errx(1, "terminated vm after %llu lines", printed);
+	else if (acked != printed) errx(1, "terminated vm with lines outstanding");
+	else if (!ranahead) errx(1, "vm never got ahead of our acks");
+
+	vm_release(vm_fromkey(key));
+	vm_killall();
+	exit(0);
+}
+
+static void
+killtest(int fd, short event, void *arg)
+{
+	vm_killall();
+	errx(1, "test maximum duration exceeded, exiting");
+
+	(void)fd;
+	(void)event;
+	(void)arg;
+}
+
+static void
+ackpoll(int fd, short event, void *arg)
+{
+	struct timeval	 tv;
+
+	if (acked != printed) {
+		warnx("acking through line %llu", printed);
+		acked = printed;
+
+		if (vm_injectacks(vm_fromkey(TEST_KEY), acked) < 0)
+			err(1, "vm_injectacks");
+	}
+
+	tv.tv_sec = 0;
+	tv.tv_usec = TEST_ACK_INTERVAL;
+	evtimer_add(&acktimer, &tv);
+
+	(void)fd;
+	(void)event;
+	(void)arg;
+}
+
+static void
+bootpoll(int fd, short event, void *arg)
+{
+	struct timeval	 tv;
+	struct vm	*new;
+
+	new = vm_claim(TEST_KEY, vmi);
+
+	if (new != NULL) {
+		char	 data[10240];
+		size_t	 datasize;
+		int	 fd;
+
+		warnx("noticed vm online");
+
+		if ((fd = open(TEST_BUNDLENAME, O_RDONLY)) < 0)
+			err(1, "open %s", TEST_BUNDLENAME);
+
+		if ((datasize = read(fd, data, TEST_BUNDLEMAXSIZE)) < 0)
+			err(1, "read %s", TEST_BUNDLENAME);
+
+		vm_injectfile(new, TEST_BUNDLENAME, data, datasize);
+		close(fd);
+
+		tv.tv_sec = 0;
+		tv.tv_usec = TEST_ACK_INTERVAL;
+
+		evtimer_set(&acktimer, ackpoll, NULL);
+		evtimer_add(&acktimer, &tv);
+
+	} else if (errno == EAGAIN) {
+		warnx("poll...");
+		tv.tv_sec = TEST_POLL_INTERVAL;
+		tv.tv_usec = 0;
+		evtimer_add(&boottimer, &tv);
+
+	} else err(1, "vm_claim returned unexpected error");
+
+	(void)fd;
+	(void)event;
+	(void)arg;
+}
+
+int
+main()
+{
+	struct timeval tv;
+
+	event_init();
+	vm_init();
+
+	tv.tv_sec = TEST_TIMEOUT;
+	tv.tv_usec = 0;
+
+	evtimer_set(&endtimer, killtest, NULL);
+	evtimer_add(&endtimer, &tv);
+
+	tv.tv_sec = TEST_POLL_INTERVAL;
+
+	evtimer_set(&boottimer, bootpoll, NULL);
+	evtimer_add(&boottimer, &tv);
+
+	event_dispatch();
+
+	/* never reached */
+	return 1;
+}
@@ -0,0 +1,7 @@
+for i in range(20):
+	name = f"result{i}.txt"
+
+	with open(name, 'w') as f:
+		f.write(f"this is result number {i}\n")
+
+	save(name)
@@ -0,0 +1,202 @@
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <event.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "workerd.h"
+
+#define TEST_TIMEOUT		60
+#define TEST_POLL_INTERVAL	1
+#define TEST_ACK_INTERVAL	100000
+#define TEST_KEY		69420
+#define TEST_FILES		20
+
+#define TEST_BUNDLENAME		"build.bundle"
+#define TEST_BUNDLEMAXSIZE	10240
+
+static void	print(uint32_t, char *);
+static void	commitfile(uint32_t, struct netmsg *);
+static void	fail(uint32_t, char *);
+static void	ackdone(uint32_t);
+
+static void	killtest(int, short, void *);
+static void	bootpoll(int, short, void *);
+static void	ackpoll(int, short, void *);
+
+static struct event     boottimer;
+static struct event	acktimer;
+static struct event	endtimer;
+
+static struct vm_interface vmi = {	.print = print,
+					.commitfile = commitfile,
+					.signaldone = ackdone,
+					.reporterror = fail };
+
+static uint64_t	sent = 0, acked = 0;
+static int	committed = 0, pipelined = 0;
+int		debug = 1, verbose = 1;
+
+int myproc() { return PROC_ENGINE; }
+
+static void
+print(uint32_t key, char *msg)
+{
+	if (key != TEST_KEY) errx(1, "got print request from unknown vm");
+
+	sent++;
+	warnx("from vm: %s", msg);
+}
+
+/* hold onto acks, so files should pile up
+ * until there are VM_FILEDEPTH of them
+ */
+static void
+commitfile(uint32_t key, struct netmsg *m)
+{
+	char	*filename;
+
+	if (key != TEST_KEY) errx(1, "got commit request from unknown vm");
+
+	if ((filename = netmsg_getlabel(m)) == NULL)
+		errx(1, "netmsg_getlabel: %s", netmsg_error(m));
+
+	warnx("committing %s", filename);
+	free(filename);
+
+	sent++;
+	committed++;
+
+	if (sent - acked > VM_FILEDEPTH) {
+		vm_killall();
+		errx(1, "vm has %llu files outstanding with a depth of %d",
+			sent - acked, VM_FILEDEPTH);
+	} else if (sent - acked > 1) pipelined = 1;
+}
+
+static void
+fail(uint32_t key, char *msg)
+{
+	if (key != TEST_KEY) errx(1, "got error from unknown vm");
+
+	vm_killall();
+	errx(1, "error callback: %s", msg);	
+}
+
+static void
+ackdone(uint32_t key)
+{
+	warnx("finishing up...");
+	if (key != TEST_KEY) errx(1, "got termination notification from unknown vm");
+	else if (committed != TEST_FILES) errx(1, "terminated vm after %d files", committed);
+	else if (acked != sent) errx(1, "terminated vm with files outstanding");
+	else if (!pipelined) errx(1, "vm never had more than one file outstanding");
+
+	vm_release(vm_fromkey(key));
+	vm_killall();
+	exit(0);
+}
+
+static void
+killtest(int fd, short event, void *arg)
+{
+	vm_killall();
+	errx(1, "test maximum duration exceeded, exiting");
+
+	(void)fd;
+	(void)event;
+	(void)arg;
+}
+
+/* files are released one at a time, oldest first */
+static void
+ackpoll(int fd, short event, void *arg)
+{
+	struct timeval	 tv;
+
+	/* the last ack may finish the job right away */
+	if (acked != sent) {
+		warnx("acking message %llu", ++acked);
+		vm_injectack(vm_fromkey(TEST_KEY));
+	}
+
+	tv.tv_sec = 0;
+	tv.tv_usec = TEST_ACK_INTERVAL;
+	evtimer_add(&acktimer, &tv);
+
+	(void)fd;
+	(void)event;
+	(void)arg;
+}
+
+static void
+bootpoll(int fd, short event, void *arg)
+{
+	struct timeval	 tv;
+	struct vm	*new;
+
+	new = vm_claim(TEST_KEY, vmi);
+
+	if (new != NULL) {
+		char	 data[10240];
+		size_t	 datasize;
+		int	 fd;
+
+		warnx("noticed vm online");
+
+		if ((fd = open(TEST_BUNDLENAME, O_RDONLY)) < 0)
+			err(1, "open %s", TEST_BUNDLENAME);
+
+		if ((datasize = read(fd, data, TEST_BUNDLEMAXSIZE)) < 0)
+			err(1, "read %s", TEST_BUNDLENAME);
+
+		vm_injectfile(new, TEST_BUNDLENAME, data, datasize);
+		close(fd);
+
+		tv.tv_sec = 0;
+		tv.tv_usec = TEST_ACK_INTERVAL;
+
+		evtimer_set(&acktimer, ackpoll, NULL);
+		evtimer_add(&acktimer, &tv);
+
+	} else if (errno == EAGAIN) {
+		warnx("poll...");
+		tv.tv_sec = TEST_POLL_INTERVAL;
+		tv.tv_usec = 0;
+		evtimer_add(&boottimer, &tv);
+
+	} else err(1, "vm_claim returned unexpected error");
+
+	(void)fd;
+	(void)event;
+	(void)arg;
+}
+
+int
+main()
+{
+	struct timeval tv;
+
+	event_init();
+	vm_init();
+
+	tv.tv_sec = TEST_TIMEOUT;
+	tv.tv_usec = 0;
+
+	evtimer_set(&endtimer, killtest, NULL);
+	evtimer_add(&endtimer, &tv);
+
+	tv.tv_sec = TEST_POLL_INTERVAL;
+
+	evtimer_set(&boottimer, bootpoll, NULL);
+	evtimer_add(&boottimer, &tv);
+
+	event_dispatch();
+
+	/* never reached */
+	return 1;
+}